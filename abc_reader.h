@@ -0,0 +1,884 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "tune.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A reader for tunes in ABC notation (https://abcnotation.com), which streams
+// over a memory-mapped file and feeds each note straight to a TuneBuilder, so
+// a tune book never needs converting to MIDI first.
+//
+// It understands what decides which notes sound when: unit note lengths,
+// meters, tempos, key signatures (with modes and explicit accidentals),
+// accidentals that last to the end of the bar, broken rhythms, tuplets, ties,
+// chords, rests, and repeats with first and second endings. Decorations,
+// grace notes, annotations, slurs and lyrics are skipped. Only the first
+// voice of a multi-voice tune is read, and parts (P:) are read in the order
+// written.
+
+// One tune of an ABC file.
+struct AbcTune {
+  // The tune's reference number, from its X: field.
+  unsigned number = 0;
+  // Its first title, if it has one.
+  std::string title;
+  Tune tune;
+};
+
+// Notes are timed at 480 ticks per quarter note, as MIDI files commonly are,
+// so TuneBuilder treats the notes of both alike.
+constexpr int kAbcTicksPerWhole = 1920;
+
+// The most notes a chord may have.
+constexpr unsigned kAbcMaxChordNotes = 16;
+
+// Parses the fields and music of one tune, building it as it goes.
+class AbcTuneParser {
+public:
+  AbcTuneParser(AbcTune &abc, bool check_playable,
+                const TuneBuilderOptions &build_options = {})
+      : abc(abc), builder(abc.tune, build_options),
+        check_playable(check_playable) {
+    bar_accidentals.fill(kNoAccidental);
+  }
+
+  // Whether the K: field that ends the header has been read.
+  bool inBody() const { return in_body; }
+
+  // The reason the last call failed.
+  const std::string &getError() const { return error; }
+
+  // Apply a field, from a header line, a body line or an inline [X:...].
+  bool field(char name, std::string_view value) {
+    value = trim(value.substr(0, value.find('%')));
+    switch (name) {
+    case 'T':
+      if (!in_body && abc.title.empty()) {
+        abc.title = value;
+      }
+      return true;
+    case 'L':
+      return parseUnitLength(value);
+    case 'M':
+      return parseMeter(value);
+    case 'Q':
+      parseTempo(value);
+      return true;
+    case 'K':
+      if (!in_body) {
+        in_body = true;
+        if (unit_den == 0) {
+          // The default unit is a sixteenth in meters shorter than 3/4.
+          bool short_meter = 4 * meter_num < 3 * meter_den;
+          unit_num = 1;
+          unit_den = short_meter ? 16 : 8;
+        }
+      }
+      return parseKey(value);
+    case 'V':
+      return selectVoice(value);
+    default:
+      return true;
+    }
+  }
+
+  // Read one line of music.
+  bool music(std::string_view line) {
+    const char *p = line.data(), *end = p + line.size();
+    while (p < end) {
+      char c = *p;
+      if (c == '%') {
+        break;
+      }
+      if (c == '[' && p + 2 < end && isLetter(p[1]) && p[2] == ':') {
+        // An inline field.
+        const char *close = std::find(p, end, ']');
+        if (!field(p[1], std::string_view(p + 3, close - p - 3))) {
+          return false;
+        }
+        p = close + (close < end);
+        continue;
+      }
+      if (!voice_active) {
+        ++p;
+        continue;
+      }
+      if (c == '|' || c == ':' || (c == '[' && p + 1 < end && p[1] == '|')) {
+        if (!bar(p, end)) {
+          return false;
+        }
+        continue;
+      }
+      if (in_overlay) {
+        ++p;
+        continue;
+      }
+      if (c == '[' && p + 1 < end && isDigit(p[1])) {
+        // A first or second ending after a space.
+        ++p;
+        startEnding(p, end);
+        continue;
+      }
+      if (isOneOf(c, "^_=ABCDEFGabcdefg[zxZX")) {
+        if (!element(p, end)) {
+          return false;
+        }
+        continue;
+      }
+      switch (c) {
+      case '"':
+      case '!':
+      case '+':
+      case '{': {
+        // Annotations and chord symbols, decorations and grace notes.
+        char close = c == '{' ? '}' : c;
+        const char *found = std::find(p + 1, end, close);
+        p = found + (found < end);
+        continue;
+      }
+      case '>':
+      case '<':
+        p = brokenRhythm(p, end);
+        continue;
+      case '(':
+        p = tuplet(p + 1, end);
+        continue;
+      case '-':
+        if (has_pending) {
+          pending.tie = true;
+        }
+        break;
+      case '&':
+        // The rest of the bar is another voice.
+        in_overlay = true;
+        break;
+      default:
+        if (!isOneOf(c, " \t)\\`$y*.~HIJKLMNOPQRSTUVWhijklmnopqrstuvw")) {
+          error = std::string("unexpected '") + c + "'";
+          return false;
+        }
+        break;
+      }
+      ++p;
+    }
+    return true;
+  }
+
+  // Finish the tune, ending every note still sounding.
+  bool finish() {
+    if (!flushPending()) {
+      return false;
+    }
+    endNotesBefore(std::numeric_limits<int>::max());
+    return true;
+  }
+
+private:
+  static constexpr int8_t kNoAccidental = 100;
+
+  // A note, chord or rest that has been read but not yet played, because
+  // a broken rhythm or tie after it may still change it.
+  struct Element {
+    std::array<uint8_t, kAbcMaxChordNotes> pitches;
+    unsigned num_pitches = 0;
+    int ticks = 0;
+    bool tie = false;
+  };
+
+  // A note that has started and not yet ended.
+  struct Sounding {
+    unsigned note_id;
+    int end;
+    bool tied;
+  };
+
+  static bool isOneOf(char c, const char *set) {
+    return c && std::strchr(set, c);
+  }
+  static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+  static bool isLetter(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+  }
+  static bool isNoteLetter(char c) { return isOneOf(c, "ABCDEFGabcdefg"); }
+
+  static std::string_view trim(std::string_view s) {
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) {
+      s.remove_prefix(1);
+    }
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) {
+      s.remove_suffix(1);
+    }
+    return s;
+  }
+
+  static const char *readNumber(const char *p, const char *end,
+                                unsigned &value) {
+    value = 0;
+    while (p < end && isDigit(*p)) {
+      value = value * 10 + (*p++ - '0');
+    }
+    return p;
+  }
+
+  // Read a note length multiplier: "2", "3/2", "/", "//", "/4".
+  static const char *readLength(const char *p, const char *end,
+                                unsigned &num, unsigned &den) {
+    const char *start = p;
+    p = readNumber(p, end, num);
+    if (p == start) {
+      num = 1;
+    }
+    den = 1;
+    while (p < end && *p == '/') {
+      unsigned d;
+      const char *after = readNumber(p + 1, end, d);
+      den *= after == p + 1 ? 2 : d;
+      p = after;
+    }
+    return p;
+  }
+
+  bool parseUnitLength(std::string_view value) {
+    unsigned num, den;
+    const char *end = value.data() + value.size();
+    if (readLength(value.data(), end, num, den) != end || num == 0 ||
+        den == 0) {
+      error = "bad unit note length '" + std::string(value) + "'";
+      return false;
+    }
+    unit_num = num;
+    unit_den = den;
+    return true;
+  }
+
+  // A tempo is beats per minute, of a length ("1/4=120", "1/8 3/8=40") or,
+  // in older tunes, of the unit note length ("120"), and may be labelled
+  // ("\"Allegro\" 1/4=120"). It only decides which notes count as played
+  // together, so one that can't be read leaves the tempo as it was.
+  void parseTempo(std::string_view value) {
+    std::string beat_text;
+    for (size_t i = 0; i < value.size(); ++i) {
+      if (value[i] != '"') {
+        beat_text += value[i];
+      } else if ((i = value.find('"', i + 1)) == std::string_view::npos) {
+        break;
+      }
+    }
+    std::string_view rest = trim(beat_text);
+
+    // The beat, in whole notes.
+    uint64_t beat_num = unit_num, beat_den = unit_den;
+    size_t equals = rest.find('=');
+    if (equals != std::string_view::npos) {
+      beat_num = 0;
+      beat_den = 1;
+      const char *p = rest.data(), *end = p + equals;
+      while (p < end) {
+        if (*p == ' ') {
+          ++p;
+          continue;
+        }
+        unsigned num, den;
+        const char *slash = readNumber(p, end, num);
+        if (slash == p || slash == end || *slash != '/') {
+          return;
+        }
+        p = readNumber(slash + 1, end, den);
+        if (den == 0) {
+          return;
+        }
+        beat_num = beat_num * den + num * beat_den;
+        beat_den *= den;
+      }
+      rest = trim(rest.substr(equals + 1));
+    }
+
+    unsigned bpm;
+    const char *end = rest.data() + rest.size();
+    if (beat_num == 0 || readNumber(rest.data(), end, bpm) != end ||
+        bpm == 0) {
+      return;
+    }
+    builder.setTickSeconds(60.0 * beat_den /
+                           (double(beat_num) * bpm * kAbcTicksPerWhole));
+  }
+
+  bool parseMeter(std::string_view value) {
+    if (value == "C") {
+      meter_num = meter_den = 4;
+    } else if (value == "C|") {
+      meter_num = meter_den = 2;
+    } else if (value.empty() || value == "none") {
+      meter_num = meter_den = 4;
+    } else {
+      // Numerators like "2+3" add up.
+      const char *p = value.data(), *end = p + value.size();
+      unsigned num = 0, den = 0, term;
+      do {
+        p = readNumber(p + (*p == '+'), end, term);
+        num += term;
+      } while (p < end && *p == '+');
+      if (p < end && *p == '/') {
+        p = readNumber(p + 1, end, den);
+      }
+      if (p != end || num == 0 || den == 0) {
+        error = "bad meter '" + std::string(value) + "'";
+        return false;
+      }
+      meter_num = num;
+      meter_den = den;
+    }
+    return true;
+  }
+
+  bool parseKey(std::string_view value) {
+    key_accidentals.fill(0);
+    std::string_view rest = value;
+    if (value.substr(0, 4) == "none" || value.substr(0, 2) == "HP") {
+      rest = value.substr(value.substr(0, 4) == "none" ? 4 : 2);
+    } else if (value.substr(0, 2) == "Hp") {
+      // Highland pipes: sharp F and C, natural G.
+      key_accidentals[letterIndex('F')] = 1;
+      key_accidentals[letterIndex('C')] = 1;
+      rest = value.substr(2);
+    } else if (!value.empty() && value[0] >= 'A' && value[0] <= 'G') {
+      // Count the sharps (positive) or flats of the major key, then move
+      // around the circle of fifths for the mode.
+      static const int letter_fifths[] = {3, 5, 0, 2, 4, -1, 1}; // A-G
+      int fifths = letter_fifths[value[0] - 'A'];
+      rest = value.substr(1);
+      if (!rest.empty() && (rest[0] == '#' || rest[0] == 'b')) {
+        fifths += rest[0] == '#' ? 7 : -7;
+        rest.remove_prefix(1);
+      }
+      rest = trim(rest);
+      size_t mode_length = 0;
+      while (mode_length < rest.size() && isLetter(rest[mode_length])) {
+        ++mode_length;
+      }
+      if (mode_length < rest.size() && rest[mode_length] == '=') {
+        mode_length = 0; // A keyword such as clef=, not a mode.
+      }
+      std::string mode;
+      for (char c : rest.substr(0, std::min<size_t>(mode_length, 3))) {
+        mode += std::tolower(c);
+      }
+      rest.remove_prefix(mode_length);
+      if (mode == "m" || mode == "min" || mode == "aeo") {
+        fifths -= 3;
+      } else if (mode == "mix") {
+        fifths -= 1;
+      } else if (mode == "dor") {
+        fifths -= 2;
+      } else if (mode == "phr") {
+        fifths -= 4;
+      } else if (mode == "lyd") {
+        fifths += 1;
+      } else if (mode == "loc") {
+        fifths -= 5;
+      } else if (mode == "exp") {
+        fifths = 0;
+      } else if (!mode.empty() && mode != "maj" && mode != "ion") {
+        error = "unknown mode in key '" + std::string(value) + "'";
+        return false;
+      }
+      if (fifths < -7 || fifths > 7) {
+        error = "too many accidentals in key '" + std::string(value) + "'";
+        return false;
+      }
+      static const char sharps[] = "FCGDAEB";
+      for (int i = 0; i < std::abs(fifths); ++i) {
+        char letter = sharps[fifths > 0 ? i : 6 - i];
+        key_accidentals[letterIndex(letter)] = fifths > 0 ? 1 : -1;
+      }
+    } else if (!value.empty() && value[0] != '^' && value[0] != '_' &&
+               value[0] != '=') {
+      error = "unknown key '" + std::string(value) + "'";
+      return false;
+    }
+
+    // Explicit accidentals such as "^f _b" adjust the signature; other
+    // words (clef=, transpose= and the like) don't affect pitches.
+    const char *p = rest.data(), *end = p + rest.size();
+    while (p < end) {
+      if (*p == '^' || *p == '_' || *p == '=') {
+        int accidental = 0;
+        for (; p < end && (*p == '^' || *p == '_' || *p == '='); ++p) {
+          accidental += *p == '^' ? 1 : *p == '_' ? -1 : 0;
+        }
+        if (p < end && isNoteLetter(*p)) {
+          key_accidentals[letterIndex(std::toupper(*p))] = accidental;
+        }
+      }
+      while (p < end && !std::isspace(static_cast<unsigned char>(*p))) {
+        ++p;
+      }
+      while (p < end && std::isspace(static_cast<unsigned char>(*p))) {
+        ++p;
+      }
+    }
+    return true;
+  }
+
+  bool selectVoice(std::string_view value) {
+    std::string_view id = value.substr(0, value.find_first_of(" \t"));
+    if (first_voice.empty()) {
+      first_voice = id;
+    }
+    if (in_body) {
+      if (!flushPending()) {
+        return false;
+      }
+      voice_active = id == first_voice;
+    }
+    return true;
+  }
+
+  // Index of a note letter from C, for key signatures.
+  static unsigned letterIndex(char upper) {
+    return std::string_view("CDEFGAB").find(upper);
+  }
+
+  // Read a bar line, which may end or start a repeat or begin an ending.
+  bool bar(const char *&p, const char *end) {
+    bool thick = false;
+    if (*p == '[') {
+      thick = true;
+      ++p;
+    }
+    unsigned leading_colons = 0, trailing_colons = 0, bars = 0;
+    for (; p < end; ++p) {
+      if (*p == ':') {
+        ++(bars ? trailing_colons : leading_colons);
+      } else if (*p == '|') {
+        if (trailing_colons) {
+          break; // The start of the next bar line.
+        }
+        ++bars;
+      } else if (*p == ']' && bars) {
+        thick = true;
+      } else {
+        break;
+      }
+    }
+    if (bars == 0) {
+      // "::" both ends and starts a repeat.
+      trailing_colons = leading_colons > 1;
+    }
+    thick |= bars > 1;
+
+    if (!flushPending()) {
+      return false;
+    }
+    bar_accidentals.fill(kNoAccidental);
+    in_overlay = false;
+
+    if (leading_colons) {
+      repeatSection();
+    }
+    if (trailing_colons || thick) {
+      startSection();
+    }
+    if (p < end && isDigit(*p)) {
+      startEnding(p, end);
+    }
+    return true;
+  }
+
+  // Read the number list of an ending, such as "1" or "1,3".
+  void startEnding(const char *&p, const char *end) {
+    if (*p == '1') {
+      ending_begin = section.size();
+      ending_tick = now;
+    }
+    while (p < end && (isDigit(*p) || *p == ',' || *p == '-')) {
+      ++p;
+    }
+  }
+
+  void startSection() {
+    section.clear();
+    section_tick = now;
+    ending_begin = ~0u;
+  }
+
+  // Play the current section again, without its first ending.
+  void repeatSection() {
+    unsigned replay_end = std::min<size_t>(ending_begin, section.size());
+    int replay_ticks =
+        (ending_begin == ~0u ? now : ending_tick) - section_tick;
+    int shift = now - section_tick;
+    std::vector<unsigned> notes = std::move(section);
+    for (unsigned i = 0; i < replay_end; ++i) {
+      const TuneNote &note = abc.tune.notes[notes[i]];
+      startNote(note.pitch, note.tick + shift, note_ends[notes[i]] + shift,
+                false, false);
+    }
+    now += replay_ticks;
+    section = std::move(notes);
+    startSection();
+  }
+
+  const char *brokenRhythm(const char *p, const char *end) {
+    char c = *p;
+    int dots = 0;
+    for (; p < end && *p == c; ++p) {
+      ++dots;
+    }
+    if (has_pending) {
+      // ">" lengthens the first by half and halves the second; ">>" makes
+      // them three quarters longer and a quarter as long.
+      int den = 1 << dots;
+      int longer = 2 * den - 1, shorter = 1;
+      pending.ticks = pending.ticks * (c == '>' ? longer : shorter) / den;
+      next_num = c == '>' ? shorter : longer;
+      next_den = den;
+    }
+    return p;
+  }
+
+  const char *tuplet(const char *p, const char *end) {
+    if (p == end || !isDigit(*p)) {
+      return p; // A slur.
+    }
+    unsigned notes, time = 0, count = 0;
+    p = readNumber(p, end, notes);
+    if (p < end && *p == ':') {
+      p = readNumber(p + 1, end, time);
+      if (p < end && *p == ':') {
+        p = readNumber(p + 1, end, count);
+      }
+    }
+    if (time == 0) {
+      bool compound = meter_num % 3 == 0 && meter_num > 3;
+      time = notes == 3 || notes == 6 ? 2
+             : notes == 2 || notes == 4 || notes == 8 ? 3
+             : compound ? 3 : 2;
+    }
+    if (notes > 0) {
+      tuplet_notes = notes;
+      tuplet_time = time;
+      tuplet_left = count ? count : notes;
+    }
+    return p;
+  }
+
+  // Read a pitch: accidentals, letter and octave marks.
+  bool pitch(const char *&p, const char *end, uint8_t &result) {
+    int accidental = 0;
+    bool explicit_accidental = false;
+    for (; p < end && (*p == '^' || *p == '_' || *p == '='); ++p) {
+      accidental += *p == '^' ? 1 : *p == '_' ? -1 : 0;
+      explicit_accidental = true;
+    }
+    if (p == end || !isNoteLetter(*p)) {
+      error = "expected a note";
+      return false;
+    }
+    static const int semitones[] = {9, 11, 0, 2, 4, 5, 7}; // A-G
+    char letter = *p++;
+    char upper = std::toupper(letter);
+    int natural = 60 + semitones[upper - 'A'] + (letter != upper ? 12 : 0);
+    for (; p < end && (*p == '\'' || *p == ','); ++p) {
+      natural += *p == '\'' ? 12 : -12;
+    }
+    if (natural < 0 || natural > 127) {
+      error = "note out of range";
+      return false;
+    }
+    if (explicit_accidental) {
+      bar_accidentals[natural] = accidental;
+    } else if (bar_accidentals[natural] != kNoAccidental) {
+      accidental = bar_accidentals[natural];
+    } else {
+      accidental = key_accidentals[letterIndex(upper)];
+    }
+    int midi = natural + accidental;
+    if (midi < 0 || midi > 127) {
+      error = "note out of range";
+      return false;
+    }
+    result = midi;
+    return true;
+  }
+
+  // Read a note, chord or rest.
+  bool element(const char *&p, const char *end) {
+    Element e;
+    unsigned num = 1, den = 1;
+    bool rest = *p == 'z' || *p == 'x', bar_rest = *p == 'Z' || *p == 'X';
+    if (rest || bar_rest) {
+      p = readLength(p + 1, end, num, den);
+    } else if (*p == '[') {
+      // A chord takes the length of its first note.
+      for (++p; p < end && *p != ']';) {
+        if (isOneOf(*p, "^_=ABCDEFGabcdefg")) {
+          if (e.num_pitches == kAbcMaxChordNotes) {
+            error = "chord has too many notes";
+            return false;
+          }
+          if (!pitch(p, end, e.pitches[e.num_pitches])) {
+            return false;
+          }
+          unsigned note_num, note_den;
+          p = readLength(p, end, note_num, note_den);
+          if (e.num_pitches++ == 0) {
+            num = note_num;
+            den = note_den;
+          }
+        } else if (*p == '-') {
+          e.tie = true;
+          ++p;
+        } else {
+          ++p; // Decorations and spaces inside the chord.
+        }
+      }
+      if (p == end) {
+        error = "unterminated chord";
+        return false;
+      }
+      unsigned outer_num, outer_den;
+      p = readLength(p + 1, end, outer_num, outer_den);
+      num *= outer_num;
+      den *= outer_den;
+    } else {
+      if (!pitch(p, end, e.pitches[0])) {
+        return false;
+      }
+      e.num_pitches = 1;
+      p = readLength(p, end, num, den);
+    }
+    if (den == 0) {
+      error = "bad note length";
+      return false;
+    }
+
+    if (bar_rest) {
+      e.ticks = kAbcTicksPerWhole * meter_num * num / meter_den;
+    } else {
+      int64_t ticks = int64_t(kAbcTicksPerWhole) * unit_num * num;
+      int64_t divisor = int64_t(unit_den) * den;
+      if (tuplet_left) {
+        ticks *= tuplet_time;
+        divisor *= tuplet_notes;
+        --tuplet_left;
+      }
+      e.ticks = ticks * next_num / (divisor * next_den);
+      next_num = next_den = 1;
+    }
+
+    if (!flushPending()) {
+      return false;
+    }
+    pending = e;
+    has_pending = true;
+    return true;
+  }
+
+  // Play the element read last.
+  bool flushPending() {
+    if (!has_pending) {
+      return true;
+    }
+    has_pending = false;
+    for (unsigned i = 0; i < pending.num_pitches; ++i) {
+      if (!startNote(pending.pitches[i], now, now + pending.ticks,
+                     pending.tie, true)) {
+        return false;
+      }
+    }
+    now += pending.ticks;
+    return true;
+  }
+
+  // End, in time order, every sounding note that ends by `tick`.
+  void endNotesBefore(int tick) {
+    std::sort(sounding.begin(), sounding.end(),
+              [](const Sounding &a, const Sounding &b) {
+                return a.end != b.end ? a.end < b.end : a.note_id < b.note_id;
+              });
+    unsigned ended = 0;
+    for (; ended < sounding.size() && sounding[ended].end <= tick; ++ended) {
+      builder.noteOff(sounding[ended].note_id, sounding[ended].end);
+    }
+    sounding.erase(sounding.begin(), sounding.begin() + ended);
+  }
+
+  // Start a note, or extend the note tied to it.
+  bool startNote(uint8_t pitch, int tick, int end, bool tie, bool record) {
+    for (auto &s : sounding) {
+      if (s.tied && s.end == tick && abc.tune.notes[s.note_id].pitch == pitch) {
+        s.end = note_ends[s.note_id] = end;
+        s.tied = tie;
+        return true;
+      }
+    }
+    if (check_playable && !midi2note(pitch)) {
+      error = "unknown note " + std::to_string(pitch);
+      return false;
+    }
+    endNotesBefore(tick);
+    unsigned note_id = builder.noteOn(pitch, tick);
+    note_ends.push_back(end);
+    sounding.push_back({note_id, end, tie});
+    if (record) {
+      section.push_back(note_id);
+    }
+    return true;
+  }
+
+  AbcTune &abc;
+  TuneBuilder builder;
+  bool check_playable;
+  std::string error;
+  bool in_body = false;
+
+  // Lengths: the unit note length (zero until set), and the meter.
+  unsigned unit_num = 0, unit_den = 0;
+  unsigned meter_num = 4, meter_den = 4;
+
+  // Semitones to add to each letter, from C: for the key, and for each
+  // natural pitch since the last bar line.
+  std::array<int8_t, 7> key_accidentals{};
+  std::array<int8_t, 128> bar_accidentals;
+
+  // Voices: the one being read, and whether the current one is it.
+  std::string first_voice;
+  bool voice_active = true;
+  bool in_overlay = false;
+
+  // Rhythm modifiers for the next elements.
+  unsigned next_num = 1, next_den = 1;
+  unsigned tuplet_notes = 0, tuplet_time = 0, tuplet_left = 0;
+
+  Element pending;
+  bool has_pending = false;
+  int now = 0;
+  std::vector<Sounding> sounding;
+  std::vector<int> note_ends;
+
+  // The notes since the start of the current repeat, and where its first
+  // ending begins.
+  std::vector<unsigned> section;
+  int section_tick = 0;
+  unsigned ending_begin = ~0u;
+  int ending_tick = 0;
+};
+
+// Read every tune of `text`, ABC that may be a tune book, calling `visit`
+// with each as soon as it has been read. Notes are related as
+// `build_options` ask. A tune that cannot be read, or unless
+// `check_playable` is false has a note the concertina cannot play, is
+// reported on stderr under `path` and skipped. Returns false if any tune was
+// skipped.
+bool readAbcText(const char *path, std::string_view text,
+                 const std::function<void(AbcTune &)> &visit,
+                 bool check_playable = true,
+                 const TuneBuilderOptions &build_options = {}) {
+  bool ok = true;
+  AbcTune abc;
+  std::optional<AbcTuneParser> parser;
+  unsigned line_number = 0;
+  auto fail = [&] {
+    fprintf(stderr, "%s:%u: %s in tune %u\n", path, line_number,
+            parser->getError().c_str(), abc.number);
+    parser.reset();
+    ok = false;
+  };
+  auto finish = [&] {
+    if (!parser) {
+      return;
+    }
+    if (!parser->inBody()) {
+      fprintf(stderr, "%s:%u: tune %u has no K: field\n", path, line_number,
+              abc.number);
+      ok = false;
+    } else if (!parser->finish()) {
+      fail();
+      return;
+    } else {
+      visit(abc);
+    }
+    parser.reset();
+  };
+
+  const char *p = text.data();
+  const char *end = p + text.size();
+  bool in_tune = false;
+  while (p < end) {
+    const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (!eol) {
+      eol = end;
+    }
+    std::string_view line(p, eol - p);
+    p = eol + 1;
+    ++line_number;
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+
+    if (!line.empty() && line[0] == '%') {
+      continue;
+    }
+    if (line.find_first_not_of(" \t") == std::string_view::npos) {
+      // A blank line ends the tune.
+      finish();
+      in_tune = false;
+      continue;
+    }
+    bool is_field = line.size() >= 2 && line[1] == ':' &&
+                    ((line[0] >= 'A' && line[0] <= 'Z') ||
+                     (line[0] >= 'a' && line[0] <= 'z'));
+    if (is_field && line[0] == 'X') {
+      finish();
+      abc = AbcTune();
+      abc.number = std::strtoul(std::string(line.substr(2)).c_str(),
+                                nullptr, 10);
+      parser.emplace(abc, check_playable, build_options);
+      in_tune = true;
+      continue;
+    }
+    if (!in_tune || !parser) {
+      continue; // Text between tunes, or the rest of a skipped tune.
+    }
+    if (is_field) {
+      if (!parser->field(line[0], line.substr(2))) {
+        fail();
+      }
+    } else if (parser->inBody() && !parser->music(line)) {
+      fail();
+    }
+  }
+  finish();
+  return ok;
+}
+
+// Read every tune of the ABC file at `path` with readAbcText. Returns false
+// if the file cannot be read or any tune was skipped.
+bool readAbcTunes(const char *path,
+                  const std::function<void(AbcTune &)> &visit,
+                  bool check_playable = true,
+                  const TuneBuilderOptions &build_options = {}) {
+  PBQP_TRACE_SCOPE("parse");
+  MappedFile file(path);
+  if (!file.valid()) {
+    fprintf(stderr, "%s: unable to read ABC file\n", path);
+    return false;
+  }
+  return readAbcText(
+      path,
+      std::string_view(reinterpret_cast<const char *>(file.begin()),
+                       file.end() - file.begin()),
+      visit, check_playable, build_options);
+}
@@ -0,0 +1,837 @@
+// Benchmark for the fingering pipeline.
+//
+// Generates deterministic synthetic tunes, writes each to a MIDI file, and
+// times reading it back, building the PBQP graph, and the phases of the
+// reduction solver. Each tune size is reported as one JSON object per line
+// on stdout, so results can be collected across commits and plotted as
+// scaling curves. With --edits, each tune is instead edited note by note
+// through IncrementalFingering, and every edit is checked against solving
+// the edited tune from scratch. With --check, the ABC reader is run on
+// fixed cases instead and the notes it reads are checked, and the exact
+// solvers are checked against brute force on small random tunes.
+
+#include "abc_reader.h"
+#include "bnb_solver.h"
+#include "concertina.h"
+#include "graph.h"
+#include "incremental.h"
+#include "local_search.h"
+#include "midi.h"
+#include "smf_reader.h"
+#include "solver.h"
+#include "solver_utils.h"
+#include "tree_solver.h"
+#include "tune.h"
+#include "MidiFile.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <new>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+// Every allocation made through operator new is counted, so each phase can
+// report how many it made.
+static std::atomic<uint64_t> allocation_count{0};
+static std::atomic<uint64_t> allocation_bytes{0};
+
+void *operator new(std::size_t size) {
+  ++allocation_count;
+  allocation_bytes += size;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// Kept out of line, so the compiler does not see a free() of memory it
+// believes came from the library's operator new.
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+struct BenchOptions {
+  std::vector<unsigned> notes{1000, 2000, 4000, 8000, 16000};
+  // Largest number of notes in a chord.
+  unsigned polyphony = 1;
+  // Range of MIDI pitches to draw notes from, inclusive.
+  unsigned low_pitch = 0;
+  unsigned high_pitch = 127;
+  const ConcertinaLayout *layout = &CGWheatstoneLayout;
+  uint64_t seed = 1;
+  // Each size is run this many times; the fastest time of each phase is
+  // reported.
+  unsigned repeat = 3;
+  // How the readers relate the notes of a tune.
+  TuneBuilderOptions build;
+  // Time this many single-note edits of each tune instead of the pipeline.
+  unsigned edits = 0;
+  // Run the correctness checks instead of the benchmark.
+  bool check = false;
+};
+
+struct PhaseStats {
+  double seconds = 0;
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+};
+
+template <typename F> PhaseStats measure(F &&f) {
+  uint64_t count = allocation_count, bytes = allocation_bytes;
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return {std::chrono::duration<double>(end - start).count(),
+          allocation_count - count, allocation_bytes - bytes};
+}
+
+// Reset the peak resident set size, where the kernel supports it (Linux 4.0
+// and later). Elsewhere the peak covers the whole run so far.
+void resetPeakRss() {
+  if (FILE *f = fopen("/proc/self/clear_refs", "w")) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+long peakRssKb() {
+  if (FILE *f = fopen("/proc/self/status", "r")) {
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, "VmHWM:", 6) == 0) {
+        kb = strtol(line + 6, nullptr, 10);
+        break;
+      }
+    }
+    fclose(f);
+    if (kb >= 0) {
+      return kb;
+    }
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// The MIDI pitches in the configured range that the layout can play.
+std::vector<uint8_t> getPlayablePitches(const BenchOptions &options) {
+  std::vector<uint8_t> pitches;
+  for (unsigned pitch = options.low_pitch;
+       pitch <= std::min(options.high_pitch, 127u); ++pitch) {
+    if (isPlayablePitch(pitch, *options.layout)) {
+      pitches.push_back(pitch);
+    }
+  }
+  return pitches;
+}
+
+// Whether the first `size` of `pitches`, sounding together, have a fingering
+// of finite cost on `layout`.
+bool isPlayableChord(const ConcertinaLayout &layout,
+                     const std::vector<uint8_t> &pitches, unsigned size) {
+  Tune chord;
+  for (unsigned i = 0; i < size; ++i) {
+    chord.notes.push_back({pitches[i], 0});
+    for (unsigned j = 0; j < i; ++j) {
+      chord.edges.push_back({j, i, EdgeKind::Simultaneous});
+    }
+  }
+  ConcertinaGraph g(layout);
+  buildTuneGraph(g, chord);
+  llvm::PBQP::RegAlloc::CostView view(g.graph);
+  llvm::PBQP::RegAlloc::TreeDecompositionOptions exact;
+  exact.MaxWidth = size;
+  return std::isfinite(
+      view.getCost(llvm::PBQP::RegAlloc::solve(g.graph, exact)));
+}
+
+// Whether `note` can be fingered together with the notes of `notes`, which
+// are in onset order, that start no more than `window` ticks from it, not
+// counting note `skip`.
+bool isPlayableWith(const ConcertinaLayout &layout,
+                    const std::vector<TuneNote> &notes, TuneNote note,
+                    unsigned skip, double window) {
+  std::vector<uint8_t> chord{note.pitch};
+  auto first = std::lower_bound(notes.begin(), notes.end(), note.tick - window,
+                                [](const TuneNote &other, double tick) {
+                                  return other.tick < tick;
+                                });
+  for (auto it = first; it != notes.end() && it->tick <= note.tick + window;
+       ++it) {
+    if (unsigned(it - notes.begin()) != skip) {
+      chord.push_back(it->pitch);
+    }
+  }
+  return isPlayableChord(layout, chord, chord.size());
+}
+
+// Write a synthetic tune of `num_notes` notes to `path`: a sequence of chords
+// of 1 to `polyphony` distinct pitches. The generator is seeded the same way
+// for every size and draws its random numbers without library distributions,
+// so a given seed gives the same tunes on every platform, and each tune is a
+// prefix of the longer ones. If `playable` is set, chords that cannot be
+// fingered are drawn again, and after a hundred tries reduced to one note,
+// so that the whole tune has a fingering of finite cost.
+bool writeSyntheticTune(const char *path, const BenchOptions &options,
+                        const std::vector<uint8_t> &pitches,
+                        unsigned num_notes, bool playable = false) {
+  std::mt19937_64 rng(options.seed);
+  smf::MidiFile midifile;
+  midifile.setTicksPerQuarterNote(480);
+
+  std::vector<uint8_t> chord_pitches = pitches;
+  int tick = 0;
+  unsigned written = 0;
+  while (written < num_notes) {
+    unsigned chord_size = 1 + rng() % std::max(1u, options.polyphony);
+    chord_size = std::min({chord_size, num_notes - written,
+                           (unsigned)chord_pitches.size()});
+    // A partial Fisher-Yates shuffle picks distinct pitches for the chord.
+    for (unsigned tries = 0;; ++tries) {
+      for (unsigned i = 0; i < chord_size; ++i) {
+        std::swap(chord_pitches[i],
+                  chord_pitches[i + rng() % (chord_pitches.size() - i)]);
+      }
+      if (!playable || chord_size == 1 ||
+          isPlayableChord(*options.layout, chord_pitches, chord_size)) {
+        break;
+      }
+      if (tries == 100) {
+        chord_size = 1;
+        break;
+      }
+    }
+    int duration = 120 * (1 + rng() % 2);
+    for (unsigned i = 0; i < chord_size; ++i) {
+      midifile.addNoteOn(0, tick, 0, chord_pitches[i], 64);
+      midifile.addNoteOff(0, tick + duration, 0, chord_pitches[i]);
+    }
+    written += chord_size;
+    tick += duration;
+  }
+  midifile.sortTracks();
+  return midifile.write(path);
+}
+
+std::string formatCost(llvm::PBQP::PBQPNum cost) {
+  if (!std::isfinite(cost)) {
+    return "null";
+  }
+  std::ostringstream out;
+  out << cost;
+  return out.str();
+}
+
+// Benchmark one tune size, printing its result line. Returns false if the
+// tune could not be written or read back.
+bool runCase(const BenchOptions &options, const std::vector<uint8_t> &pitches,
+             unsigned num_notes, const std::string &midi_path) {
+  if (!writeSyntheticTune(midi_path.c_str(), options, pitches, num_notes)) {
+    fprintf(stderr, "%s: unable to write MIDI file\n", midi_path.c_str());
+    return false;
+  }
+
+  PhaseStats parse, midifile_parse, build, solve;
+  llvm::PBQP::RegAlloc::SolvePhaseTimes phases;
+  size_t tune_notes = 0, tune_edges = 0;
+  std::array<size_t, size_t(EdgeKind::MaxEdgeKind)> edge_counts{};
+  llvm::PBQP::PBQPNum cost = 0;
+  long peak_rss_kb = 0;
+  llvm::PBQP::RegAlloc::CostArenaUsage arena;
+  for (unsigned r = 0; r < std::max(1u, options.repeat); ++r) {
+    resetPeakRss();
+
+    Tune tune;
+    bool ok = true;
+    PhaseStats run_parse = measure(
+        [&] {
+          ok = readMappedMidiTune(midi_path.c_str(), tune, true,
+                                  options.build);
+        });
+    if (!ok) {
+      return false;
+    }
+    // The smf::MidiFile reader, for comparison.
+    Tune midifile_tune;
+    PhaseStats run_midifile_parse = measure(
+        [&] {
+          ok = readMidiTune(midi_path.c_str(), midifile_tune, true,
+                            options.build);
+        });
+    if (!ok) {
+      return false;
+    }
+    tune_notes = tune.notes.size();
+    tune_edges = tune.edges.size();
+    edge_counts = countTuneEdges(tune);
+
+    llvm::PBQP::RegAlloc::CostArena::takeUsage();
+    PhaseStats run_build, run_solve;
+    llvm::PBQP::RegAlloc::SolvePhaseTimes run_phases;
+    {
+      ConcertinaGraph g(*options.layout);
+      run_build = measure([&] { buildTuneGraph(g, tune); });
+
+      // The solver consumes the graph, so take a view of its costs first.
+      llvm::PBQP::RegAlloc::CostView view(g.graph);
+      Solution solution;
+      run_solve = measure([&] {
+        solution = llvm::PBQP::RegAlloc::solve(g.graph, &run_phases);
+      });
+      cost = view.getCost(solution);
+    }
+    // The graph, and with it its arena, is gone, so its peak is counted.
+    arena = llvm::PBQP::RegAlloc::CostArena::takeUsage();
+
+    if (r == 0 || run_parse.seconds < parse.seconds) {
+      parse = run_parse;
+    }
+    if (r == 0 || run_midifile_parse.seconds < midifile_parse.seconds) {
+      midifile_parse = run_midifile_parse;
+    }
+    if (r == 0 || run_build.seconds < build.seconds) {
+      build = run_build;
+    }
+    if (r == 0 || run_solve.seconds < solve.seconds) {
+      solve = run_solve;
+      phases = run_phases;
+    }
+    peak_rss_kb = std::max(peak_rss_kb, peakRssKb());
+  }
+
+  printf("{\"notes\": %zu, \"edges\": %zu, \"simultaneous_edges\": %zu, "
+         "\"sequential_edges\": %zu, \"polyphony\": %u, "
+         "\"pitch_range\": [%u, %u], \"layout\": \"%s\", \"seed\": %llu, "
+         "\"kernel\": \"%s\", "
+         "\"parse_ms\": %.3f, \"parse_allocs\": %llu, "
+         "\"midifile_parse_ms\": %.3f, \"midifile_parse_allocs\": %llu, "
+         "\"build_ms\": %.3f, \"build_allocs\": %llu, "
+         "\"build_bytes\": %llu, "
+         "\"setup_ms\": %.3f, \"reduce_ms\": %.3f, "
+         "\"backpropagate_ms\": %.3f, \"solve_allocs\": %llu, "
+         "\"solve_bytes\": %llu, \"arena_reserved_bytes\": %zu, "
+         "\"arena_in_use_bytes\": %zu, \"peak_rss_kb\": %ld, \"cost\": %s}\n",
+         tune_notes, tune_edges,
+         edge_counts[size_t(EdgeKind::Simultaneous)],
+         edge_counts[size_t(EdgeKind::Sequential)], options.polyphony,
+         options.low_pitch,
+         options.high_pitch, options.layout->name,
+         (unsigned long long)options.seed,
+         llvm::PBQP::RegAlloc::getMinPlusKernelName(
+             llvm::PBQP::RegAlloc::getMinPlusKernel()),
+         parse.seconds * 1e3,
+         (unsigned long long)parse.allocations,
+         midifile_parse.seconds * 1e3,
+         (unsigned long long)midifile_parse.allocations, build.seconds * 1e3,
+         (unsigned long long)build.allocations,
+         (unsigned long long)build.bytes, phases.Setup * 1e3,
+         phases.Reduce * 1e3, phases.Backpropagate * 1e3,
+         (unsigned long long)solve.allocations,
+         (unsigned long long)solve.bytes, arena.PeakBytesReserved,
+         arena.PeakBytesInUse, peak_rss_kb,
+         formatCost(cost).c_str());
+  fflush(stdout);
+  return true;
+}
+
+// `cost`, or infinity if it is NaN: a NaN cost, from adding opposite
+// infinities, is as infeasible as an infinite one.
+llvm::PBQP::PBQPNum comparableCost(llvm::PBQP::PBQPNum cost) {
+  return std::isnan(cost)
+             ? std::numeric_limits<llvm::PBQP::PBQPNum>::infinity()
+             : cost;
+}
+
+// Whether costs `a` and `b` agree, allowing for float sums taken in a
+// different order, and taking NaN as infinite.
+bool sameCost(llvm::PBQP::PBQPNum a, llvm::PBQP::PBQPNum b) {
+  a = comparableCost(a);
+  b = comparableCost(b);
+  if (!std::isfinite(a) || !std::isfinite(b)) {
+    return a == b;
+  }
+  return std::abs(a - b) <= 1e-3f * std::max(1.0f, std::abs(a));
+}
+
+// Apply `options.edits` random edits to one tune through IncrementalFingering,
+// in turn transposing, deleting and inserting a note, and print a result line
+// comparing each edit's fingering with a full solve of the edited tune. The
+// tune's chords are drawn so that it can be played, and both solve exactly,
+// as the heuristic often finds no finite fingering for a tune of chords; an
+// edit that leaves the tune without one cannot be compared. Returns false if
+// the tune could not be written or read back, if an edit left the tune
+// malformed or unplayable where a full solve could play it, or if no edit
+// could be compared.
+bool runEditCase(const BenchOptions &options,
+                 const std::vector<uint8_t> &pitches, unsigned num_notes,
+                 const std::string &midi_path) {
+  if (!writeSyntheticTune(midi_path.c_str(), options, pitches, num_notes,
+                          true)) {
+    fprintf(stderr, "%s: unable to write MIDI file\n", midi_path.c_str());
+    return false;
+  }
+  Tune tune;
+  if (!readMappedMidiTune(midi_path.c_str(), tune, true, options.build)) {
+    return false;
+  }
+  const ConcertinaLayout &layout = *options.layout;
+  SolverOptions exact;
+  exact.strategy = SolverStrategy::TreeDecomposition;
+  exact.tree_decomposition.MaxWidth = 8;
+  IncrementalFingering fingering(tune, exact, layout);
+
+  std::mt19937_64 rng(options.seed);
+  double edit_seconds = 0, max_edit_seconds = 0, full_seconds = 0;
+  uint64_t region_notes = 0, solves = 0;
+  unsigned edits = 0, cheaper = 0, costlier = 0, uncomparable = 0;
+  llvm::PBQP::PBQPNum max_extra_cost = 0, cost = 0, full_cost = 0;
+  for (unsigned attempt = 0; edits < options.edits && fingering.size() > 0 &&
+                             attempt < 10 * options.edits;
+       ++attempt) {
+    unsigned index = rng() % fingering.size();
+    const auto &notes = fingering.getNotes();
+    int shift = rng() % 2 ? 1 : -1;
+    TuneNote inserted{pitches[rng() % pitches.size()],
+                      notes[index].tick + 60};
+    // Transpose and insert only where the note's chord stays playable.
+    if (attempt % 3 == 0 &&
+        (!isPlayablePitch(notes[index].pitch + shift, layout) ||
+         !isPlayableWith(layout, notes,
+                         {uint8_t(notes[index].pitch + shift),
+                          notes[index].tick},
+                         index, tune.onset_window_ticks))) {
+      continue;
+    }
+    if (attempt % 3 == 2 && !isPlayableWith(layout, notes, inserted, ~0u,
+                                            tune.onset_window_ticks)) {
+      continue;
+    }
+    bool done = false;
+    PhaseStats edit = measure([&] {
+      switch (attempt % 3) {
+      case 0:
+        done = fingering.transposeNote(index, shift);
+        break;
+      case 1:
+        done = fingering.deleteNote(index);
+        break;
+      default:
+        done = fingering.insertNote(inserted);
+        break;
+      }
+    });
+    if (!done) {
+      continue;
+    }
+    ++edits;
+    edit_seconds += edit.seconds;
+    max_edit_seconds = std::max(max_edit_seconds, edit.seconds);
+    region_notes +=
+        fingering.getLastRegionEnd() - fingering.getLastRegionBegin();
+    solves += fingering.getLastSolveCount();
+
+    Tune edited = fingering.getTune();
+    for (const auto &edge : edited.edges) {
+      if (edge.from >= edge.to || edge.to >= edited.notes.size()) {
+        fprintf(stderr, "Edit %u left an edge from note %u to note %u\n",
+                edits, edge.from, edge.to);
+        return false;
+      }
+    }
+    for (unsigned i = 1; i < edited.notes.size(); ++i) {
+      if (edited.notes[i].tick < edited.notes[i - 1].tick) {
+        fprintf(stderr, "Edit %u left note %u out of order\n", edits, i);
+        return false;
+      }
+    }
+    std::vector<unsigned> full;
+    PhaseStats solve =
+        measure([&] { full = solveTune(edited, exact, nullptr, layout); });
+    full_seconds += solve.seconds;
+    cost = getTuneFingeringCost(edited, fingering.getSelections(), layout);
+    full_cost = getTuneFingeringCost(edited, full, layout);
+    if (std::isfinite(full_cost) && !std::isfinite(cost)) {
+      fprintf(stderr, "Edit %u left an unplayable fingering\n", edits);
+      return false;
+    }
+    if (!std::isfinite(full_cost)) {
+      ++uncomparable;
+    } else if (!sameCost(cost, full_cost)) {
+      if (cost < full_cost) {
+        ++cheaper;
+      } else {
+        ++costlier;
+        max_extra_cost = std::max(max_extra_cost, cost - full_cost);
+      }
+    }
+  }
+
+  unsigned per = std::max(1u, edits);
+  printf("{\"notes\": %u, \"polyphony\": %u, \"pitch_range\": [%u, %u], "
+         "\"layout\": \"%s\", \"seed\": %llu, \"edits\": %u, "
+         "\"edit_ms\": %.3f, \"max_edit_ms\": %.3f, \"full_solve_ms\": %.3f, "
+         "\"region_notes\": %.1f, \"solves\": %.2f, \"cheaper\": %u, "
+         "\"costlier\": %u, \"uncomparable\": %u, \"max_extra_cost\": %s, "
+         "\"cost\": %s, \"full_cost\": %s}\n",
+         num_notes, options.polyphony, options.low_pitch, options.high_pitch,
+         layout.name, (unsigned long long)options.seed, edits,
+         edit_seconds * 1e3 / per, max_edit_seconds * 1e3,
+         full_seconds * 1e3 / per, double(region_notes) / per,
+         double(solves) / per, cheaper, costlier, uncomparable,
+         formatCost(max_extra_cost).c_str(), formatCost(cost).c_str(),
+         formatCost(full_cost).c_str());
+  fflush(stdout);
+  if (edits > 0 && uncomparable == edits) {
+    fprintf(stderr, "No edit of the %u-note tune left a fingering of finite "
+                    "cost to compare\n",
+            num_notes);
+    return false;
+  }
+  return true;
+}
+
+// An ABC text and the notes expected of each of its tunes, as pitch and
+// tick.
+struct AbcCase {
+  const char *name;
+  const char *text;
+  std::vector<std::vector<TuneNote>> tunes;
+};
+
+const AbcCase kAbcCases[] = {
+    {"key signature", "X:1\nL:1/8\nK:G\nGABc dBGF|\n",
+     {{{67, 0},
+       {69, 240},
+       {71, 480},
+       {72, 720},
+       {74, 960},
+       {71, 1200},
+       {67, 1440},
+       {66, 1680}}}},
+    {"mode", "X:1\nL:1/8\nK:Ador\nB f c|\n",
+     {{{71, 0}, {78, 240}, {72, 480}}}},
+    {"bar accidentals", "X:1\nL:1/8\nK:C\n^FFG|F _B=B|\n",
+     {{{66, 0}, {66, 240}, {67, 480}, {65, 720}, {70, 960}, {71, 1200}}}},
+    {"octaves", "X:1\nL:1/8\nK:C\nC, c' C,,|\n",
+     {{{48, 0}, {84, 240}, {36, 480}}}},
+    {"unit length", "X:1\nM:6/8\nL:1/16\nK:D\nA2B|\n", {{{69, 0}, {71, 240}}}},
+    {"broken rhythm", "X:1\nL:1/8\nK:C\nA>B C<D|\n",
+     {{{69, 0}, {71, 360}, {60, 480}, {62, 600}}}},
+    {"chords", "X:1\nL:1/8\nK:C\n[CEG]2 [DF]|\n",
+     {{{60, 0}, {64, 0}, {67, 0}, {62, 480}, {65, 480}}}},
+    {"triplet", "X:1\nL:1/8\nK:C\n(3ABc d|\n",
+     {{{69, 0}, {71, 160}, {72, 320}, {74, 480}}}},
+    {"tie", "X:1\nL:1/8\nK:C\nA2-A2 B|\n", {{{69, 0}, {71, 960}}}},
+    {"rests", "X:1\nL:1/8\nK:C\nA z B Z2|c|\n",
+     {{{69, 0}, {71, 480}, {72, 4560}}}},
+    {"repeat with endings", "X:1\nL:1/8\nK:C\n|:A B|1 c:|2 d|]\n",
+     {{{69, 0}, {71, 240}, {72, 480}, {69, 720}, {71, 960}, {74, 1200}}}},
+    {"decorations", "X:1\nL:1/8\nK:C\n\"Am\"~A {g}B !trill!c|\n",
+     {{{69, 0}, {71, 240}, {72, 480}}}},
+    {"tune book",
+     "Text before the first tune\n\nX:1\nT:One\nL:1/8\nK:G\nGA|\n\n"
+     "X:2\nT:Two\nL:1/4\nK:D\nfc|\n",
+     {{{67, 0}, {69, 240}}, {{78, 0}, {73, 480}}}},
+};
+
+// Read each of kAbcCases, reporting on stderr every tune whose notes are not
+// those expected, and print a result line. Returns false if any case failed.
+bool checkAbcReader() {
+  unsigned failed = 0;
+  for (const auto &abc_case : kAbcCases) {
+    std::vector<std::vector<TuneNote>> tunes;
+    bool ok = readAbcText(abc_case.name, abc_case.text,
+                          [&](AbcTune &abc) {
+                            tunes.push_back(abc.tune.notes);
+                          },
+                          false);
+    if (ok && tunes.size() != abc_case.tunes.size()) {
+      fprintf(stderr, "%s: read %zu tunes, expected %zu\n", abc_case.name,
+              tunes.size(), abc_case.tunes.size());
+      ok = false;
+    }
+    for (unsigned t = 0; ok && t < tunes.size(); ++t) {
+      const auto &notes = tunes[t];
+      const auto &expected = abc_case.tunes[t];
+      for (unsigned i = 0; ok && i < std::max(notes.size(), expected.size());
+           ++i) {
+        if (i >= notes.size() || i >= expected.size() ||
+            notes[i].pitch != expected[i].pitch ||
+            notes[i].tick != expected[i].tick) {
+          fprintf(stderr, "%s: tune %u differs from note %u\n",
+                  abc_case.name, t + 1, i);
+          ok = false;
+        }
+      }
+    }
+    failed += !ok;
+  }
+  printf("{\"check\": \"abc\", \"cases\": %zu, \"failed\": %u}\n",
+         std::size(kAbcCases), failed);
+  fflush(stdout);
+  return failed == 0;
+}
+
+// Check the exact solvers against brute force on small random tunes drawn
+// from `pitches`: the tree-decomposition solve must find the cheapest
+// fingering, solveKBest the cheapest K distinct ones in order, or only the
+// optimum when it is not finite, and branch and bound the cheapest, proven
+// optimal. Local search must not end costlier than the heuristic's
+// fingering it starts from. Failures are
+// reported on stderr, and a result line printed. Returns false if any tune
+// failed.
+bool checkExactSolvers(const BenchOptions &options,
+                       const std::vector<uint8_t> &pitches) {
+  using namespace llvm::PBQP::RegAlloc;
+  constexpr unsigned num_tunes = 300;
+  // Tunes with more fingerings than this are not enumerated.
+  constexpr double max_fingerings = 300000;
+  std::mt19937_64 rng(options.seed);
+  TreeDecompositionOptions exact;
+  exact.MaxWidth = 8;
+  unsigned checked = 0, failed = 0;
+  for (unsigned t = 0; t < num_tunes; ++t) {
+    Tune tune;
+    unsigned num_notes = 2 + rng() % 7;
+    for (unsigned i = 0; i < num_notes; ++i) {
+      tune.notes.push_back({pitches[rng() % pitches.size()], int(i * 240)});
+    }
+    for (unsigned to = 1; to < num_notes; ++to) {
+      for (unsigned from = to > 3 ? to - 3 : 0; from < to; ++from) {
+        if (rng() % 2) {
+          tune.edges.push_back({from, to,
+                                rng() % 3 ? EdgeKind::Sequential
+                                          : EdgeKind::Simultaneous});
+        }
+      }
+    }
+
+    ConcertinaGraph g(*options.layout);
+    buildTuneGraph(g, tune);
+    CostView view(g.graph);
+    double fingerings = 1;
+    for (unsigned n = 0; n < view.getNumNodes(); ++n) {
+      fingerings *= view.getNumOptions(n);
+    }
+    if (fingerings > max_fingerings) {
+      continue;
+    }
+    ++checked;
+
+    // Every fingering's cost, counting through the selections like an
+    // odometer.
+    std::vector<llvm::PBQP::PBQPNum> finite_costs;
+    auto best_cost = std::numeric_limits<llvm::PBQP::PBQPNum>::infinity();
+    std::vector<unsigned> selections(view.getNumNodes(), 0);
+    while (true) {
+      auto cost = view.getCost(selections);
+      best_cost = std::min(best_cost, cost);
+      if (std::isfinite(cost)) {
+        finite_costs.push_back(cost);
+      }
+      unsigned n = 0;
+      for (; n < selections.size(); ++n) {
+        if (++selections[n] < view.getNumOptions(n)) {
+          break;
+        }
+        selections[n] = 0;
+      }
+      if (n == selections.size()) {
+        break;
+      }
+    }
+    std::sort(finite_costs.begin(), finite_costs.end());
+
+    TreeDecompositionStats stats;
+    auto exact_cost = view.getCost(solve(g.graph, exact, &stats));
+    if (!stats.Exact || !sameCost(exact_cost, best_cost)) {
+      fprintf(stderr, "Tune %u: exact solve cost %g, brute force %g\n", t,
+              exact_cost, best_cost);
+      ++failed;
+      continue;
+    }
+
+    unsigned k = 1 + rng() % 40;
+    auto ranked = solveKBest(g.graph, k, exact, &stats);
+    size_t expected = std::min<size_t>(k, finite_costs.size());
+    if (ranked.empty() || !std::isfinite(ranked[0].Cost)) {
+      expected = 1;
+    }
+    bool ok = stats.Exact && ranked.size() == expected &&
+              sameCost(ranked[0].Cost, best_cost);
+    std::set<std::vector<unsigned>> seen;
+    for (unsigned i = 0; ok && i < ranked.size(); ++i) {
+      const auto &solution = ranked[i];
+      ok = seen.insert(solution.Selections).second &&
+           sameCost(view.getCost(solution.Selections), solution.Cost) &&
+           (!std::isfinite(best_cost) ||
+            sameCost(solution.Cost, finite_costs[i]));
+    }
+    if (!ok) {
+      fprintf(stderr, "Tune %u: the %u best fingerings differ from brute "
+                      "force\n",
+              t, k);
+      ++failed;
+      continue;
+    }
+
+    // Branch and bound starts from the heuristic, which reduces the graph,
+    // so it runs last.
+    BranchAndBoundStats bnb_stats;
+    auto bnb_cost =
+        view.getCost(solve(g.graph, BranchAndBoundOptions{}, &bnb_stats));
+    if (!bnb_stats.Proven || !sameCost(bnb_cost, best_cost)) {
+      fprintf(stderr, "Tune %u: branch and bound cost %g%s, brute force %g\n",
+              t, bnb_cost, bnb_stats.Proven ? "" : " (not proven)",
+              best_cost);
+      ++failed;
+      continue;
+    }
+
+    // Local search on a graph of its own, since branch and bound reduced
+    // this one.
+    ConcertinaGraph local_graph(*options.layout);
+    buildTuneGraph(local_graph, tune);
+    LocalSearchStats local_stats;
+    solve(local_graph.graph, LocalSearchOptions{}, &local_stats);
+    if (comparableCost(local_stats.Cost) >
+        comparableCost(local_stats.InitialCost)) {
+      fprintf(stderr, "Tune %u: local search cost %g, up from the "
+                      "heuristic's %g\n",
+              t, local_stats.Cost, local_stats.InitialCost);
+      ++failed;
+    }
+  }
+  printf("{\"check\": \"exact solvers\", \"tunes\": %u, \"failed\": %u}\n",
+         checked, failed);
+  fflush(stdout);
+  return failed == 0;
+}
+
+std::vector<unsigned> parseSizes(const std::string &list) {
+  std::vector<unsigned> sizes;
+  std::istringstream in(list);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    if (!item.empty()) {
+      sizes.push_back(std::stoul(item));
+    }
+  }
+  return sizes;
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--notes" && i + 1 < argc) {
+      options.notes = parseSizes(argv[++i]);
+    } else if (arg == "--polyphony" && i + 1 < argc) {
+      options.polyphony = std::stoul(argv[++i]);
+    } else if (arg == "--pitch-range" && i + 1 < argc) {
+      std::string range = argv[++i];
+      auto dash = range.find('-');
+      options.low_pitch = std::stoul(range.substr(0, dash));
+      options.high_pitch = dash == std::string::npos
+                               ? options.low_pitch
+                               : std::stoul(range.substr(dash + 1));
+    } else if (arg == "--layout" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "cg") {
+        options.layout = &CGWheatstoneLayout;
+      } else if (name == "gd") {
+        options.layout = &GDWheatstoneLayout;
+      } else {
+        fprintf(stderr, "Unknown layout: %s\n", name.c_str());
+        return 1;
+      }
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = std::stoull(argv[++i]);
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      options.repeat = std::stoul(argv[++i]);
+    } else if (arg == "--onset-window" && i + 1 < argc) {
+      options.build.onset_window_ms = std::stod(argv[++i]);
+    } else if (arg == "--lookback" && i + 1 < argc) {
+      options.build.sequential_lookback = std::stoul(argv[++i]);
+    } else if (arg == "--check") {
+      options.check = true;
+    } else if (arg == "--edits" && i + 1 < argc) {
+      options.edits = std::stoul(argv[++i]);
+    } else if (arg == "--kernel" && i + 1 < argc) {
+      using llvm::PBQP::RegAlloc::MinPlusKernel;
+      std::string name = argv[++i];
+      bool found = false;
+      for (MinPlusKernel kernel :
+           {MinPlusKernel::Generic, MinPlusKernel::Scalar, MinPlusKernel::SSE,
+            MinPlusKernel::AVX2}) {
+        if (name == llvm::PBQP::RegAlloc::getMinPlusKernelName(kernel)) {
+          found = true;
+          if (!llvm::PBQP::RegAlloc::setMinPlusKernel(kernel)) {
+            fprintf(stderr, "The %s kernel is not supported on this CPU\n",
+                    name.c_str());
+            return 1;
+          }
+        }
+      }
+      if (!found) {
+        fprintf(stderr, "Unknown kernel: %s\n", name.c_str());
+        return 1;
+      }
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--notes N,N,...] [--polyphony N]\n"
+              "          [--pitch-range LOW-HIGH] [--layout cg|gd]\n"
+              "          [--seed N] [--repeat N]\n"
+              "          [--onset-window MS] [--lookback N]\n"
+              "          [--kernel generic|scalar|sse|avx2] [--edits N]\n"
+              "          [--check]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<uint8_t> pitches = getPlayablePitches(options);
+  if (pitches.empty()) {
+    fprintf(stderr, "No pitches in %u-%u are playable on the %s layout\n",
+            options.low_pitch, options.high_pitch, options.layout->name);
+    return 1;
+  }
+
+  if (options.check) {
+    bool abc_ok = checkAbcReader();
+    bool solvers_ok = checkExactSolvers(options, pitches);
+    return abc_ok && solvers_ok ? 0 : 1;
+  }
+
+  std::string midi_path =
+      (std::filesystem::temp_directory_path() /
+       ("concertina-bench-" + std::to_string(getpid()) + ".mid"))
+          .string();
+  int status = 0;
+  for (unsigned num_notes : options.notes) {
+    bool ok = options.edits > 0
+                  ? runEditCase(options, pitches, num_notes, midi_path)
+                  : runCase(options, pitches, num_notes, midi_path);
+    if (!ok) {
+      status = 1;
+      break;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::remove(midi_path, ec);
+  return status;
+}
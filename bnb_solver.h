@@ -0,0 +1,362 @@
+#pragma once
+
+#include "solver.h"
+#include "solver_utils.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+struct BranchAndBoundOptions {
+  /// Number of search threads. Zero uses one per hardware thread.
+  unsigned Threads = 0;
+  /// Stop after expanding this many search nodes. Zero means no limit.
+  uint64_t NodeLimit = 0;
+  /// Stop after this many seconds. Zero means no limit.
+  double TimeLimit = 0;
+  /// If set, stop once this becomes true.
+  const std::atomic<bool> *Cancel = nullptr;
+};
+
+struct BranchAndBoundStats {
+  /// Cost of the heuristic solution the search started from.
+  PBQPNum HeuristicCost = 0;
+  /// Cost of the returned solution.
+  PBQPNum Cost = 0;
+  uint64_t Nodes = 0;
+  /// Whether the search ran to completion, so that the returned solution is
+  /// known to be optimal. False if a limit or cancellation stopped it.
+  bool Proven = false;
+};
+
+/// Exact PBQP solver by depth-first branch and bound.
+///
+/// Nodes are assigned in node id order, which for tunes is onset order, so
+/// most of a node's neighbours are assigned shortly before or after it. The
+/// incumbent starts as the reduction heuristic's solution. A partial
+/// assignment is pruned when its cost plus a lower bound on every unassigned
+/// node reaches the incumbent. A node's bound is the minimum over its options
+/// of its own cost, its edge costs to assigned neighbours, and the minimum of
+/// each edge to an unassigned neighbour later in the order (so each edge
+/// between unassigned nodes is counted once). Assigning a node only changes
+/// the bounds of its later neighbours, which are updated incrementally.
+///
+/// The search tree is split across a work-stealing pool: a task is a prefix
+/// of the assignment, and a busy worker donates the untried options at the
+/// shallowest open level of its search whenever threads are idle.
+///
+/// As in the tree-decomposition solver, a sum of opposite infinities is
+/// treated as infeasible.
+class BranchAndBoundSolver {
+public:
+  BranchAndBoundSolver(const PBQPRAGraph &G, const BranchAndBoundOptions &Opts)
+      : View(G), Opts(Opts) {
+    unsigned N = View.getNumNodes();
+    LaterEdgeMin.resize(N);
+    for (unsigned U = 0; U < N; ++U) {
+      unsigned NumOpts = View.getNumOptions(U);
+      LaterEdgeMin[U].assign(NumOpts, 0);
+      for (const auto &A : View.adj(U)) {
+        if (A.Other < U)
+          continue;
+        for (unsigned V = 0; V < NumOpts; ++V) {
+          PBQPNum Min = infinity();
+          for (unsigned W = 0; W < View.getNumOptions(A.Other); ++W)
+            Min = std::min(Min, sanitize(CostView::getEdgeCost(A, V, W)));
+          LaterEdgeMin[U][V] = sanitize(LaterEdgeMin[U][V] + Min);
+        }
+      }
+    }
+  }
+
+  /// Search for a solution better than Incumbent, which must be a complete
+  /// solution of the graph the solver was built from.
+  Solution solve(const Solution &Incumbent,
+                 BranchAndBoundStats *Stats = nullptr) {
+    unsigned N = View.getNumNodes();
+    BestSel.resize(N);
+    for (unsigned I = 0; I < N; ++I)
+      BestSel[I] = Incumbent.getSelection(View.getNodeId(I));
+    PBQPNum HeuristicCost = sanitize(View.getCost(BestSel));
+    BestCost.store(HeuristicCost);
+    Nodes.store(0);
+    Aborted.store(false);
+    Start = std::chrono::steady_clock::now();
+
+    {
+      WorkStealingPool Pool(Opts.Threads);
+      NumThreads = Pool.size();
+      Outstanding.store(1);
+      Pool.submit([this, &Pool] { search(Pool, {}); });
+      Pool.wait();
+    }
+
+    if (Stats) {
+      Stats->HeuristicCost = HeuristicCost;
+      Stats->Cost = BestCost.load();
+      Stats->Nodes = Nodes.load();
+      Stats->Proven = !Aborted.load();
+    }
+    return View.getSolution(BestSel);
+  }
+
+private:
+  static PBQPNum infinity() { return std::numeric_limits<PBQPNum>::infinity(); }
+
+  static PBQPNum sanitize(PBQPNum C) { return std::isnan(C) ? infinity() : C; }
+
+  /// One level of a worker's depth-first search.
+  struct Frame {
+    /// Cost of the nodes assigned before this level's node.
+    PBQPNum Cost;
+    /// Untried options as (optimistic bound, option), best first.
+    std::vector<std::pair<PBQPNum, unsigned>> Options;
+    unsigned Next = 0;
+    /// Trail size before this level's current option was assigned.
+    size_t TrailMark = 0;
+  };
+
+  /// The search state of one task.
+  struct State {
+    std::vector<unsigned> Sel;
+    /// Lower bound of each unassigned node; zero once it is assigned.
+    std::vector<PBQPNum> NodeBound;
+    CostSum Remaining;
+    /// Previous NodeBound values, for undoing assignments.
+    std::vector<std::pair<unsigned, PBQPNum>> Trail;
+    uint64_t Nodes = 0;
+  };
+
+  /// Cost of option V of node D, given every node before D is assigned.
+  PBQPNum optionCost(const State &S, unsigned D, unsigned V) const {
+    PBQPNum Cost = View.getNodeCosts(D)[V];
+    for (const auto &A : View.adj(D))
+      if (A.Other < D)
+        Cost += CostView::getEdgeCost(A, V, S.Sel[A.Other]);
+    return sanitize(Cost);
+  }
+
+  /// Lower bound of unassigned node U when the first Depth nodes are
+  /// assigned.
+  PBQPNum nodeBound(const State &S, unsigned U, unsigned Depth) const {
+    PBQPNum Min = infinity();
+    for (unsigned V = 0; V < View.getNumOptions(U); ++V) {
+      PBQPNum Cost = View.getNodeCosts(U)[V] + LaterEdgeMin[U][V];
+      for (const auto &A : View.adj(U))
+        if (A.Other < Depth)
+          Cost += CostView::getEdgeCost(A, V, S.Sel[A.Other]);
+      Min = std::min(Min, sanitize(Cost));
+    }
+    return Min;
+  }
+
+  void setBound(State &S, unsigned U, PBQPNum Bound) {
+    S.Trail.push_back({U, S.NodeBound[U]});
+    S.Remaining.remove(S.NodeBound[U]);
+    S.NodeBound[U] = Bound;
+    S.Remaining.add(Bound);
+  }
+
+  void assign(State &S, unsigned D, unsigned V) {
+    S.Sel[D] = V;
+    setBound(S, D, 0);
+    for (const auto &A : View.adj(D))
+      if (A.Other > D)
+        setBound(S, A.Other, nodeBound(S, A.Other, D + 1));
+  }
+
+  void undo(State &S, size_t Mark) {
+    while (S.Trail.size() > Mark) {
+      auto [U, Bound] = S.Trail.back();
+      S.Trail.pop_back();
+      S.Remaining.remove(S.NodeBound[U]);
+      S.NodeBound[U] = Bound;
+      S.Remaining.add(Bound);
+    }
+  }
+
+  Frame makeFrame(const State &S, unsigned D, PBQPNum Cost) const {
+    CostSum Rest = S.Remaining;
+    Rest.remove(S.NodeBound[D]);
+    Frame F;
+    F.Cost = Cost;
+    for (unsigned V = 0; V < View.getNumOptions(D); ++V) {
+      PBQPNum Bound = sanitize(Cost + optionCost(S, D, V) +
+                               LaterEdgeMin[D][V] + Rest.value());
+      F.Options.push_back({Bound, V});
+    }
+    std::stable_sort(F.Options.begin(), F.Options.end(),
+                     [](const auto &A, const auto &B) {
+                       return A.first < B.first;
+                     });
+    return F;
+  }
+
+  void offer(const State &S, PBQPNum Cost) {
+    std::lock_guard<std::mutex> Lock(BestMutex);
+    if (Cost < BestCost.load()) {
+      BestCost.store(Cost);
+      BestSel = S.Sel;
+    }
+  }
+
+  /// Flush the local node count and check the limits. Returns false if the
+  /// search should stop.
+  bool checkLimits(State &S) {
+    uint64_t Total = Nodes.fetch_add(S.Nodes) + S.Nodes;
+    S.Nodes = 0;
+    if (Opts.NodeLimit && Total >= Opts.NodeLimit)
+      Aborted.store(true);
+    if (Opts.TimeLimit > 0 &&
+        std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                      Start)
+                .count() >= Opts.TimeLimit)
+      Aborted.store(true);
+    if (Opts.Cancel && Opts.Cancel->load())
+      Aborted.store(true);
+    return !Aborted.load();
+  }
+
+  /// Hand the untried options of the shallowest open level to other workers.
+  void donate(WorkStealingPool &Pool, State &S, std::vector<Frame> &Stack,
+              unsigned FirstDepth) {
+    for (unsigned L = 0; L < Stack.size(); ++L) {
+      Frame &F = Stack[L];
+      if (F.Next >= F.Options.size())
+        continue;
+      unsigned D = FirstDepth + L;
+      PBQPNum Best = BestCost.load();
+      for (unsigned I = F.Next; I < F.Options.size(); ++I) {
+        if (!(F.Options[I].first < Best))
+          break;
+        std::vector<unsigned> Prefix(S.Sel.begin(), S.Sel.begin() + D);
+        Prefix.push_back(F.Options[I].second);
+        ++Outstanding;
+        Pool.submit([this, &Pool, Prefix = std::move(Prefix)] {
+          search(Pool, Prefix);
+        });
+      }
+      F.Options.resize(F.Next);
+      return;
+    }
+  }
+
+  /// Search every completion of Prefix.
+  void search(WorkStealingPool &Pool, const std::vector<unsigned> &Prefix) {
+    runSearch(Pool, Prefix);
+    --Outstanding;
+  }
+
+  void runSearch(WorkStealingPool &Pool, const std::vector<unsigned> &Prefix) {
+    if (Aborted.load())
+      return;
+
+    unsigned N = View.getNumNodes();
+    State S;
+    S.Sel.assign(N, 0);
+    S.NodeBound.resize(N);
+    for (unsigned U = 0; U < N; ++U) {
+      S.NodeBound[U] = nodeBound(S, U, 0);
+      S.Remaining.add(S.NodeBound[U]);
+    }
+
+    PBQPNum Cost = 0;
+    for (unsigned D = 0; D < Prefix.size(); ++D) {
+      Cost = sanitize(Cost + optionCost(S, D, Prefix[D]));
+      assign(S, D, Prefix[D]);
+    }
+    if (!(sanitize(Cost + S.Remaining.value()) < BestCost.load()))
+      return;
+    if (Prefix.size() == N) {
+      offer(S, Cost);
+      return;
+    }
+
+    unsigned FirstDepth = Prefix.size();
+    std::vector<Frame> Stack;
+    Stack.push_back(makeFrame(S, FirstDepth, Cost));
+    unsigned Steps = 0;
+    while (!Stack.empty()) {
+      Frame &F = Stack.back();
+      unsigned D = FirstDepth + Stack.size() - 1;
+      if (F.Next > 0)
+        undo(S, F.TrailMark);
+
+      if ((++Steps & 1023) == 0) {
+        if (!checkLimits(S))
+          break;
+        if (Outstanding.load() < NumThreads)
+          donate(Pool, S, Stack, FirstDepth);
+      }
+
+      if (F.Next >= F.Options.size()) {
+        Stack.pop_back();
+        continue;
+      }
+
+      auto [Optimistic, V] = F.Options[F.Next++];
+      PBQPNum Best = BestCost.load();
+      if (!(Optimistic < Best)) {
+        // Options are sorted by their bound, so none of the rest can win.
+        F.Next = F.Options.size();
+        continue;
+      }
+
+      PBQPNum NewCost = sanitize(F.Cost + optionCost(S, D, V));
+      ++S.Nodes;
+      F.TrailMark = S.Trail.size();
+      assign(S, D, V);
+      if (!(sanitize(NewCost + S.Remaining.value()) < Best))
+        continue;
+      if (D + 1 == N) {
+        offer(S, NewCost);
+        continue;
+      }
+      Stack.push_back(makeFrame(S, D + 1, NewCost));
+    }
+    Nodes.fetch_add(S.Nodes);
+  }
+
+  CostView View;
+  BranchAndBoundOptions Opts;
+  /// For each node and option, the sum over edges to later nodes of the
+  /// cheapest cost of that edge.
+  std::vector<std::vector<PBQPNum>> LaterEdgeMin;
+
+  std::mutex BestMutex;
+  std::atomic<PBQPNum> BestCost{0};
+  std::vector<unsigned> BestSel;
+
+  unsigned NumThreads = 1;
+  std::atomic<unsigned> Outstanding{0};
+  std::atomic<uint64_t> Nodes{0};
+  std::atomic<bool> Aborted{false};
+  std::chrono::steady_clock::time_point Start;
+};
+
+/// Solve G by branch and bound, starting from the reduction heuristic's
+/// solution. If a limit in Opts stops the search early, the best solution
+/// found so far is returned and Stats->Proven is false.
+inline Solution solve(PBQPRAGraph &G, const BranchAndBoundOptions &Opts,
+                      BranchAndBoundStats *Stats = nullptr) {
+  if (G.empty())
+    return Solution();
+
+  BranchAndBoundSolver BBSolver(G, Opts);
+  Solution Heuristic = solve(G);
+  return BBSolver.solve(Heuristic, Stats);
+}
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <optional>
 #include <string>
-#include <unordered_map>
 
 constexpr unsigned LEFT = 0 << 4;
 constexpr unsigned RIGHT = 1 << 4;
@@ -21,7 +23,7 @@ constexpr unsigned FINGER3 = 2 << 6;
 constexpr unsigned FINGER4 = 3 << 6;
 constexpr unsigned FINGER_MASK = 0xC0;
 
-static std::array<unsigned, 4> FINGERS = {FINGER1, FINGER2, FINGER3, FINGER4};
+constexpr std::array<unsigned, 4> FINGERS = {FINGER1, FINGER2, FINGER3, FINGER4};
 
 enum class ConcertinaReed : unsigned {
   L01aPush = LEFT | PUSH | 4,
@@ -150,8 +152,12 @@ enum class ConcertinaNote : unsigned {
   MaxNote,
 };
 
-const std::unordered_multimap<ConcertinaNote, ConcertinaReed>
-    CGWheatstoneReedMapping = {
+struct ReedMapping {
+  ConcertinaNote note;
+  ConcertinaReed reed;
+};
+
+constexpr ReedMapping CGWheatstoneReeds[] = {
         {ConcertinaNote::E3, ConcertinaReed::L01aPush},
         {ConcertinaNote::F3, ConcertinaReed::L01aPull},
         {ConcertinaNote::A3, ConcertinaReed::L02aPush},
@@ -214,8 +220,7 @@ const std::unordered_multimap<ConcertinaNote, ConcertinaReed>
         {ConcertinaNote::Fsharp6, ConcertinaReed::R10Pull},
 };
 
-const std::unordered_multimap<ConcertinaNote, ConcertinaReed>
-    GDWheatstoneReedMapping = {
+constexpr ReedMapping GDWheatstoneReeds[] = {
         {ConcertinaNote::B2, ConcertinaReed::L01aPush},
         {ConcertinaNote::C2, ConcertinaReed::L01aPull},
         {ConcertinaNote::E3, ConcertinaReed::L02aPush},
@@ -278,6 +283,95 @@ const std::unordered_multimap<ConcertinaNote, ConcertinaReed>
         {ConcertinaNote::C6, ConcertinaReed::R10Pull},
 };
 
+// Upper bound on the reed|finger options for a single note. Each option is
+// stored in a byte, as reed | finger < 256.
+constexpr unsigned MAX_NOTE_OPTIONS = 16;
+
+// The playable options for one note, pre-expanded to every allowed
+// reed|finger combination, with the ergonomic cost of each.
+struct NoteOptions {
+  unsigned num_options = 0;
+  std::array<uint8_t, MAX_NOTE_OPTIONS> options{};
+  std::array<uint8_t, MAX_NOTE_OPTIONS> costs{};
+};
+
+// A concertina layout flattened into a table indexed by ConcertinaNote.
+struct ConcertinaLayout {
+  const char *name;
+  std::array<NoteOptions, (unsigned)ConcertinaNote::MaxNote> notes{};
+
+  constexpr const NoteOptions &operator[](ConcertinaNote note) const {
+    return notes[(unsigned)note];
+  }
+};
+
+// The cost of playing a note with a particular reed|finger combination.
+constexpr unsigned GetReedFingerCost(unsigned reed) {
+  unsigned cost = 0;
+  unsigned col = GetColumn((ConcertinaReed)reed);
+
+  // Apply a cost the non-home reeds.
+  if (col > 1) {
+    cost += col;
+  }
+
+  // Apply a cost to playing buttons with fingers other than the "home"
+  // finger.
+  unsigned row = GetRow((ConcertinaReed)reed);
+  unsigned finger_col = GetFingerColumn((ConcertinaReed)reed);
+  if (row == 0 && col == 3) {
+    // The L02a and R04a buttons are more easily reached by the ring
+    // finger, despite being in the pinky column.
+    if (finger_col == 3) {
+      cost += 1;
+    }
+  } else {
+    if (col != finger_col) {
+      cost += 2;
+    }
+  }
+  return cost;
+}
+
+// Expand a note->reed mapping into the per-note option table. When a note is
+// available on several reeds, later entries in the mapping are listed first.
+template <size_t N>
+constexpr ConcertinaLayout MakeLayout(const char *name,
+                                      const ReedMapping (&reeds)[N]) {
+  ConcertinaLayout layout{name};
+  for (size_t i = N; i-- > 0;) {
+    NoteOptions &note = layout.notes[(unsigned)reeds[i].note];
+    for (auto finger : FINGERS) {
+      int col = GetColumn(reeds[i].reed);
+      int finger_col = GetFingerColumn((ConcertinaReed)finger);
+      // Fingers are allowed to travel at most one column from their
+      // home column.
+      if (col - finger_col >= 2 || finger_col - col >= 2) {
+        continue;
+      }
+      if (note.num_options == MAX_NOTE_OPTIONS) {
+        throw "too many options for a single note";
+      }
+      unsigned option = (unsigned)reeds[i].reed | finger;
+      note.options[note.num_options] = option;
+      note.costs[note.num_options] = GetReedFingerCost(option);
+      ++note.num_options;
+    }
+  }
+  return layout;
+}
+
+constexpr ConcertinaLayout CGWheatstoneLayout =
+    MakeLayout("C/G Wheatstone", CGWheatstoneReeds);
+constexpr ConcertinaLayout GDWheatstoneLayout =
+    MakeLayout("G/D Wheatstone", GDWheatstoneReeds);
+
+// Every known layout, for comparing how well a tune suits each.
+constexpr const ConcertinaLayout *AllLayouts[] = {
+    &CGWheatstoneLayout,
+    &GDWheatstoneLayout,
+};
+
 const char* GetReedName(ConcertinaReed reed) {
   switch (reed) {
     case ConcertinaReed::L01aPull:
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "solver_stats.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+/// How much memory cost arenas have used, for reporting.
+struct CostArenaUsage {
+  /// Most bytes held in slabs by all live arenas together.
+  size_t PeakBytesReserved = 0;
+  /// Most bytes any one arena had handed out at once.
+  size_t PeakBytesInUse = 0;
+};
+
+/// Memory for the pooled cost entries of one graph, and their reference
+/// counts. Blocks are carved from large slabs, freed blocks are kept on a
+/// free list for their size and reused, and the slabs are released together
+/// when the arena is destroyed, so a tune's pool entries never go back to
+/// the heap one at a time.
+///
+/// The arena does not hold the cost vectors' and matrices' own buffers:
+/// those are allocated by LLVM's PBQP::Vector and PBQP::Matrix, which own
+/// them through plain new[], as are the copies the reductions build before
+/// handing new costs to the graph.
+class CostArena {
+public:
+  CostArena() = default;
+  CostArena(const CostArena &) = delete;
+  CostArena &operator=(const CostArena &) = delete;
+
+  ~CostArena() {
+    for (void *Slab : Slabs)
+      std::free(Slab);
+    LiveBytesReserved -= getBytesReserved();
+    raise(PeakInUseAll, PeakBytesInUse);
+  }
+
+  void *allocate(size_t Size) {
+    Size = roundUp(Size);
+    if (Size > MaxBlockSize)
+      return ::operator new(Size);
+    unsigned Class = Size / Granule;
+    if (Class < FreeLists.size() && FreeLists[Class]) {
+      FreeBlock *Block = FreeLists[Class];
+      FreeLists[Class] = Block->Next;
+      noteInUse(Size);
+      return Block;
+    }
+    if (size_t(End - Cur) < Size) {
+      Cur = static_cast<char *>(std::malloc(SlabSize));
+      if (!Cur)
+        throw std::bad_alloc();
+      End = Cur + SlabSize;
+      Slabs.push_back(Cur);
+      PBQP_STAT_ADD(CostArenaBytes, SlabSize);
+      raise(PeakReservedAll, LiveBytesReserved += SlabSize);
+    }
+    void *P = Cur;
+    Cur += Size;
+    noteInUse(Size);
+    return P;
+  }
+
+  void deallocate(void *P, size_t Size) {
+    Size = roundUp(Size);
+    if (Size > MaxBlockSize) {
+      ::operator delete(P);
+      return;
+    }
+    unsigned Class = Size / Granule;
+    if (Class >= FreeLists.size())
+      FreeLists.resize(Class + 1, nullptr);
+    FreeLists[Class] = new (P) FreeBlock{FreeLists[Class]};
+    BytesInUse -= Size;
+  }
+
+  /// Bytes held in slabs, whether in use or free.
+  size_t getBytesReserved() const { return Slabs.size() * SlabSize; }
+
+  /// Bytes in blocks currently handed out.
+  size_t getBytesInUse() const { return BytesInUse; }
+
+  /// The usage of every arena since the last call, which counts arenas
+  /// destroyed since then and the slabs of those still alive.
+  static CostArenaUsage takeUsage() {
+    CostArenaUsage Usage;
+    Usage.PeakBytesReserved = PeakReservedAll.exchange(LiveBytesReserved);
+    Usage.PeakBytesInUse = PeakInUseAll.exchange(0);
+    return Usage;
+  }
+
+private:
+  struct FreeBlock {
+    FreeBlock *Next;
+  };
+
+  static constexpr size_t Granule = alignof(std::max_align_t);
+  static constexpr size_t SlabSize = 64 * 1024;
+  static constexpr size_t MaxBlockSize = SlabSize / 16;
+
+  static size_t roundUp(size_t Size) {
+    return (Size + Granule - 1) / Granule * Granule;
+  }
+
+  void noteInUse(size_t Size) {
+    BytesInUse += Size;
+    if (BytesInUse > PeakBytesInUse)
+      PeakBytesInUse = BytesInUse;
+  }
+
+  static void raise(std::atomic<size_t> &Peak, size_t Value) {
+    size_t Old = Peak;
+    while (Old < Value && !Peak.compare_exchange_weak(Old, Value))
+      ;
+  }
+
+  // Process-wide tallies, touched once per slab and once per arena.
+  static inline std::atomic<size_t> LiveBytesReserved{0};
+  static inline std::atomic<size_t> PeakReservedAll{0};
+  static inline std::atomic<size_t> PeakInUseAll{0};
+
+  std::vector<void *> Slabs;
+  char *Cur = nullptr;
+  char *End = nullptr;
+  std::vector<FreeBlock *> FreeLists;
+  size_t BytesInUse = 0;
+  size_t PeakBytesInUse = 0;
+};
+
+/// A standard allocator drawing from a CostArena, for std::allocate_shared.
+template <typename T> class CostArenaAllocator {
+public:
+  using value_type = T;
+
+  explicit CostArenaAllocator(CostArena &Arena) : Arena(&Arena) {}
+  template <typename U>
+  CostArenaAllocator(const CostArenaAllocator<U> &Other)
+      : Arena(Other.Arena) {}
+
+  T *allocate(size_t N) {
+    return static_cast<T *>(Arena->allocate(N * sizeof(T)));
+  }
+  void deallocate(T *P, size_t N) { Arena->deallocate(P, N * sizeof(T)); }
+
+  template <typename U>
+  bool operator==(const CostArenaAllocator<U> &Other) const {
+    return Arena == Other.Arena;
+  }
+  template <typename U>
+  bool operator!=(const CostArenaAllocator<U> &Other) const {
+    return Arena != Other.Arena;
+  }
+
+private:
+  template <typename U> friend class CostArenaAllocator;
+  CostArena *Arena;
+};
+
+/// PBQP::ValuePool with its entries, and their reference counts, allocated
+/// from a CostArena. Equal costs are still shared: asking for a value that
+/// is already pooled returns a reference to the existing entry.
+template <typename ValueT> class ArenaValuePool {
+public:
+  using PoolRef = std::shared_ptr<const ValueT>;
+
+  explicit ArenaValuePool(CostArena &Arena) : Arena(Arena) {}
+
+  template <typename ValueKeyT> PoolRef getValue(ValueKeyT ValueKey) {
+    typename EntrySetT::iterator I = EntrySet.find_as(ValueKey);
+
+    if (I != EntrySet.end())
+      return PoolRef((*I)->shared_from_this(), &(*I)->getValue());
+
+    auto P = std::allocate_shared<PoolEntry>(
+        CostArenaAllocator<PoolEntry>(Arena), *this, std::move(ValueKey));
+    EntrySet.insert(P.get());
+    return PoolRef(std::move(P), &P->getValue());
+  }
+
+private:
+  class PoolEntry : public std::enable_shared_from_this<PoolEntry> {
+  public:
+    template <typename ValueKeyT>
+    PoolEntry(ArenaValuePool &Pool, ValueKeyT Value)
+        : Pool(Pool), Value(std::move(Value)) {}
+
+    ~PoolEntry() { Pool.removeEntry(this); }
+
+    const ValueT &getValue() const { return Value; }
+
+  private:
+    ArenaValuePool &Pool;
+    ValueT Value;
+  };
+
+  class PoolEntryDSInfo {
+  public:
+    static inline PoolEntry *getEmptyKey() { return nullptr; }
+
+    static inline PoolEntry *getTombstoneKey() {
+      return reinterpret_cast<PoolEntry *>(static_cast<uintptr_t>(1));
+    }
+
+    template <typename ValueKeyT>
+    static unsigned getHashValue(const ValueKeyT &C) {
+      return hash_value(C);
+    }
+
+    static unsigned getHashValue(PoolEntry *P) {
+      return getHashValue(P->getValue());
+    }
+
+    static unsigned getHashValue(const PoolEntry *P) {
+      return getHashValue(P->getValue());
+    }
+
+    template <typename ValueKeyT1, typename ValueKeyT2>
+    static bool isEqual(const ValueKeyT1 &C1, const ValueKeyT2 &C2) {
+      return C1 == C2;
+    }
+
+    template <typename ValueKeyT>
+    static bool isEqual(const ValueKeyT &C, PoolEntry *P) {
+      if (P == getEmptyKey() || P == getTombstoneKey())
+        return false;
+      return isEqual(C, P->getValue());
+    }
+
+    // Entries are compared by identity, not value: costs holding a NaN
+    // never compare equal to themselves, so a value comparison would leave
+    // their entries in the set, dangling, once they are destroyed.
+    static bool isEqual(PoolEntry *P1, PoolEntry *P2) { return P1 == P2; }
+  };
+
+  using EntrySetT = DenseSet<PoolEntry *, PoolEntryDSInfo>;
+
+  void removeEntry(PoolEntry *P) { EntrySet.erase(P); }
+
+  CostArena &Arena;
+  EntrySetT EntrySet;
+};
+
+/// A drop-in replacement for PBQP::PoolCostAllocator whose pooled costs live
+/// in a per-graph CostArena. The arena is declared first so that it outlives
+/// the pools; as with PoolCostAllocator, every cost pointer handed out must
+/// be released before the allocator (and so the graph) is destroyed.
+template <typename VectorT, typename MatrixT> class ArenaCostAllocator {
+public:
+  using Vector = VectorT;
+  using Matrix = MatrixT;
+  using VectorPtr = typename ArenaValuePool<VectorT>::PoolRef;
+  using MatrixPtr = typename ArenaValuePool<MatrixT>::PoolRef;
+
+  template <typename VectorKeyT> VectorPtr getVector(VectorKeyT V) {
+    return VectorPool.getValue(std::move(V));
+  }
+
+  template <typename MatrixKeyT> MatrixPtr getMatrix(MatrixKeyT M) {
+    return MatrixPool.getValue(std::move(M));
+  }
+
+private:
+  CostArena Arena;
+  ArenaValuePool<VectorT> VectorPool{Arena};
+  ArenaValuePool<MatrixT> MatrixPool{Arena};
+};
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
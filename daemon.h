@@ -0,0 +1,293 @@
+#pragma once
+
+#include "thread_pool.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// A long-running server for fingering requests, so that a stream of small
+// tunes doesn't pay for process startup, and each worker keeps the graph
+// and cost arena it built for the last tune.
+//
+// Requests are JSON objects, one per line. They are solved on a pool of
+// worker threads, oldest first, and answered one JSON object per line as
+// each finishes, so answers may come back in a different order from the
+// requests; each carries the request's "id" and its latency in
+// microseconds. A request may set a "timeout" in seconds, overriding the
+// server's. A request still running when its timeout passes is answered
+// with an error, and asked to stop: the exact, branch and bound and local
+// search solvers return early, and whatever they find is dropped.
+//
+// {"stats": true} is answered at once with the number of requests answered
+// so far, how many timed out, and the 50th and 99th percentile and largest
+// latencies.
+
+// Answers a request on a worker thread, returning the fields of its
+// response. `cancel` becomes true once the request has timed out.
+using DaemonHandler = std::function<llvm::json::Object(
+    const llvm::json::Object &request, const std::atomic<bool> &cancel)>;
+
+// A histogram of latencies, in buckets a sixteenth of a doubling wide, so
+// percentiles are exact to within about 4% in a fixed amount of memory.
+class LatencyHistogram {
+public:
+  void record(double seconds) {
+    double micros = std::max(seconds * 1e6, 1.0);
+    unsigned bucket = std::min<double>(std::log2(micros) * kBucketsPerDoubling,
+                                       kBuckets - 1);
+    ++counts[bucket];
+    ++total;
+    max_seconds = std::max(max_seconds, seconds);
+  }
+
+  uint64_t count() const { return total; }
+  double max() const { return max_seconds; }
+
+  // The latency within which `fraction` of the requests were answered.
+  double percentile(double fraction) const {
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(fraction * total));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        double upper = std::exp2((i + 1.0) / kBucketsPerDoubling) * 1e-6;
+        return std::min(upper, max_seconds);
+      }
+    }
+    return max_seconds;
+  }
+
+private:
+  static constexpr unsigned kBucketsPerDoubling = 16;
+  // Up to about 18 minutes.
+  static constexpr unsigned kBuckets = 30 * kBucketsPerDoubling;
+
+  std::array<uint64_t, kBuckets> counts{};
+  uint64_t total = 0;
+  double max_seconds = 0;
+};
+
+class SolverDaemon {
+public:
+  // Serve requests with `handler` on `jobs` threads (one per core if zero),
+  // writing answers to `out`. Requests without a timeout of their own time
+  // out after `default_timeout` seconds, or never if that is zero.
+  // `warm_up` is run once on each worker before any request is taken.
+  SolverDaemon(DaemonHandler handler, unsigned jobs, double default_timeout,
+               FILE *out, const std::function<void()> &warm_up = nullptr)
+      : handler(std::move(handler)), default_timeout(default_timeout),
+        out(out), pool(jobs) {
+    if (warm_up) {
+      // Each worker blocks until all have warmed up, so none runs two.
+      unsigned warm = 0;
+      std::mutex warm_mutex;
+      std::condition_variable all_warm;
+      for (unsigned i = 0; i < pool.size(); ++i) {
+        pool.submit([&] {
+          warm_up();
+          std::unique_lock<std::mutex> lock(warm_mutex);
+          if (++warm == pool.size()) {
+            all_warm.notify_all();
+          }
+          all_warm.wait(lock, [&] { return warm == pool.size(); });
+        });
+      }
+      pool.wait();
+    }
+    timer = std::thread([this] { watchTimeouts(); });
+  }
+
+  SolverDaemon(const SolverDaemon &) = delete;
+  SolverDaemon &operator=(const SolverDaemon &) = delete;
+
+  ~SolverDaemon() {
+    pool.wait();
+    {
+      std::lock_guard<std::mutex> lock(timer_mutex);
+      stopping = true;
+    }
+    timer_changed.notify_all();
+    timer.join();
+  }
+
+  // Answer every request read from `in`, returning once it ends and every
+  // request has been answered.
+  void serve(std::istream &in) {
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.find_first_not_of(" \t\r") == std::string::npos) {
+        continue;
+      }
+      auto request = std::make_shared<Request>();
+      request->received = std::chrono::steady_clock::now();
+
+      llvm::Expected<llvm::json::Value> parsed = llvm::json::parse(line);
+      if (!parsed) {
+        answer(*request, error(llvm::toString(parsed.takeError())));
+        continue;
+      }
+      llvm::json::Object *body = parsed->getAsObject();
+      if (!body) {
+        answer(*request, error("request is not a JSON object"));
+        continue;
+      }
+      if (const llvm::json::Value *id = body->get("id")) {
+        request->id = *id;
+      }
+      if (body->getBoolean("stats").getValueOr(false)) {
+        answer(*request, stats());
+        continue;
+      }
+
+      double timeout =
+          body->getNumber("timeout").getValueOr(default_timeout);
+      request->body = std::move(*body);
+      if (timeout > 0) {
+        auto deadline =
+            request->received +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(timeout));
+        std::lock_guard<std::mutex> lock(timer_mutex);
+        deadlines.emplace(deadline, request);
+      }
+      timer_changed.notify_all();
+
+      {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(std::move(request));
+      }
+      // Workers take the oldest request, whichever task they run.
+      pool.submit([this] {
+        std::shared_ptr<Request> next;
+        {
+          std::lock_guard<std::mutex> lock(queue_mutex);
+          next = std::move(queue.front());
+          queue.pop_front();
+        }
+        if (!next->answered) {
+          answer(*next, handler(next->body, next->cancel));
+        }
+      });
+    }
+    pool.wait();
+  }
+
+  // The latency summary, as answered to a stats request.
+  llvm::json::Object stats() const {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return llvm::json::Object{
+        {"ok", true},
+        {"requests", int64_t(latencies.count())},
+        {"timeouts", int64_t(timeouts)},
+        {"p50_us", toMicroseconds(latencies.percentile(0.5))},
+        {"p99_us", toMicroseconds(latencies.percentile(0.99))},
+        {"max_us", toMicroseconds(latencies.max())},
+    };
+  }
+
+private:
+  struct Request {
+    llvm::json::Value id = nullptr;
+    llvm::json::Object body;
+    std::chrono::steady_clock::time_point received;
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> answered{false};
+  };
+
+  static int64_t toMicroseconds(double seconds) {
+    return std::llround(seconds * 1e6);
+  }
+
+  static llvm::json::Object error(std::string message) {
+    return llvm::json::Object{{"ok", false}, {"error", std::move(message)}};
+  }
+
+  // Write the answer to `request`, unless it has already been answered.
+  void answer(Request &request, llvm::json::Object response,
+              bool timed_out = false) {
+    if (request.answered.exchange(true)) {
+      return;
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - request.received)
+                         .count();
+    response["id"] = request.id;
+    response["latency_us"] = toMicroseconds(seconds);
+    std::string text;
+    llvm::raw_string_ostream os(text);
+    os << llvm::json::Value(std::move(response)) << '\n';
+    os.flush();
+    {
+      std::lock_guard<std::mutex> lock(out_mutex);
+      fputs(text.c_str(), out);
+      fflush(out);
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    latencies.record(seconds);
+    timeouts += timed_out;
+  }
+
+  // Answer requests whose deadlines pass with an error, and cancel them.
+  void watchTimeouts() {
+    std::unique_lock<std::mutex> lock(timer_mutex);
+    while (!stopping) {
+      while (!deadlines.empty() && deadlines.begin()->second->answered) {
+        deadlines.erase(deadlines.begin());
+      }
+      if (deadlines.empty()) {
+        timer_changed.wait(lock);
+        continue;
+      }
+      auto [deadline, request] = *deadlines.begin();
+      if (std::chrono::steady_clock::now() < deadline) {
+        timer_changed.wait_until(lock, deadline);
+        continue;
+      }
+      deadlines.erase(deadlines.begin());
+      lock.unlock();
+      request->cancel = true;
+      answer(*request, error("timed out"), true);
+      lock.lock();
+    }
+  }
+
+  DaemonHandler handler;
+  double default_timeout;
+  FILE *out;
+  std::mutex out_mutex;
+
+  // Requests not yet taken by a worker, oldest first.
+  std::mutex queue_mutex;
+  std::deque<std::shared_ptr<Request>> queue;
+
+  mutable std::mutex stats_mutex;
+  LatencyHistogram latencies;
+  uint64_t timeouts = 0;
+
+  std::mutex timer_mutex;
+  std::condition_variable timer_changed;
+  std::multimap<std::chrono::steady_clock::time_point,
+                std::shared_ptr<Request>>
+      deadlines;
+  bool stopping = false;
+  std::thread timer;
+
+  // Declared last, so that its workers stop before anything they use goes.
+  WorkStealingPool pool;
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "concertina.h"
+#include "solver.h"
+#include "llvm/ADT/ArrayRef.h"
+#include <array>
+#include <vector>
+
+using llvm::PBQP::Solution;
+using llvm::PBQP::RegAlloc::PBQPRAGraph;
+using llvm::PBQP::RegAlloc::solve;
+
+enum class EdgeKind : unsigned {
+  Simultaneous,
+  Sequential,
+  SequentialAndSimultaneous,
+  MaxEdgeKind,
+};
+
+// The version of the cost rules applied by addNote and the
+// setup*NoteCosts functions. Bump it whenever they change, so that
+// fingerings cached under the old rules are solved again.
+constexpr unsigned kCostRulesVersion = 1;
+
+struct ConcertinaGraph {
+  explicit ConcertinaGraph(
+      const ConcertinaLayout &layout = CGWheatstoneLayout)
+      : graph({}), layout(&layout) {}
+
+  // Remove every node and edge, keeping the costs built so far for the next
+  // tune on the same layout.
+  void clear() {
+    graph.clear();
+    node_notes.clear();
+  }
+
+  PBQPRAGraph graph;
+  // The note of each node, indexed by NodeId (which the graph hands out
+  // densely from zero). A node's options are its note's options on the
+  // layout, so they are looked up there rather than copied per node.
+  std::vector<ConcertinaNote> node_notes;
+
+  // Node costs depend only on the note, and edge costs only on the two notes
+  // and the kind of edge, so each is built once and then shared between all
+  // nodes and edges that need it. These hold references into the graph's
+  // cost pools, so they must be declared after `graph`, so that they are
+  // destroyed before it.
+  std::array<PBQPRAGraph::VectorPtr, (unsigned)ConcertinaNote::MaxNote>
+      note_costs;
+  std::vector<PBQPRAGraph::MatrixPtr> edge_costs;
+
+  // The layout whose buttons the notes are assigned to.
+  const ConcertinaLayout *layout;
+};
+
+PBQPRAGraph::MatrixPtr &getCachedEdgeCosts(ConcertinaGraph &graph,
+                                           PBQPRAGraph::NodeId n1id,
+                                           PBQPRAGraph::NodeId n2id,
+                                           EdgeKind kind) {
+  constexpr unsigned num_notes = (unsigned)ConcertinaNote::MaxNote;
+  if (graph.edge_costs.empty()) {
+    graph.edge_costs.resize((unsigned)EdgeKind::MaxEdgeKind * num_notes *
+                            num_notes);
+  }
+  unsigned n1 = (unsigned)graph.node_notes[n1id];
+  unsigned n2 = (unsigned)graph.node_notes[n2id];
+  return graph.edge_costs[((unsigned)kind * num_notes + n1) * num_notes + n2];
+}
+
+// The reed and finger options of `note` on `layout`, in the order of its
+// node's costs.
+llvm::ArrayRef<uint8_t> getNoteOptions(const ConcertinaLayout &layout,
+                                       ConcertinaNote note) {
+  const NoteOptions &options = layout[note];
+  return llvm::makeArrayRef(options.options.data(), options.num_options);
+}
+
+llvm::ArrayRef<uint8_t> getNodeOptions(const ConcertinaGraph &graph,
+                                       PBQPRAGraph::NodeId nid) {
+  return getNoteOptions(*graph.layout, graph.node_notes[nid]);
+}
+
+unsigned lookupSolution(ConcertinaGraph &graph, PBQPRAGraph::NodeId nid,
+                        unsigned val) {
+  return getNodeOptions(graph, nid)[val];
+}
+
+PBQPRAGraph::RawVector setupNoteCosts(const ConcertinaLayout &layout,
+                                      ConcertinaNote note) {
+  // Set all allowed note->reed mappings to their precomputed costs.
+  const NoteOptions &options = layout[note];
+  PBQPRAGraph::RawVector Costs(options.num_options);
+  for (unsigned i = 0; i < options.num_options; ++i) {
+    Costs[i] = options.costs[i];
+  }
+  return Costs;
+}
+
+auto addNote(ConcertinaGraph &graph, ConcertinaNote note) {
+  auto &cached_costs = graph.note_costs[(unsigned)note];
+  PBQPRAGraph::NodeId nid;
+  if (cached_costs) {
+    nid = graph.graph.addNodeBypassingCostAllocator(cached_costs);
+  } else {
+    nid = graph.graph.addNode(setupNoteCosts(*graph.layout, note));
+    cached_costs = graph.graph.getNodeCostsPtr(nid);
+  }
+
+  if (graph.node_notes.size() <= nid) {
+    graph.node_notes.resize(nid + 1);
+  }
+  graph.node_notes[nid] = note;
+  return nid;
+}
+
+void setupSimultaneousNoteCosts(llvm::PBQP::Matrix &Costs,
+                                llvm::ArrayRef<uint8_t> n_options,
+                                llvm::ArrayRef<uint8_t> m_options) {
+  for (int n = 0; n < n_options.size(); ++n) {
+    unsigned n_reed = n_options[n];
+    for (int m = 0; m < m_options.size(); ++m) {
+      unsigned m_reed = m_options[m];
+      if (n_reed == m_reed) {
+        Costs[n][m] = -INFINITY;
+        return;
+      }
+
+
+      // Mismatched bellows directions are impossible, thus infinite cost.
+      if ((n_reed & DIRECTION_MASK) != (m_reed & DIRECTION_MASK)) {
+        Costs[n][m] = INFINITY;
+      }
+
+      // Using the same finger more than once is impossible.
+      if ((n_reed & FINGER_MASK) == (m_reed & FINGER_MASK)) {
+        Costs[n][m] = INFINITY;
+      }
+
+      if ((n_reed & HAND_MASK) == (m_reed & HAND_MASK)) {
+        // Apply a cost to multiple buttons in the same column.
+        if (GetColumn((ConcertinaReed)n_reed) ==
+            GetColumn((ConcertinaReed)m_reed)) {
+          Costs[n][m] += 3;
+        }
+
+        // Apply a cost to playing upper and lower row simultaneously.
+        auto n_row = GetRow((ConcertinaReed)n_reed);
+        auto m_row = GetRow((ConcertinaReed)m_reed);
+        if ((n_row == 0 && m_row == 2) || (n_row == 2 && m_row == 0)) {
+          Costs[n][m] += 1;
+        }
+      }
+    }
+  }
+}
+
+void setupSequentialNoteCosts(llvm::PBQP::Matrix &Costs,
+                              llvm::ArrayRef<uint8_t> n_options,
+                              llvm::ArrayRef<uint8_t> m_options) {
+  for (int n = 0; n < n_options.size(); ++n) {
+    unsigned n_reed = n_options[n];
+    for (int m = 0; m < m_options.size(); ++m) {
+      unsigned m_reed = m_options[m];
+
+      // Apply a cost to anything *other* than simple bellows reversal
+      // or a repeated note.
+      if ((n_reed & ~DIRECTION_MASK) != (m_reed & ~DIRECTION_MASK)) {
+        Costs[n][m] += 1;
+      }
+
+      // Apply a cost to changing hands.
+      if ((n_reed & HAND_MASK) != (m_reed & HAND_MASK)) {
+        Costs[n][m] += 1;
+      }
+
+      // Intra-hand rules
+      if ((n_reed & HAND_MASK) == (m_reed & HAND_MASK)) {
+        // Apply a cost to going directly from the upper to the lower row.
+        auto n_row = GetRow((ConcertinaReed)n_reed);
+        auto m_row = GetRow((ConcertinaReed)m_reed);
+        if ((n_row == 0 && m_row == 2) || (n_row == 2 && m_row == 0)) {
+          Costs[n][m] += 1;
+        }
+
+        if ((n_reed & BUTTON_MASK) != (m_reed & BUTTON_MASK)) {
+          // Apply a cost to sequential notes being assigned to reeds in the
+          // same column.
+          if (GetColumn((ConcertinaReed)n_reed) ==
+              GetColumn((ConcertinaReed)m_reed)) {
+            Costs[n][m] += 4;
+          }
+
+          // Apply a cost to sequential notes being assigned to the same finger.
+          if (GetFingerColumn((ConcertinaReed)n_reed) ==
+              GetFingerColumn((ConcertinaReed)m_reed)) {
+            Costs[n][m] += 2;
+          }
+        }
+      }
+    }
+  }
+}
+
+void setupNoteEdgeCosts(EdgeKind kind, llvm::PBQP::Matrix &Costs,
+                        llvm::ArrayRef<uint8_t> n_options,
+                        llvm::ArrayRef<uint8_t> m_options) {
+  if (kind != EdgeKind::Simultaneous) {
+    setupSequentialNoteCosts(Costs, n_options, m_options);
+  }
+  if (kind != EdgeKind::Sequential) {
+    setupSimultaneousNoteCosts(Costs, n_options, m_options);
+  }
+}
+
+// Add the costs of a `kind` edge from n1id to n2id into `eid`, the edge
+// already joining them. Parallel edges would each count towards their
+// nodes' degrees, keeping them from being reduced optimally, so a pair of
+// notes gets one edge holding the sum of the costs of all its constraints.
+PBQPRAGraph::EdgeId mergeNoteEdge(ConcertinaGraph &graph,
+                                  PBQPRAGraph::EdgeId eid,
+                                  PBQPRAGraph::NodeId n1id,
+                                  PBQPRAGraph::NodeId n2id, EdgeKind kind) {
+  auto n_options = getNodeOptions(graph, n1id);
+  auto m_options = getNodeOptions(graph, n2id);
+
+  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
+  setupNoteEdgeCosts(kind, Costs, n_options, m_options);
+  llvm::PBQP::Matrix EdgeCosts = graph.graph.getEdgeNode1Id(eid) == n1id
+                                     ? std::move(Costs)
+                                     : Costs.transpose();
+  EdgeCosts += graph.graph.getEdgeCosts(eid);
+  graph.graph.updateEdgeCosts(eid, std::move(EdgeCosts));
+  return eid;
+}
+
+auto addSimultaneousNoteEdge(ConcertinaGraph &graph, PBQPRAGraph::NodeId n1id,
+                             PBQPRAGraph::NodeId n2id) {
+  auto existing = graph.graph.findEdge(n1id, n2id);
+  if (existing != graph.graph.invalidEdgeId()) {
+    return mergeNoteEdge(graph, existing, n1id, n2id, EdgeKind::Simultaneous);
+  }
+
+  auto &cached_costs =
+      getCachedEdgeCosts(graph, n1id, n2id, EdgeKind::Simultaneous);
+  if (cached_costs) {
+    return graph.graph.addEdgeBypassingCostAllocator(n1id, n2id, cached_costs);
+  }
+
+  auto n_options = getNodeOptions(graph, n1id);
+  auto m_options = getNodeOptions(graph, n2id);
+
+  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
+  setupSimultaneousNoteCosts(Costs, n_options, m_options);
+  auto eid = graph.graph.addEdge(n1id, n2id, std::move(Costs));
+  cached_costs = graph.graph.getEdgeCostsPtr(eid);
+  return eid;
+}
+
+auto addSequentialNoteEdge(ConcertinaGraph &graph, PBQPRAGraph::NodeId n1id,
+                           PBQPRAGraph::NodeId n2id) {
+  auto existing = graph.graph.findEdge(n1id, n2id);
+  if (existing != graph.graph.invalidEdgeId()) {
+    return mergeNoteEdge(graph, existing, n1id, n2id, EdgeKind::Sequential);
+  }
+
+  auto &cached_costs =
+      getCachedEdgeCosts(graph, n1id, n2id, EdgeKind::Sequential);
+  if (cached_costs) {
+    return graph.graph.addEdgeBypassingCostAllocator(n1id, n2id, cached_costs);
+  }
+
+  auto n_options = getNodeOptions(graph, n1id);
+  auto m_options = getNodeOptions(graph, n2id);
+
+  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
+  setupSequentialNoteCosts(Costs, n_options, m_options);
+  auto eid = graph.graph.addEdge(n1id, n2id, std::move(Costs));
+  cached_costs = graph.graph.getEdgeCostsPtr(eid);
+  return eid;
+}
+
+auto addSequentialAndSimultaneousNoteEdge(ConcertinaGraph &graph,
+                                          PBQPRAGraph::NodeId n1id,
+                                          PBQPRAGraph::NodeId n2id) {
+  auto existing = graph.graph.findEdge(n1id, n2id);
+  if (existing != graph.graph.invalidEdgeId()) {
+    return mergeNoteEdge(graph, existing, n1id, n2id,
+                         EdgeKind::SequentialAndSimultaneous);
+  }
+
+  auto &cached_costs = getCachedEdgeCosts(graph, n1id, n2id,
+                                          EdgeKind::SequentialAndSimultaneous);
+  if (cached_costs) {
+    return graph.graph.addEdgeBypassingCostAllocator(n1id, n2id, cached_costs);
+  }
+
+  auto n_options = getNodeOptions(graph, n1id);
+  auto m_options = getNodeOptions(graph, n2id);
+
+  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
+  setupSequentialNoteCosts(Costs, n_options, m_options);
+  setupSimultaneousNoteCosts(Costs, n_options, m_options);
+  auto eid = graph.graph.addEdge(n1id, n2id, std::move(Costs));
+  cached_costs = graph.graph.getEdgeCostsPtr(eid);
+  return eid;
+}
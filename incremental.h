@@ -0,0 +1,382 @@
+#pragma once
+
+#include "concertina.h"
+#include "graph.h"
+#include "solvers.h"
+#include "tune.h"
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Keeps the fingering of a tune up to date as single notes are inserted,
+// deleted or transposed, as in an editor. Each edit changes the notes and
+// constraints around it in place, then re-solves only a region of notes
+// around the edit, with the fingering outside the region held fixed: edges
+// that cross the region's boundary are folded into the costs of the notes
+// inside it. If the fingering at either edge of the region changes, its
+// fixed neighbours might now be better fingered differently too, so the
+// region is doubled and solved again. Since a small edit usually only
+// disturbs a few notes, the time per edit stays flat as the tune grows.
+//
+// Constraints are kept per note, as the distance back to each earlier note
+// it is constrained against, so that inserting or deleting a note only
+// renumbers the constraints that span it.
+class IncrementalFingering {
+public:
+  explicit IncrementalFingering(
+      const Tune &tune, const SolverOptions &options = {},
+      const ConcertinaLayout &layout = CGWheatstoneLayout)
+      : notes(tune.notes), incoming(tune.notes.size()),
+        window_ticks(tune.onset_window_ticks), options(options),
+        layout(&layout) {
+    for (const auto &edge : tune.edges) {
+      unsigned span = edge.to - edge.from;
+      incoming[edge.to].push_back({span, edge.kind});
+      max_span = std::max(max_span, span);
+    }
+    selections = solveTune(tune, options, nullptr, layout);
+  }
+
+  unsigned size() const { return notes.size(); }
+  const std::vector<TuneNote> &getNotes() const { return notes; }
+
+  // The selected option index for each note, as for solveTune.
+  const std::vector<unsigned> &getSelections() const { return selections; }
+
+  // The tune as edited so far.
+  Tune getTune() const {
+    Tune tune;
+    tune.notes = notes;
+    tune.onset_window_ticks = window_ticks;
+    for (unsigned to = 0; to < notes.size(); ++to) {
+      for (const auto &edge : incoming[to]) {
+        tune.edges.push_back({to - edge.span, to, edge.kind});
+      }
+    }
+    return tune;
+  }
+
+  // The range of notes, [first, last), re-solved by the last edit, and the
+  // number of times it was solved.
+  unsigned getLastRegionBegin() const { return region_begin; }
+  unsigned getLastRegionEnd() const { return region_end; }
+  unsigned getLastSolveCount() const { return solve_count; }
+
+  // Shift note `index` by `shift` semitones. Returns false, leaving the tune
+  // unchanged, if the shifted note cannot be played.
+  bool transposeNote(unsigned index, int shift) {
+    if (index >= notes.size()) {
+      return false;
+    }
+    int pitch = notes[index].pitch + shift;
+    if (!isPlayablePitch(pitch, *layout)) {
+      return false;
+    }
+    notes[index].pitch = pitch;
+    resolve(index, index + 1);
+    return true;
+  }
+
+  // Insert `note` after every note with an onset no later than its own.
+  // As when the tune was read, notes starting within its onset window of
+  // each other are played together; the new note follows the group of notes
+  // before it, and the group after it follows the new note instead of that
+  // earlier group.
+  // Tunes carry no note lengths, so held notes that overlap later onsets are
+  // not seen. Returns false if the note cannot be played.
+  bool insertNote(TuneNote note) {
+    if (!isPlayablePitch(note.pitch, *layout)) {
+      return false;
+    }
+    unsigned pos =
+        std::upper_bound(notes.begin(), notes.end(), note.tick,
+                         [](int tick, const TuneNote &other) {
+                           return tick < other.tick;
+                         }) -
+        notes.begin();
+    auto together = [&](unsigned i) {
+      return std::abs(notes[i].tick - note.tick) <= window_ticks;
+    };
+
+    // Notes starting with the new one, and the groups on either side.
+    unsigned chord_begin = pos;
+    while (chord_begin > 0 && together(chord_begin - 1)) {
+      --chord_begin;
+    }
+    unsigned chord_end = pos;
+    while (chord_end < notes.size() && together(chord_end)) {
+      ++chord_end;
+    }
+    unsigned prev_begin = chord_begin;
+    if (prev_begin > 0) {
+      int tick = notes[prev_begin - 1].tick;
+      while (prev_begin > 0 &&
+             tick - notes[prev_begin - 1].tick <= window_ticks) {
+        --prev_begin;
+      }
+    }
+    unsigned next_end = chord_end;
+    if (next_end < notes.size()) {
+      int tick = notes[next_end].tick;
+      while (next_end < notes.size() &&
+             notes[next_end].tick - tick <= window_ticks) {
+        ++next_end;
+      }
+    }
+
+    // A note starting a group of its own comes between the groups on either
+    // side, which no longer follow each other directly.
+    if (chord_begin == chord_end) {
+      for (unsigned to = chord_end; to < next_end; ++to) {
+        auto &edges = incoming[to];
+        edges.erase(std::remove_if(edges.begin(), edges.end(),
+                                   [&](const Edge &edge) {
+                                     unsigned from = to - edge.span;
+                                     return from >= prev_begin &&
+                                            from < chord_begin &&
+                                            edge.kind == EdgeKind::Sequential;
+                                   }),
+                    edges.end());
+      }
+    }
+
+    shiftSpans(pos, +1);
+    notes.insert(notes.begin() + pos, note);
+    incoming.insert(incoming.begin() + pos, std::vector<Edge>());
+    selections.insert(selections.begin() + pos, 0);
+    // Indices at or after `pos` have moved up by one.
+    chord_end += 1;
+    next_end += 1;
+
+    for (unsigned from = prev_begin; from < chord_begin; ++from) {
+      addEdge(from, pos, EdgeKind::Sequential);
+    }
+    for (unsigned other = chord_begin; other < chord_end; ++other) {
+      if (other != pos) {
+        addEdge(std::min(other, pos), std::max(other, pos),
+                EdgeKind::Simultaneous);
+      }
+    }
+    for (unsigned to = chord_end; to < next_end; ++to) {
+      addEdge(pos, to, EdgeKind::Sequential);
+    }
+    resolve(pos, pos + 1);
+    return true;
+  }
+
+  // Delete note `index`. Notes that followed it now follow the notes it
+  // followed. Returns false if there is no such note.
+  bool deleteNote(unsigned index) {
+    if (index >= notes.size()) {
+      return false;
+    }
+    std::vector<unsigned> before, after;
+    for (const auto &edge : incoming[index]) {
+      if (edge.kind != EdgeKind::Simultaneous) {
+        before.push_back(index - edge.span);
+      }
+    }
+    unsigned scan_end = std::min<size_t>(notes.size(), index + max_span + 1);
+    for (unsigned to = index + 1; to < scan_end; ++to) {
+      auto &edges = incoming[to];
+      for (const auto &edge : edges) {
+        if (to - edge.span == index && edge.kind != EdgeKind::Simultaneous) {
+          after.push_back(to);
+        }
+      }
+      edges.erase(std::remove_if(edges.begin(), edges.end(),
+                                 [&](const Edge &edge) {
+                                   return to - edge.span == index;
+                                 }),
+                  edges.end());
+    }
+
+    shiftSpans(index + 1, -1);
+    notes.erase(notes.begin() + index);
+    incoming.erase(incoming.begin() + index);
+    selections.erase(selections.begin() + index);
+    for (unsigned from : before) {
+      for (unsigned to : after) {
+        addEdge(from, to - 1, EdgeKind::Sequential);
+      }
+    }
+    if (!notes.empty()) {
+      resolve(index > 0 ? index - 1 : 0,
+              std::min<unsigned>(index + 1, notes.size()));
+    }
+    return true;
+  }
+
+private:
+  // A constraint against the note `span` places earlier.
+  struct Edge {
+    unsigned span;
+    EdgeKind kind;
+  };
+
+  // Notes re-solved on each side of an edit, before any expansion.
+  static constexpr unsigned initial_radius = 16;
+
+  ConcertinaNote getNote(unsigned i) const {
+    return *midi2note(notes[i].pitch);
+  }
+
+  // Add a constraint between notes `from` < `to`. Notes already constrained
+  // keep one edge, of both kinds if the constraints differ, so that the
+  // graph never has parallel edges.
+  void addEdge(unsigned from, unsigned to, EdgeKind kind) {
+    unsigned span = to - from;
+    for (auto &edge : incoming[to]) {
+      if (edge.span == span) {
+        if (edge.kind != kind) {
+          edge.kind = EdgeKind::SequentialAndSimultaneous;
+        }
+        return;
+      }
+    }
+    incoming[to].push_back({span, kind});
+    max_span = std::max(max_span, span);
+  }
+
+  // Adjust the constraints that span position `pos` for a note being
+  // inserted there (`delta` = 1) or removed from just before it (-1). Only
+  // notes within max_span of `pos` can have such constraints.
+  void shiftSpans(unsigned pos, int delta) {
+    unsigned scan_end = std::min<size_t>(notes.size(), pos + max_span + 1);
+    unsigned longest = 0;
+    for (unsigned to = pos; to < scan_end; ++to) {
+      for (auto &edge : incoming[to]) {
+        if (edge.span > to - pos) {
+          edge.span += delta;
+          longest = std::max(longest, edge.span);
+        }
+      }
+    }
+    max_span = std::max(max_span, longest);
+  }
+
+  // The cost of each of the options of note `to` (if `to_in_region`) or
+  // `from`, for a constraint with the other note held at its selection.
+  PBQPRAGraph::RawVector getFixedEdgeCosts(unsigned from, unsigned to,
+                                           EdgeKind kind,
+                                           bool to_in_region) const {
+    auto n = getNoteOptions(*layout, getNote(from));
+    auto m = getNoteOptions(*layout, getNote(to));
+    llvm::PBQP::Matrix Costs(n.size(), m.size(), 0);
+    setupNoteEdgeCosts(kind, Costs, n, m);
+    return to_in_region ? Costs.getRowAsVector(selections[from])
+                        : Costs.getColAsVector(selections[to]);
+  }
+
+  // Build notes [begin, end) into `g`, with the notes outside held at their
+  // selections, returning the node for each note.
+  std::vector<PBQPRAGraph::NodeId> buildRegion(ConcertinaGraph &g,
+                                               unsigned begin,
+                                               unsigned end) const {
+    std::vector<PBQPRAGraph::NodeId> node_ids;
+    node_ids.reserve(end - begin);
+    for (unsigned i = begin; i < end; ++i) {
+      node_ids.push_back(addNote(g, getNote(i)));
+    }
+
+    std::vector<std::optional<PBQPRAGraph::RawVector>> fixed(end - begin);
+    auto addFixed = [&](unsigned i, PBQPRAGraph::RawVector costs) {
+      auto &node_fixed = fixed[i - begin];
+      if (!node_fixed) {
+        node_fixed.emplace(g.graph.getNodeCosts(node_ids[i - begin]));
+      }
+      *node_fixed += costs;
+    };
+    for (unsigned to = begin; to < end; ++to) {
+      for (const auto &edge : incoming[to]) {
+        unsigned from = to - edge.span;
+        if (from < begin) {
+          addFixed(to, getFixedEdgeCosts(from, to, edge.kind, true));
+        }
+      }
+    }
+    unsigned scan_end = std::min<size_t>(notes.size(), end + max_span);
+    for (unsigned to = end; to < scan_end; ++to) {
+      for (const auto &edge : incoming[to]) {
+        unsigned from = to - edge.span;
+        if (from >= begin && from < end) {
+          addFixed(from, getFixedEdgeCosts(from, to, edge.kind, false));
+        }
+      }
+    }
+    for (unsigned i = begin; i < end; ++i) {
+      if (fixed[i - begin]) {
+        g.graph.setNodeCosts(node_ids[i - begin],
+                             std::move(*fixed[i - begin]));
+      }
+    }
+
+    for (unsigned to = begin; to < end; ++to) {
+      for (const auto &edge : incoming[to]) {
+        unsigned from = to - edge.span;
+        if (from >= begin) {
+          addNoteEdge(g, node_ids[from - begin], node_ids[to - begin],
+                      edge.kind);
+        }
+      }
+    }
+    return node_ids;
+  }
+
+  // Re-solve around the edited notes [first, last), growing the region
+  // until the fingering at its edges stops changing.
+  void resolve(unsigned first, unsigned last) {
+    unsigned radius = initial_radius;
+    unsigned num_notes = notes.size();
+    solve_count = 0;
+    while (true) {
+      unsigned begin = first > radius ? first - radius : 0;
+      unsigned end = std::min(num_notes, last + radius);
+
+      ConcertinaGraph g(*layout);
+      auto node_ids = buildRegion(g, begin, end);
+      auto rebuild = [this, begin, end] {
+        auto copy = std::make_shared<ConcertinaGraph>(*layout);
+        buildRegion(*copy, begin, end);
+        return std::shared_ptr<PBQPRAGraph>(copy, &copy->graph);
+      };
+      Solution solution = solveGraph(g.graph, options, nullptr, rebuild);
+      ++solve_count;
+
+      bool begin_changed =
+          begin > 0 && solution.getSelection(node_ids.front()) !=
+                           selections[begin];
+      bool end_changed =
+          end < num_notes &&
+          solution.getSelection(node_ids.back()) != selections[end - 1];
+      if (begin_changed || end_changed) {
+        radius *= 2;
+        continue;
+      }
+
+      for (unsigned i = begin; i < end; ++i) {
+        selections[i] = solution.getSelection(node_ids[i - begin]);
+      }
+      region_begin = begin;
+      region_end = end;
+      return;
+    }
+  }
+
+  std::vector<TuneNote> notes;
+  // The constraints of each note against earlier notes.
+  std::vector<std::vector<Edge>> incoming;
+  // Notes starting no more than this many ticks apart are played together.
+  double window_ticks;
+  // The longest span of any constraint; none reaches further.
+  unsigned max_span = 0;
+  std::vector<unsigned> selections;
+  SolverOptions options;
+  const ConcertinaLayout *layout;
+
+  unsigned region_begin = 0;
+  unsigned region_end = 0;
+  unsigned solve_count = 0;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "concertina.h"
+#include "thread_pool.h"
+#include "tune.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <optional>
+#include <vector>
+
+// How far a tune may be shifted when searching for its most playable key:
+// every key, in each octave that fits the instrument.
+constexpr int kMaxTransposition = 24;
+
+// One transposition of a tune and how well it fingers.
+struct Transposition {
+  // Shift in semitones from the tune as written.
+  int shift;
+  // Total fingering cost; infinite if no fingering avoids every impossible
+  // combination.
+  llvm::PBQP::PBQPNum cost;
+  std::vector<unsigned> selections;
+};
+
+// Whether every note of `tune`, shifted by `shift` semitones, is mapped by
+// midi2note and can be played somewhere on `layout`.
+bool isPlayableTransposition(const Tune &tune, int shift,
+                             const ConcertinaLayout &layout) {
+  for (const auto &note : tune.notes) {
+    if (!isPlayablePitch(note.pitch + shift, layout)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// `tune` shifted by `shift` semitones. Only the pitches change; the notes'
+// timing and the constraints between them are kept as they are.
+Tune transposeTune(const Tune &tune, int shift) {
+  Tune shifted = tune;
+  for (auto &note : shifted.notes) {
+    note.pitch += shift;
+  }
+  return shifted;
+}
+
+// Solve every playable transposition of `tune` within kMaxTransposition
+// semitones and return them cheapest first. Transpositions with an
+// unplayable note are dropped before solving, and the rest are fingered on
+// `layout` by `solve`, several at once on `jobs` threads (one per core if
+// zero).
+std::vector<Transposition> rankTranspositions(
+    const Tune &tune,
+    const std::function<std::vector<unsigned>(const Tune &)> &solve,
+    unsigned jobs = 0,
+    const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  std::vector<Transposition> results;
+  for (int shift = -kMaxTransposition; shift <= kMaxTransposition; ++shift) {
+    if (isPlayableTransposition(tune, shift, layout)) {
+      results.push_back({shift, 0, {}});
+    }
+  }
+
+  {
+    WorkStealingPool pool(jobs);
+    for (auto &result : results) {
+      pool.submit([&tune, &solve, &layout, &result] {
+        Tune shifted = transposeTune(tune, result.shift);
+        result.selections = solve(shifted);
+        result.cost =
+            getRankingFingeringCost(shifted, result.selections, layout);
+      });
+    }
+  }
+
+  // Equal costs prefer the smaller shift, then shifting up.
+  std::sort(results.begin(), results.end(),
+            [](const Transposition &a, const Transposition &b) {
+              if (a.cost != b.cost) {
+                return a.cost < b.cost;
+              }
+              if (std::abs(a.shift) != std::abs(b.shift)) {
+                return std::abs(a.shift) < std::abs(b.shift);
+              }
+              return a.shift > b.shift;
+            });
+  return results;
+}
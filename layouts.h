@@ -0,0 +1,92 @@
+#pragma once
+
+#include "concertina.h"
+#include "thread_pool.h"
+#include "tune.h"
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// How well a tune suits one layout.
+struct LayoutResult {
+  const ConcertinaLayout *layout;
+  // Number of the tune's notes with no button on the layout.
+  unsigned unplayable_notes = 0;
+  // The tune without its unplayable notes, and its fingering and total cost.
+  Tune playable;
+  std::vector<unsigned> selections;
+  llvm::PBQP::PBQPNum cost = 0;
+};
+
+unsigned countUnplayableNotes(const Tune &tune,
+                              const ConcertinaLayout &layout) {
+  return std::count_if(tune.notes.begin(), tune.notes.end(),
+                       [&layout](const TuneNote &note) {
+                         return !isPlayablePitch(note.pitch, layout);
+                       });
+}
+
+// `tune` without the notes that `layout` cannot play, or the edges to them.
+Tune removeUnplayableNotes(const Tune &tune, const ConcertinaLayout &layout) {
+  constexpr unsigned removed = ~0u;
+  std::vector<unsigned> new_index(tune.notes.size(), removed);
+  Tune playable;
+  playable.onset_window_ticks = tune.onset_window_ticks;
+  for (unsigned i = 0; i < tune.notes.size(); ++i) {
+    if (isPlayablePitch(tune.notes[i].pitch, layout)) {
+      new_index[i] = playable.notes.size();
+      playable.notes.push_back(tune.notes[i]);
+    }
+  }
+  for (const auto &edge : tune.edges) {
+    if (new_index[edge.from] != removed && new_index[edge.to] != removed) {
+      playable.edges.push_back(
+          {new_index[edge.from], new_index[edge.to], edge.kind});
+    }
+  }
+  return playable;
+}
+
+// Solve `tune` against every known layout and return the layouts best
+// suited first: those that can play the most notes, then the cheapest.
+// Notes a layout cannot play are left out of its fingering. The layouts are
+// solved side by side on `jobs` threads (one per core if zero), so `solve`
+// may be running for several of them at once.
+std::vector<LayoutResult> rankLayouts(
+    const Tune &tune,
+    const std::function<std::vector<unsigned>(
+        const Tune &, const ConcertinaLayout &)> &solve,
+    unsigned jobs = 0) {
+  std::vector<LayoutResult> results;
+  for (const ConcertinaLayout *layout : AllLayouts) {
+    LayoutResult result;
+    result.layout = layout;
+    results.push_back(std::move(result));
+  }
+
+  {
+    WorkStealingPool pool(jobs);
+    for (auto &result : results) {
+      pool.submit([&tune, &solve, &result] {
+        const ConcertinaLayout &layout = *result.layout;
+        result.unplayable_notes = countUnplayableNotes(tune, layout);
+        result.playable = result.unplayable_notes
+                              ? removeUnplayableNotes(tune, layout)
+                              : tune;
+        result.selections = solve(result.playable, layout);
+        result.cost = getRankingFingeringCost(result.playable,
+                                              result.selections, layout);
+      });
+    }
+  }
+
+  std::stable_sort(results.begin(), results.end(),
+                   [](const LayoutResult &a, const LayoutResult &b) {
+                     if (a.unplayable_notes != b.unplayable_notes) {
+                       return a.unplayable_notes < b.unplayable_notes;
+                     }
+                     return a.cost < b.cost;
+                   });
+  return results;
+}
@@ -0,0 +1,303 @@
+#pragma once
+
+#include "solver.h"
+#include "solver_utils.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+struct LocalSearchOptions {
+  /// Number of annealing moves to try. Zero tries 100 per node.
+  uint64_t Iterations = 0;
+  /// Stop annealing after this many seconds. Zero means no limit.
+  double TimeLimit = 0;
+  /// Annealing temperature at the first and last move, in cost units.
+  PBQPNum StartTemperature = 2.0;
+  PBQPNum EndTemperature = 0.05;
+  uint64_t Seed = 1;
+  /// If set, stop annealing once this becomes true.
+  const std::atomic<bool> *Cancel = nullptr;
+};
+
+struct LocalSearchStats {
+  /// Cost of the solution the search started from.
+  PBQPNum InitialCost = 0;
+  /// Cost of the returned solution.
+  PBQPNum Cost = 0;
+  uint64_t Iterations = 0;
+  /// Number of moves applied, including descent moves.
+  uint64_t Moves = 0;
+};
+
+/// Improves a complete solution by local search: simulated annealing over
+/// single-node moves, followed by a descent over single-node moves and moves
+/// of both ends of an edge, from the best solution the annealing saw.
+///
+/// For every node and option the refiner keeps the cost that option would
+/// contribute given the neighbours' current selections (its node cost plus
+/// its edge costs), so a single-node move is scored in constant time and a
+/// pair move in time proportional to the edges between the pair. Applying a
+/// move updates the tables of the moved nodes' neighbours.
+class LocalSearchRefiner {
+public:
+  explicit LocalSearchRefiner(const PBQPRAGraph &G) : View(G) {}
+
+  Solution refine(const Solution &Initial, const LocalSearchOptions &Opts,
+                  LocalSearchStats *Stats = nullptr) {
+    unsigned N = View.getNumNodes();
+    Sel.resize(N);
+    for (unsigned I = 0; I < N; ++I)
+      Sel[I] = Initial.getSelection(View.getNodeId(I));
+    computeContributions();
+    PBQPNum InitialCost = Total.value();
+    uint64_t Moves = 0;
+
+    // Anneal, remembering the best selection seen.
+    std::vector<unsigned> BestSel = Sel;
+    CostSum Best = Total;
+    uint64_t Iterations =
+        Opts.Iterations ? Opts.Iterations : uint64_t(100) * N;
+    uint64_t Done = 0;
+    auto Start = std::chrono::steady_clock::now();
+    RandomState = Opts.Seed;
+    for (; Done < Iterations; ++Done) {
+      if ((Done & 1023) == 0 && Done != 0 && shouldStop(Opts, Start))
+        break;
+      unsigned U = nextRandom() % N;
+      unsigned NumOpts = View.getNumOptions(U);
+      if (NumOpts < 2)
+        continue;
+      unsigned V = nextRandom() % (NumOpts - 1);
+      if (V >= Sel[U])
+        ++V;
+
+      PBQPNum Delta = Contrib[U][Sel[U]].deltaTo(Contrib[U][V]);
+      if (!(Delta < std::numeric_limits<PBQPNum>::infinity()))
+        continue;
+      if (Delta > 0) {
+        double T = Opts.StartTemperature *
+                   std::pow(Opts.EndTemperature / Opts.StartTemperature,
+                            double(Done) / Iterations);
+        if (nextRandom() >= std::exp(-Delta / T) * double(UINT64_MAX))
+          continue;
+      }
+      move(U, V);
+      ++Moves;
+      if (Best.deltaTo(Total) < 0) {
+        Best = Total;
+        BestSel = Sel;
+      }
+    }
+
+    if (BestSel != Sel) {
+      Sel = std::move(BestSel);
+      computeContributions();
+    }
+    Moves += descend();
+
+    if (Stats) {
+      Stats->InitialCost = InitialCost;
+      Stats->Cost = Total.value();
+      Stats->Iterations = Done;
+      Stats->Moves = Moves;
+    }
+    return View.getSolution(Sel);
+  }
+
+private:
+  bool shouldStop(const LocalSearchOptions &Opts,
+                  std::chrono::steady_clock::time_point Start) const {
+    if (Opts.Cancel && Opts.Cancel->load())
+      return true;
+    return Opts.TimeLimit > 0 &&
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         Start)
+                   .count() >= Opts.TimeLimit;
+  }
+
+  void computeContributions() {
+    unsigned N = View.getNumNodes();
+    Contrib.assign(N, {});
+    Total = CostSum();
+    for (unsigned U = 0; U < N; ++U) {
+      unsigned NumOpts = View.getNumOptions(U);
+      Contrib[U].assign(NumOpts, CostSum());
+      for (unsigned V = 0; V < NumOpts; ++V) {
+        Contrib[U][V].add(View.getNodeCosts(U)[V]);
+        for (const auto &A : View.adj(U))
+          Contrib[U][V].add(CostView::getEdgeCost(A, V, Sel[A.Other]));
+      }
+      Total.add(View.getNodeCosts(U)[Sel[U]]);
+      for (const auto &A : View.adj(U))
+        if (!A.Transposed)
+          Total.add(CostView::getEdgeCost(A, Sel[U], Sel[A.Other]));
+    }
+  }
+
+  /// Change node U's selection to V, updating the total and the
+  /// contributions of U's neighbours.
+  void move(unsigned U, unsigned V) {
+    unsigned Old = Sel[U];
+    Total.remove(View.getNodeCosts(U)[Old]);
+    Total.add(View.getNodeCosts(U)[V]);
+    for (const auto &A : View.adj(U)) {
+      Total.remove(CostView::getEdgeCost(A, Old, Sel[A.Other]));
+      Total.add(CostView::getEdgeCost(A, V, Sel[A.Other]));
+
+      // The same matrix seen from the neighbour's side.
+      AdjEntry Back{U, A.Costs, !A.Transposed};
+      auto &Row = Contrib[A.Other];
+      for (unsigned W = 0; W < Row.size(); ++W) {
+        Row[W].remove(CostView::getEdgeCost(Back, W, Old));
+        Row[W].add(CostView::getEdgeCost(Back, W, V));
+      }
+    }
+    Sel[U] = V;
+  }
+
+  /// Find the best move of adjacent nodes U and W to new options A and B,
+  /// with its change in total cost. Returns false if no pair move improves.
+  bool bestPairMove(unsigned U, unsigned W, unsigned &BestA, unsigned &BestB,
+                    PBQPNum &BestDelta) const {
+    // Contrib[U] assumes W at its current selection and vice versa, so the
+    // edges between U and W are corrected for the options being tried.
+    CostSum Before = Contrib[U][Sel[U]];
+    Before.add(Contrib[W][Sel[W]]);
+    Before.remove(edgesBetween(U, W, Sel[U], Sel[W]));
+
+    BestDelta = 0;
+    bool Found = false;
+    for (unsigned A = 0; A < View.getNumOptions(U); ++A) {
+      if (A == Sel[U])
+        continue;
+      CostSum UAfter = Contrib[U][A];
+      UAfter.remove(edgesBetween(U, W, A, Sel[W]));
+      for (unsigned B = 0; B < View.getNumOptions(W); ++B) {
+        if (B == Sel[W])
+          continue;
+        CostSum After = UAfter;
+        After.add(Contrib[W][B]);
+        After.remove(edgesBetween(U, W, Sel[U], B));
+        After.add(edgesBetween(U, W, A, B));
+        PBQPNum Delta = Before.deltaTo(After);
+        if (Delta < BestDelta) {
+          BestDelta = Delta;
+          BestA = A;
+          BestB = B;
+          Found = true;
+        }
+      }
+    }
+    return Found;
+  }
+
+  /// Sum of the costs of the edges between U and W with U at A and W at B.
+  CostSum edgesBetween(unsigned U, unsigned W, unsigned A, unsigned B) const {
+    CostSum Sum;
+    for (const auto &E : View.adj(U))
+      if (E.Other == W)
+        Sum.add(CostView::getEdgeCost(E, A, B));
+    return Sum;
+  }
+
+  /// Apply improving single-node and pair moves until none is left. Returns
+  /// the number of moves applied.
+  uint64_t descend() {
+    unsigned N = View.getNumNodes();
+    std::vector<unsigned> Worklist(N);
+    std::vector<bool> Queued(N, true);
+    for (unsigned U = 0; U < N; ++U)
+      Worklist[U] = N - 1 - U;
+
+    auto Enqueue = [&](unsigned U) {
+      if (!Queued[U]) {
+        Queued[U] = true;
+        Worklist.push_back(U);
+      }
+    };
+    auto EnqueueAround = [&](unsigned U) {
+      Enqueue(U);
+      for (const auto &A : View.adj(U))
+        Enqueue(A.Other);
+    };
+
+    uint64_t Moves = 0;
+    while (!Worklist.empty()) {
+      unsigned U = Worklist.back();
+      Worklist.pop_back();
+      Queued[U] = false;
+
+      unsigned BestV = Sel[U];
+      PBQPNum BestDelta = 0;
+      for (unsigned V = 0; V < View.getNumOptions(U); ++V) {
+        PBQPNum Delta = Contrib[U][Sel[U]].deltaTo(Contrib[U][V]);
+        if (Delta < BestDelta) {
+          BestDelta = Delta;
+          BestV = V;
+        }
+      }
+      if (BestV != Sel[U]) {
+        move(U, BestV);
+        ++Moves;
+        EnqueueAround(U);
+        continue;
+      }
+
+      for (const auto &E : View.adj(U)) {
+        unsigned A, B;
+        PBQPNum Delta;
+        if (bestPairMove(U, E.Other, A, B, Delta)) {
+          unsigned W = E.Other;
+          move(U, A);
+          move(W, B);
+          Moves += 2;
+          EnqueueAround(U);
+          EnqueueAround(W);
+          break;
+        }
+      }
+    }
+    return Moves;
+  }
+
+  /// SplitMix64.
+  uint64_t nextRandom() {
+    uint64_t Z = (RandomState += 0x9e3779b97f4a7c15);
+    Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+    Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+    return Z ^ (Z >> 31);
+  }
+
+  using AdjEntry = CostView::AdjEntry;
+
+  CostView View;
+  std::vector<unsigned> Sel;
+  /// Contrib[U][V] is the cost of U's option V, plus the cost of each of
+  /// U's edges with the other end at its current selection.
+  std::vector<std::vector<CostSum>> Contrib;
+  CostSum Total;
+  uint64_t RandomState = 0;
+};
+
+/// Solve G with the reduction heuristic and refine the result by local
+/// search.
+inline Solution solve(PBQPRAGraph &G, const LocalSearchOptions &Opts,
+                      LocalSearchStats *Stats = nullptr) {
+  if (G.empty())
+    return Solution();
+
+  LocalSearchRefiner Refiner(G);
+  Solution Heuristic = solve(G);
+  return Refiner.refine(Heuristic, Opts, Stats);
+}
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
@@ -1,200 +1,246 @@
+#include "abc_reader.h"
 #include "concertina.h"
+#include "daemon.h"
+#include "graph.h"
+#include "key.h"
+#include "layouts.h"
+#include "smf_reader.h"
+#include "solution_cache.h"
 #include "solver.h"
-#include "MidiFile.h"
-#include <unordered_set>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-
-
-using llvm::PBQP::Solution;
-using llvm::PBQP::RegAlloc::PBQPRAGraph;
-using llvm::PBQP::RegAlloc::solve;
-
-struct ConcertinaGraph {
-  PBQPRAGraph graph;
-  std::unordered_map<PBQPRAGraph::NodeId, std::vector<unsigned>> node_options;
+#include "thread_pool.h"
+#include "tune.h"
+#include "window.h"
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+
+
+struct SolveOptions {
+  // Solve in overlapping windows rather than as one graph when
+  // window.window_notes is non-zero.
+  WindowOptions window{0, 0};
+  // Also solve windowed tunes whole, and report the difference in cost.
+  bool compare_whole = false;
+  SolverOptions solver;
+  // Report solver statistics on stderr.
+  bool verbose = false;
+  const ConcertinaLayout *layout = &CGWheatstoneLayout;
+  // Solve every playable transposition and finger the cheapest.
+  bool best_key = false;
+  // Solve against every known layout and finger the best suited.
+  bool compare_layouts = false;
+  // Threads for solving keys or layouts side by side (one per core if zero).
+  unsigned parallel_jobs = 0;
+  // How the readers relate the notes of a tune.
+  TuneBuilderOptions build;
+  // Where fingerings are looked up before solving, and stored after.
+  SolutionCache *cache = nullptr;
+  // List this many of the cheapest fingerings, if more than one.
+  unsigned alternatives = 1;
 };
 
-unsigned lookupSolution(ConcertinaGraph &graph, PBQPRAGraph::NodeId nid,
-                        unsigned val) {
-  return graph.node_options[nid][val];
-}
-
-auto addNote(ConcertinaGraph &graph, ConcertinaNote note) {
-  // Set all allowed note->reed mappings to have zero cost.
-  auto reed_range = CGWheatstoneReedMapping.equal_range(note);
-  std::vector<unsigned> node_options_vec;
-  for (auto it = reed_range.first; it != reed_range.second; ++it) {
-    for (auto finger : FINGERS) {
-      int col = GetColumn(it->second);
-      int finger_col = GetFingerColumn((ConcertinaReed)finger);
-      if (std::abs(finger_col - col) < 2) {
-        // Fingers are allowed to travel at most one column from their
-        // home column.
-        node_options_vec.push_back((unsigned)it->second | finger);
+bool writeSolverStats(const char *stats_path, const char *trace_path);
+
+bool solveTuneFile(const char *path, FILE *out, const SolveOptions &options);
+bool solveMidiFile(const char *path, FILE *out, const SolveOptions &options);
+bool solveAbcFile(const char *path, FILE *out, const SolveOptions &options);
+bool solveAndPrintTune(const char *name, Tune &tune, FILE *out,
+                       const SolveOptions &options);
+bool printTuneAlternatives(const char *name, const Tune &tune, FILE *out,
+                           const SolveOptions &options);
+std::vector<unsigned> fingerTune(const Tune &tune,
+                                 const ConcertinaLayout &layout,
+                                 const SolveOptions &options,
+                                 SolveReport *report = nullptr,
+                                 ConcertinaGraph *workspace = nullptr);
+const ConcertinaLayout *findLayout(const std::string &name);
+int runBatch(const char *input, const char *output_dir, unsigned jobs,
+             const SolveOptions &options);
+int runDaemon(unsigned jobs, double request_timeout,
+              const SolveOptions &options);
+
+int main(int argc, char **argv) {
+  const char *batch_input = nullptr;
+  const char *output_dir = nullptr;
+  unsigned jobs = 0;
+  const char *stats_path = nullptr;
+  const char *trace_path = nullptr;
+  const char *cache_dir = nullptr;
+  uint64_t cache_mb = 256;
+  bool daemon = false;
+  double request_timeout = 10;
+  SolveOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--batch" && i + 1 < argc) {
+      batch_input = argv[++i];
+    } else if ((arg == "--jobs" || arg == "-j") && i + 1 < argc) {
+      jobs = std::stoul(argv[++i]);
+    } else if ((arg == "--output" || arg == "-o") && i + 1 < argc) {
+      output_dir = argv[++i];
+    } else if (arg == "--window" && i + 1 < argc) {
+      options.window.window_notes = std::stoul(argv[++i]);
+      if (options.window.overlap_notes == 0) {
+        options.window.overlap_notes = options.window.window_notes / 4;
       }
-    }
-  }
-
-  PBQPRAGraph::RawVector Costs(node_options_vec.size(), 0);
-  for (int i = 0; i < node_options_vec.size(); ++i) {
-    unsigned reed = node_options_vec[i];
-    unsigned col = GetColumn((ConcertinaReed)reed);
-
-    // Apply a cost the non-home reeds.
-    if (col > 1) {
-      Costs[i] += col;
-    }
-
-    // Apply a cost to playing buttons with fingers other than the "home"
-    // finger.
-    unsigned row = GetRow((ConcertinaReed)reed);
-    unsigned finger_col = GetFingerColumn((ConcertinaReed)reed);
-    if (row == 0 && col == 3) {
-      // The L02a and R04a buttons are more easily reached by the ring
-      // finger, despite being in the pinky column.
-      if (finger_col == 3) {
-        Costs[i] += 1;
+    } else if (arg == "--overlap" && i + 1 < argc) {
+      options.window.overlap_notes = std::stoul(argv[++i]);
+    } else if (arg == "--onset-window" && i + 1 < argc) {
+      options.build.onset_window_ms = std::stod(argv[++i]);
+    } else if (arg == "--lookback" && i + 1 < argc) {
+      options.build.sequential_lookback = std::stoul(argv[++i]);
+    } else if (arg == "--compare-whole") {
+      options.compare_whole = true;
+    } else if (arg == "--solver" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "heuristic") {
+        options.solver.strategy = SolverStrategy::Heuristic;
+      } else if (name == "exact") {
+        options.solver.strategy = SolverStrategy::TreeDecomposition;
+      } else if (name == "bnb") {
+        options.solver.strategy = SolverStrategy::BranchAndBound;
+      } else if (name == "local") {
+        options.solver.strategy = SolverStrategy::LocalSearch;
+      } else if (name == "portfolio") {
+        options.solver.strategy = SolverStrategy::Portfolio;
+      } else {
+        fprintf(stderr, "Unknown solver: %s\n", name.c_str());
+        return 1;
       }
-    } else {
-      if (col != finger_col) {
-        Costs[i] += 2;
+    } else if (arg == "--max-width" && i + 1 < argc) {
+      options.solver.tree_decomposition.MaxWidth = std::stoul(argv[++i]);
+    } else if (arg == "--solver-threads" && i + 1 < argc) {
+      options.solver.branch_and_bound.Threads = std::stoul(argv[++i]);
+    } else if (arg == "--node-limit" && i + 1 < argc) {
+      options.solver.branch_and_bound.NodeLimit = std::stoull(argv[++i]);
+    } else if (arg == "--time-limit" && i + 1 < argc) {
+      options.solver.branch_and_bound.TimeLimit = std::stod(argv[i + 1]);
+      options.solver.local_search.TimeLimit = std::stod(argv[++i]);
+    } else if (arg == "--iterations" && i + 1 < argc) {
+      options.solver.local_search.Iterations = std::stoull(argv[++i]);
+    } else if (arg == "--budget" && i + 1 < argc) {
+      options.solver.portfolio.budget = std::stod(argv[++i]);
+    } else if (arg == "--verbose" || arg == "-v") {
+      options.verbose = true;
+    } else if (arg == "--layout" && i + 1 < argc) {
+      std::string name = argv[++i];
+      options.layout = findLayout(name);
+      if (!options.layout) {
+        fprintf(stderr, "Unknown layout: %s\n", name.c_str());
+        return 1;
       }
+    } else if (arg == "--best-key") {
+      options.best_key = true;
+    } else if (arg == "--compare-layouts") {
+      options.compare_layouts = true;
+    } else if (arg == "--alternatives" && i + 1 < argc) {
+      options.alternatives = std::stoul(argv[++i]);
+    } else if (arg == "--daemon") {
+      daemon = true;
+    } else if (arg == "--request-timeout" && i + 1 < argc) {
+      request_timeout = std::stod(argv[++i]);
+    } else if (arg == "--cache" && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (arg == "--cache-size" && i + 1 < argc) {
+      cache_mb = std::stoull(argv[++i]);
+    } else if (arg == "--stats" && i + 1 < argc) {
+      stats_path = argv[++i];
+    } else if (arg == "--trace" && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--batch <dir|list-file> [--jobs N] [--output DIR]]\n"
+              "          [--window NOTES [--overlap NOTES] [--compare-whole]]\n"
+              "          [--onset-window MS] [--lookback N]\n"
+              "          [--solver heuristic|exact|bnb|local|portfolio]\n"
+              "          [--max-width N] [--solver-threads N]\n"
+              "          [--node-limit N] [--iterations N]\n"
+              "          [--time-limit SECONDS] [--budget SECONDS] [--verbose]\n"
+              "          [--layout cg|gd] [--best-key] [--compare-layouts]\n"
+              "          [--alternatives N]\n"
+              "          [--cache DIR [--cache-size MB]]\n"
+              "          [--daemon [--jobs N] [--request-timeout SECONDS]]\n"
+              "          [--stats FILE] [--trace FILE]\n",
+              argv[0]);
+      return 1;
     }
   }
+#ifndef CONCERTINA_STATS
+  if (stats_path || trace_path) {
+    fprintf(stderr, "%s: --stats and --trace need a build with "
+                    "CONCERTINA_STATS enabled\n", argv[0]);
+    return 1;
+  }
+#endif
 
-  auto nid = graph.graph.addNode(std::move(Costs));
-  graph.node_options[nid] = std::move(node_options_vec);
-  return nid;
-}
-
-void setupSimultaneousNoteCosts(llvm::PBQP::Matrix &Costs,
-                                std::vector<unsigned> &n_options,
-                                std::vector<unsigned> &m_options) {
-  for (int n = 0; n < n_options.size(); ++n) {
-    unsigned n_reed = n_options[n];
-    for (int m = 0; m < m_options.size(); ++m) {
-      unsigned m_reed = m_options[m];
-      if (n_reed == m_reed) {
-        Costs[n][m] = -INFINITY;
-        return;
-      }
-
-
-      // Mismatched bellows directions are impossible, thus infinite cost.
-      if ((n_reed & DIRECTION_MASK) != (m_reed & DIRECTION_MASK)) {
-        Costs[n][m] = INFINITY;
-      }
-
-      // Using the same finger more than once is impossible.
-      if ((n_reed & FINGER_MASK) == (m_reed & FINGER_MASK)) {
-        Costs[n][m] = INFINITY;
-      }
+  if (options.best_key && options.compare_layouts) {
+    fprintf(stderr, "%s: --best-key and --compare-layouts cannot be combined\n",
+            argv[0]);
+    return 1;
+  }
 
-      if ((n_reed & HAND_MASK) == (m_reed & HAND_MASK)) {
-        // Apply a cost to multiple buttons in the same column.
-        if (GetColumn((ConcertinaReed)n_reed) ==
-            GetColumn((ConcertinaReed)m_reed)) {
-          Costs[n][m] += 3;
-        }
+  if (options.alternatives > 1 &&
+      (options.best_key || options.compare_layouts ||
+       options.window.window_notes != 0)) {
+    fprintf(stderr, "%s: --alternatives cannot be combined with --best-key, "
+                    "--compare-layouts or --window\n",
+            argv[0]);
+    return 1;
+  }
 
-        // Apply a cost to playing upper and lower row simultaneously.
-        auto n_row = GetRow((ConcertinaReed)n_reed);
-        auto m_row = GetRow((ConcertinaReed)m_reed);
-        if ((n_row == 0 && m_row == 2) || (n_row == 2 && m_row == 0)) {
-          Costs[n][m] += 1;
-        }
-      }
+  std::optional<SolutionCache> cache;
+  if (cache_dir) {
+    cache.emplace(cache_dir, cache_mb << 20);
+    if (!cache->valid()) {
+      fprintf(stderr, "%s: unable to open cache directory\n", cache_dir);
+      return 1;
     }
+    options.cache = &*cache;
   }
-}
 
-auto addSimultaneousNoteEdge(ConcertinaGraph &graph, PBQPRAGraph::NodeId n1id,
-                             PBQPRAGraph::NodeId n2id) {
-  auto &n_options = graph.node_options[n1id];
-  auto &m_options = graph.node_options[n2id];
-
-  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
-  setupSimultaneousNoteCosts(Costs, n_options, m_options);
-  return graph.graph.addEdge(n1id, n2id, std::move(Costs));
-}
-
-void setupSequentialNoteCosts(llvm::PBQP::Matrix &Costs,
-                              std::vector<unsigned> n_options,
-                              std::vector<unsigned> m_options) {
-  for (int n = 0; n < n_options.size(); ++n) {
-    unsigned n_reed = n_options[n];
-    for (int m = 0; m < m_options.size(); ++m) {
-      unsigned m_reed = m_options[m];
-
-      // Apply a cost to anything *other* than simple bellows reversal
-      // or a repeated note.
-      if ((n_reed & ~DIRECTION_MASK) != (m_reed & ~DIRECTION_MASK)) {
-        Costs[n][m] += 1;
-      }
-
-      // Apply a cost to changing hands.
-      if ((n_reed & HAND_MASK) != (m_reed & HAND_MASK)) {
-        Costs[n][m] += 1;
-      }
-
-      // Intra-hand rules
-      if ((n_reed & HAND_MASK) == (m_reed & HAND_MASK)) {
-        // Apply a cost to going directly from the upper to the lower row.
-        auto n_row = GetRow((ConcertinaReed)n_reed);
-        auto m_row = GetRow((ConcertinaReed)m_reed);
-        if ((n_row == 0 && m_row == 2) || (n_row == 2 && m_row == 0)) {
-          Costs[n][m] += 1;
-        }
+  // Keys and layouts are solved in parallel, so search each one on a single
+  // thread unless asked otherwise.
+  if ((options.best_key || options.compare_layouts) &&
+      options.solver.branch_and_bound.Threads == 0) {
+    options.solver.branch_and_bound.Threads = 1;
+  }
 
-        if ((n_reed & BUTTON_MASK) != (m_reed & BUTTON_MASK)) {
-          // Apply a cost to sequential notes being assigned to reeds in the
-          // same column.
-          if (GetColumn((ConcertinaReed)n_reed) ==
-              GetColumn((ConcertinaReed)m_reed)) {
-            Costs[n][m] += 4;
-          }
-
-          // Apply a cost to sequential notes being assigned to the same finger.
-          if (GetFingerColumn((ConcertinaReed)n_reed) ==
-              GetFingerColumn((ConcertinaReed)m_reed)) {
-            Costs[n][m] += 2;
-          }
-        }
-      }
+  if (daemon) {
+    // Requests run in parallel, so search each one on a single thread
+    // unless asked otherwise.
+    if (options.solver.branch_and_bound.Threads == 0 && jobs != 1) {
+      options.solver.branch_and_bound.Threads = 1;
+    }
+    int status = runDaemon(jobs, request_timeout, options);
+    if (!writeSolverStats(stats_path, trace_path)) {
+      status = 1;
     }
+    return status;
   }
-}
-
-auto addSequentialNoteEdge(ConcertinaGraph &graph, PBQPRAGraph::NodeId n1id,
-                           PBQPRAGraph::NodeId n2id) {
-  auto &n_options = graph.node_options[n1id];
-  auto &m_options = graph.node_options[n2id];
-
-  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
-  setupSequentialNoteCosts(Costs, n_options, m_options);
-  return graph.graph.addEdge(n1id, n2id, std::move(Costs));
-}
-
-auto addSequentialAndSimultaneousNoteEdge(ConcertinaGraph &graph,
-                                          PBQPRAGraph::NodeId n1id,
-                                          PBQPRAGraph::NodeId n2id) {
-  auto &n_options = graph.node_options[n1id];
-  auto &m_options = graph.node_options[n2id];
-
-  llvm::PBQP::Matrix Costs(n_options.size(), m_options.size(), 0);
-  setupSequentialNoteCosts(Costs, n_options, m_options);
-  setupSimultaneousNoteCosts(Costs, n_options, m_options);
-  return graph.graph.addEdge(n1id, n2id, std::move(Costs));
-}
 
-void test_midi();
+  if (batch_input) {
+    // Tunes already run in parallel, so search each one on a single thread
+    // unless asked otherwise, and solve their keys or layouts one at a time.
+    if (options.solver.branch_and_bound.Threads == 0 && jobs != 1) {
+      options.solver.branch_and_bound.Threads = 1;
+    }
+    if (jobs != 1) {
+      options.parallel_jobs = 1;
+    }
+    int status = runBatch(batch_input, output_dir, jobs, options);
+    if (!writeSolverStats(stats_path, trace_path)) {
+      status = 1;
+    }
+    return status;
+  }
 
-int main() {
-  test_midi();
+  solveMidiFile("sample.mid", stdout, options);
 
-  ConcertinaGraph g{{{}}, {}};
+  ConcertinaGraph g;
   /*
     // Construct the nodes of the PBQP graph, representing the individual notes.
     std::vector<PBQPRAGraph::NodeId> nodes = {
@@ -386,130 +432,619 @@ int main() {
            GetReedAndFinger(lookupSolution(g, n3, solution.getSelection(n3)))
                .c_str());
                */
-  return 0;
+  return writeSolverStats(stats_path, trace_path) ? 0 : 1;
 }
 
-ConcertinaNote midi2note(uint8_t n) {
-  switch (n) {
-    case 84: return ConcertinaNote::C5;
-    case 83: return ConcertinaNote::B5;
-    case 81: return ConcertinaNote::A5;
-    case 80: return ConcertinaNote::Gsharp5;
-    case 79: return ConcertinaNote::G5;
-    case 78: return ConcertinaNote::Fsharp5;
-    case 77: return ConcertinaNote::F5;
-    case 76: return ConcertinaNote::E5;
-    case 75: return ConcertinaNote::Dsharp5;
-    case 74: return ConcertinaNote::D5;
-    case 73: return ConcertinaNote::Csharp5;
-    case 72: return ConcertinaNote::C5;
-    case 71: return ConcertinaNote::B4;
-    case 70: return ConcertinaNote::Bflat4;
-    case 69: return ConcertinaNote::A4;
-    case 68: return ConcertinaNote::Gsharp4;
-    case 67: return ConcertinaNote::G4;
-    case 66: return ConcertinaNote::Fsharp4;
-    case 65: return ConcertinaNote::F4;
-    case 64: return ConcertinaNote::E4;
-    case 63: return ConcertinaNote::Dsharp4;
-    case 62: return ConcertinaNote::D4;
-    case 61: return ConcertinaNote::Csharp4;
-    case 60: return ConcertinaNote::C4;
-    case 59: return ConcertinaNote::B3;
-    case 58: return ConcertinaNote::Bflat3;
-    case 57: return ConcertinaNote::A3;
-    case 55: return ConcertinaNote::G3;
-    case 54: return ConcertinaNote::Fsharp3;
-    case 53: return ConcertinaNote::F3;
-    case 52: return ConcertinaNote::E3;
-    case 48: return ConcertinaNote::C3;
-    case 43: return ConcertinaNote::G2;
-    case 38: return ConcertinaNote::D2;
-    case 36: return ConcertinaNote::C2;
-    default: {
-      fprintf(stderr, "Unknown note: %u\n", n);
-      exit(-1);
+// Write the solver counters and phase totals as JSON to `stats_path`, and
+// the phase timeline as a Chrome trace to `trace_path`, skipping either if
+// it is null. Returns false if a file cannot be written.
+bool writeSolverStats(const char *stats_path, const char *trace_path) {
+#ifdef CONCERTINA_STATS
+  using llvm::PBQP::RegAlloc::SolverStats;
+  auto write = [](const char *path, auto &&writer) {
+    if (!path) {
+      return true;
     }
-  }
+    FILE *out = fopen(path, "w");
+    if (!out) {
+      fprintf(stderr, "%s: unable to open for writing\n", path);
+      return false;
+    }
+    writer(out);
+    return fclose(out) == 0;
+  };
+  bool ok = write(stats_path,
+                  [](FILE *out) { SolverStats::get().writeJSON(out); });
+  return write(trace_path,
+               [](FILE *out) { SolverStats::get().writeTrace(out); }) &&
+         ok;
+#else
+  (void)stats_path;
+  (void)trace_path;
+  return true;
+#endif
 }
 
-void test_midi() {
-  smf::MidiFile midifile;
-  midifile.read("sample.mid");
-
-  while (midifile.getTrackCount() > 1) {
-    midifile.mergeTracks(0, 1);
+// Solve the fingering for every tune in a MIDI or ABC file, chosen by its
+// extension, and print them to `out`.
+bool solveTuneFile(const char *path, FILE *out, const SolveOptions &options) {
+  auto ext = std::filesystem::path(path).extension();
+  if (ext == ".abc") {
+    return solveAbcFile(path, out, options);
   }
-  int tracks = midifile.getTrackCount();
+  return solveMidiFile(path, out, options);
+}
 
-  midifile.sortTracks();
-  midifile.doTimeAnalysis();
-  midifile.linkNotePairs();
+// Solve the fingering for a single MIDI file and print it to `out`. Returns
+// false, after reporting the reason on stderr, if the file cannot be read or
+// contains a note the concertina cannot play.
+bool solveMidiFile(const char *path, FILE *out, const SolveOptions &options) {
+  Tune tune;
+  if (!readMappedMidiTune(path, tune,
+                          !options.best_key && !options.compare_layouts,
+                          options.build)) {
+    return false;
+  }
+  return solveAndPrintTune(path, tune, out, options);
+}
 
-  ConcertinaGraph g{{{}}, {}};
+// Solve the fingering for each tune of an ABC file, printing each after its
+// number and title. Tunes that cannot be read or fingered are reported on
+// stderr and skipped, so one bad tune doesn't lose a whole tune book. Returns
+// false if no tune could be fingered.
+bool solveAbcFile(const char *path, FILE *out, const SolveOptions &options) {
+  unsigned solved = 0;
+  readAbcTunes(
+      path,
+      [&](AbcTune &abc) {
+        fprintf(out, "%sX:%u %s\n", solved ? "\n" : "", abc.number,
+                abc.title.c_str());
+        std::string name = std::string(path) + ":X" +
+                           std::to_string(abc.number);
+        solved += solveAndPrintTune(name.c_str(), abc.tune, out, options);
+      },
+      !options.best_key && !options.compare_layouts, options.build);
+  return solved > 0;
+}
 
-  std::unordered_map<const smf::MidiEvent*, PBQPRAGraph::NodeId> event_map;
-  std::unordered_set<PBQPRAGraph::NodeId> live_notes;
-  std::unordered_set<PBQPRAGraph::NodeId> recently_ended;
-  int last_tick = 0;
-  bool last_event_was_note_on = false;
+// Solve the fingering for `tune` as `options` ask and print it to `out`.
+// `name` identifies the tune in messages. Returns false, after reporting the
+// reason on stderr, if the tune cannot be fingered.
+bool solveAndPrintTune(const char *name, Tune &tune, FILE *out,
+                       const SolveOptions &options) {
+  const ConcertinaLayout *layout = options.layout;
+  std::vector<unsigned> selections;
+  if (options.verbose) {
+    auto edges = countTuneEdges(tune);
+    fprintf(stderr, "%s: %zu notes, %zu simultaneous and %zu sequential "
+                    "edges\n",
+            name, tune.notes.size(), edges[size_t(EdgeKind::Simultaneous)],
+            edges[size_t(EdgeKind::Sequential)]);
+  }
+  if (options.best_key) {
+    auto keys = rankTranspositions(
+        tune,
+        [&options](const Tune &shifted) {
+          return fingerTune(shifted, *options.layout, options);
+        },
+        options.parallel_jobs, *layout);
+    if (keys.empty()) {
+      fprintf(stderr, "%s: no transposition within %d semitones is playable\n",
+              name, kMaxTransposition);
+      return false;
+    }
+    fprintf(out, "Transpositions by fingering cost:\n");
+    for (const auto &key : keys) {
+      fprintf(out, "  %+3d semitones: cost %g\n", key.shift, key.cost);
+    }
+    fprintf(out, "\nFingering transposed %+d semitones:", keys[0].shift);
+    tune = transposeTune(tune, keys[0].shift);
+    selections = std::move(keys[0].selections);
+  } else if (options.compare_layouts) {
+    auto layouts = rankLayouts(
+        tune,
+        [&options](const Tune &tune, const ConcertinaLayout &layout) {
+          return fingerTune(tune, layout, options);
+        },
+        options.parallel_jobs);
+    fprintf(out, "Layouts by suitability:\n");
+    for (const auto &result : layouts) {
+      fprintf(out, "  %s: cost %g, %u unplayable note%s\n",
+              result.layout->name, result.cost, result.unplayable_notes,
+              result.unplayable_notes == 1 ? "" : "s");
+    }
+    fprintf(out, "\nFingering for %s:", layouts[0].layout->name);
+    layout = layouts[0].layout;
+    tune = std::move(layouts[0].playable);
+    selections = std::move(layouts[0].selections);
+  } else if (unsigned unplayable = countUnplayableNotes(tune, *layout)) {
+    fprintf(stderr, "%s: %u notes cannot be played on the %s layout\n", name,
+            unplayable, layout->name);
+    return false;
+  } else if (options.alternatives > 1) {
+    return printTuneAlternatives(name, tune, out, options);
+  } else if (options.window.window_notes != 0) {
+    selections = fingerTune(tune, *layout, options);
+    if (options.compare_whole) {
+      auto windowed_cost = getTuneFingeringCost(tune, selections, *layout);
+      auto whole_cost = getTuneFingeringCost(
+          tune, solveTune(tune, options.solver, nullptr, *layout), *layout);
+      fprintf(stderr,
+              "%s: windowed cost %g, whole-graph cost %g (%+.2f%%)\n", name,
+              windowed_cost, whole_cost,
+              100.0 * (windowed_cost - whole_cost) / std::abs(whole_cost));
+    }
+  } else {
+    SolveReport report;
+    selections = fingerTune(tune, *layout, options, &report);
+    if (options.verbose && report.strategy == "cache") {
+      fprintf(stderr, "%s: fingering from cache, cost %g\n", name,
+              getTuneFingeringCost(tune, selections, *layout));
+    } else if (options.verbose) {
+      fprintf(stderr, "%s: solved with %s", name, report.strategy.c_str());
+      if (options.solver.strategy == SolverStrategy::TreeDecomposition) {
+        const auto &stats = report.tree_decomposition;
+        fprintf(stderr, ", tree-width %s%u, %llu table entries",
+                stats.Exact ? "" : ">", stats.Width,
+                (unsigned long long)stats.TableEntries);
+      }
+      if (options.solver.strategy == SolverStrategy::BranchAndBound) {
+        const auto &stats = report.branch_and_bound;
+        fprintf(stderr, ", %llu nodes, heuristic cost %g, %s",
+                (unsigned long long)stats.Nodes, stats.HeuristicCost,
+                stats.Proven ? "proven optimal" : "stopped at limit");
+      }
+      if (options.solver.strategy == SolverStrategy::LocalSearch) {
+        const auto &stats = report.local_search;
+        fprintf(stderr, ", heuristic cost %g improved by %g in %llu moves",
+                stats.InitialCost, stats.InitialCost - stats.Cost,
+                (unsigned long long)stats.Moves);
+      }
+      for (const auto &result : report.portfolio) {
+        fprintf(stderr, "; %s: cost %g from %u solution%s%s",
+                result.strategy.c_str(), result.cost, result.solutions,
+                result.solutions == 1 ? "" : "s",
+                result.optimal ? " (optimal)" : "");
+      }
+      fprintf(stderr, ", cost %g\n",
+              getTuneFingeringCost(tune, selections, *layout));
+    }
+  }
 
-  for (int i = 0, e = midifile[0].getEventCount(); i != e; ++i) {
-    const auto& event = midifile[0][i];
-    if (event.isNoteOn()) {
-      uint8_t note = event[1];
+  printTuneFingering(out, tune, selections, *layout);
+  return true;
+}
 
-      auto node_id = addNote(g, midi2note(note));
-      event_map[&event] = node_id;
+// Print the cheapest few fingerings of `tune`, as many as `options` ask for,
+// with their costs: the cheapest in full, and each of the others as the
+// notes where it differs from the cheapest. They are always found by the
+// exact solver, whichever solver `options` pick; a tune too wide for it gets
+// only the heuristic's fingering.
+bool printTuneAlternatives(const char *name, const Tune &tune, FILE *out,
+                           const SolveOptions &options) {
+  const ConcertinaLayout &layout = *options.layout;
+  llvm::PBQP::RegAlloc::TreeDecompositionStats stats;
+  auto fingerings = solveTuneAlternatives(
+      tune, options.alternatives, options.solver.tree_decomposition, &stats,
+      layout);
+  if (fingerings.empty()) {
+    printTuneFingering(out, tune, {}, layout);
+    return true;
+  }
+  if (!stats.Exact) {
+    fprintf(stderr, "%s: tree-width exceeds %u, so only the heuristic's "
+                    "fingering is listed\n",
+            name, options.solver.tree_decomposition.MaxWidth);
+  } else if (options.verbose) {
+    fprintf(stderr, "%s: %zu fingering%s by tree-decomposition, tree-width "
+                    "%u, %llu table entries\n",
+            name, fingerings.size(), fingerings.size() == 1 ? "" : "s",
+            stats.Width, (unsigned long long)stats.TableEntries);
+  }
 
-      for (auto simul_id : live_notes) {
-        addSimultaneousNoteEdge(g, simul_id, node_id);
+  const auto &best = fingerings[0];
+  fprintf(out, "Fingerings by cost:\n");
+  for (unsigned i = 0; i < fingerings.size(); ++i) {
+    fprintf(out, "  %2u: cost %g", i + 1, fingerings[i].cost);
+    if (i > 0) {
+      fprintf(out, " (%+g)", fingerings[i].cost - best.cost);
+    }
+    fprintf(out, "\n");
+  }
+  fprintf(out, "\nFingering 1:");
+  printTuneFingering(out, tune, best.selections, layout);
+  for (unsigned i = 1; i < fingerings.size(); ++i) {
+    fprintf(out, "\nFingering %u, changing fingering 1 at:\n", i + 1);
+    for (unsigned n = 0; n < tune.notes.size(); ++n) {
+      unsigned selection = fingerings[i].selections[n];
+      if (selection == best.selections[n]) {
+        continue;
       }
+      const NoteOptions &note_options = layout[getTuneNote(tune, n)];
+      fprintf(out, "Time %d: (%s) for (%s)\n", tune.notes[n].tick,
+              GetReedAndFinger(note_options.options[selection]).c_str(),
+              GetReedAndFinger(note_options.options[best.selections[n]])
+                  .c_str());
+    }
+  }
+  return true;
+}
 
-      live_notes.insert(node_id);
+// What a fingering depends on besides the tune and layout, for keying the
+// solution cache. Thread counts are left out, since they only change how
+// quickly a search runs.
+std::string describeSolveSettings(const SolveOptions &options) {
+  const auto &solver = options.solver;
+  char text[320];
+  snprintf(text, sizeof(text),
+           "strategy %u; window %u/%u; max-width %u/%llu; node-limit %llu; "
+           "time-limit %g/%g; iterations %llu; temperature %g/%g; "
+           "seed %llu; budget %g; restarts %u",
+           unsigned(solver.strategy), options.window.window_notes,
+           options.window.overlap_notes, solver.tree_decomposition.MaxWidth,
+           (unsigned long long)solver.tree_decomposition.MaxTableEntries,
+           (unsigned long long)solver.branch_and_bound.NodeLimit,
+           solver.branch_and_bound.TimeLimit, solver.local_search.TimeLimit,
+           (unsigned long long)solver.local_search.Iterations,
+           solver.local_search.StartTemperature,
+           solver.local_search.EndTemperature,
+           (unsigned long long)solver.local_search.Seed,
+           solver.portfolio.budget, solver.portfolio.restart_threads);
+  return text;
+}
 
-      if (last_event_was_note_on && event.tick - last_tick > 10) {
-        recently_ended.clear();
+// Finger `tune` on `layout`, whole or in windows as `options` ask, reusing a
+// cached fingering if there is one. Only a whole-tune solve fills in
+// `report`; a cache hit reports the strategy as "cache". A whole-tune solve
+// builds its graph in `workspace`, if given, which must be for `layout`.
+std::vector<unsigned> fingerTune(const Tune &tune,
+                                 const ConcertinaLayout &layout,
+                                 const SolveOptions &options,
+                                 SolveReport *report,
+                                 ConcertinaGraph *workspace) {
+  SolutionCacheKey key;
+  if (options.cache) {
+    key = makeSolutionCacheKey(tune, layout, describeSolveSettings(options));
+    if (auto selections = options.cache->lookup(key, tune, layout)) {
+      if (report) {
+        report->strategy = "cache";
       }
+      return std::move(*selections);
+    }
+  }
 
-      for (auto seq_id : recently_ended) {
-        addSequentialNoteEdge(g, seq_id, node_id);
+  std::vector<unsigned> selections;
+  if (options.window.window_notes != 0) {
+    selections =
+        solveTuneWindowed(tune, options.window, options.solver, layout);
+  } else if (workspace) {
+    selections = solveTune(*workspace, tune, options.solver, report);
+  } else {
+    selections = solveTune(tune, options.solver, report, layout);
+  }
+  // A cancelled solve may have fallen back to the heuristic, which isn't
+  // what these settings ask for, so its answer isn't kept.
+  if (options.cache && !isSolveCancelled(options.solver)) {
+    options.cache->store(key, tune, layout, selections);
+  }
+  return selections;
+}
+
+// Collect the tune files named by `input`, which is either a directory
+// (scanned recursively for .mid, .midi and .abc files) or a text file listing
+// one path per line.
+std::vector<std::string> collectBatchInputs(const char *input) {
+  namespace fs = std::filesystem;
+  std::vector<std::string> paths;
+  std::error_code ec;
+  if (fs::is_directory(input, ec)) {
+    for (const auto &entry : fs::recursive_directory_iterator(input, ec)) {
+      auto ext = entry.path().extension().string();
+      if (entry.is_regular_file() &&
+          (ext == ".mid" || ext == ".midi" || ext == ".abc")) {
+        paths.push_back(entry.path().string());
       }
+    }
+    std::sort(paths.begin(), paths.end());
+  } else {
+    std::ifstream list(input);
+    std::string line;
+    while (std::getline(list, line)) {
+      if (!line.empty() && line[0] != '#') {
+        paths.push_back(line);
+      }
+    }
+  }
+  return paths;
+}
 
-      last_event_was_note_on = true;
-    } else if (event.isNoteOff()) {
-      uint8_t note = event[1];
-      
-      auto node_id = event_map[event.getLinkedEvent()];
-      live_notes.erase(node_id);
+// Solve every tune named by `input` on a work-stealing pool, writing one
+// fingering file per tune. A tune that fails to solve is reported and
+// skipped; it does not stop the rest of the batch.
+int runBatch(const char *input, const char *output_dir, unsigned jobs,
+             const SolveOptions &options) {
+  namespace fs = std::filesystem;
+  std::vector<std::string> paths = collectBatchInputs(input);
+  if (paths.empty()) {
+    fprintf(stderr, "%s: no tune files found\n", input);
+    return 1;
+  }
 
-      if (event.tick - last_tick > 10) {
-        recently_ended.clear();
-      }
+  // Each tune's output is named after its file, extension and all, and
+  // under a directory input keeps its place relative to the directory, so
+  // that a/reel.abc, b/reel.abc and reel.mid don't overwrite each other.
+  // Inputs listed in a file are named by file name alone, and must not
+  // collide.
+  std::error_code ec;
+  bool input_is_dir = fs::is_directory(input, ec);
+  std::vector<fs::path> out_paths;
+  std::map<fs::path, const std::string *> claimed;
+  for (const auto &path : paths) {
+    fs::path out_path;
+    if (!output_dir) {
+      out_path = fs::path(path).concat(".txt");
+    } else if (input_is_dir) {
+      out_path = fs::path(output_dir) /
+                 fs::path(path).lexically_relative(input).concat(".txt");
+    } else {
+      out_path =
+          fs::path(output_dir) / fs::path(path).filename().concat(".txt");
+    }
+    out_path = out_path.lexically_normal();
+    auto [it, inserted] = claimed.emplace(out_path, &path);
+    if (!inserted) {
+      fprintf(stderr, "%s: output %s would overwrite that of %s\n",
+              path.c_str(), out_path.c_str(), it->second->c_str());
+      return 1;
+    }
+    out_paths.push_back(std::move(out_path));
+  }
+  for (const auto &out_path : out_paths) {
+    if (out_path.has_parent_path()) {
+      fs::create_directories(out_path.parent_path(), ec);
+    }
+  }
+
+  std::atomic<unsigned> failures{0};
+  {
+    WorkStealingPool pool(jobs);
+    for (unsigned i = 0; i < paths.size(); ++i) {
+      pool.submit([&path = paths[i], &out_path = out_paths[i], &options,
+                   &failures] {
+        FILE *out = fopen(out_path.c_str(), "w");
+        if (!out) {
+          fprintf(stderr, "%s: unable to open output %s\n", path.c_str(),
+                  out_path.c_str());
+          ++failures;
+          return;
+        }
 
-      recently_ended.insert(node_id);
-      last_event_was_note_on = false;
+        bool ok = false;
+        try {
+          ok = solveTuneFile(path.c_str(), out, options);
+        } catch (const std::exception &e) {
+          fprintf(stderr, "%s: %s\n", path.c_str(), e.what());
+        }
+        fclose(out);
+        if (!ok) {
+          fs::remove(out_path);
+          ++failures;
+        }
+      });
     }
+  }
 
-    last_tick = event.tick;
+  fprintf(stderr, "Solved %zu of %zu tunes\n", paths.size() - failures,
+          paths.size());
+  return failures == 0 ? 0 : 1;
+}
+
+// The layout named `name` on the command line, or null if there is none.
+const ConcertinaLayout *findLayout(const std::string &name) {
+  if (name == "cg") {
+    return &CGWheatstoneLayout;
+  }
+  if (name == "gd") {
+    return &GDWheatstoneLayout;
   }
+  return nullptr;
+}
 
-  Solution solution = solve(g.graph);
+// This thread's graph for solving on `layout`, kept between tunes so that a
+// daemon worker reuses the costs it has built and the arena that holds them.
+ConcertinaGraph &getThreadWorkspace(const ConcertinaLayout &layout) {
+  thread_local std::vector<std::unique_ptr<ConcertinaGraph>> workspaces;
+  for (auto &workspace : workspaces) {
+    if (workspace->layout == &layout) {
+      return *workspace;
+    }
+  }
+  workspaces.push_back(std::make_unique<ConcertinaGraph>(layout));
+  return *workspaces.back();
+}
+
+// Read the tunes a daemon request carries: every tune of the MIDI or ABC
+// file at "path", every tune of the ABC text "abc", or one tune of "notes",
+// each [pitch, start tick, end tick] at 480 ticks a beat. Returns false
+// after setting `error` if they cannot be read.
+bool readDaemonTunes(const llvm::json::Object &request,
+                     const SolveOptions &options,
+                     std::vector<std::pair<std::string, Tune>> &tunes,
+                     std::string &error) {
+  auto visit_abc = [&tunes](const char *name) {
+    return [&tunes, name](AbcTune &abc) {
+      tunes.emplace_back(std::string(name) + ":X" +
+                             std::to_string(abc.number),
+                         std::move(abc.tune));
+    };
+  };
+
+  if (auto path = request.getString("path")) {
+    std::string name = path->str();
+    if (std::filesystem::path(name).extension() == ".abc") {
+      readAbcTunes(name.c_str(), visit_abc(name.c_str()), true,
+                   options.build);
+    } else {
+      Tune tune;
+      if (readMappedMidiTune(name.c_str(), tune, true, options.build)) {
+        tunes.emplace_back(name, std::move(tune));
+      }
+    }
+  } else if (auto abc = request.getString("abc")) {
+    readAbcText("abc", std::string_view(abc->data(), abc->size()),
+                visit_abc("abc"), true, options.build);
+  } else if (const llvm::json::Array *notes = request.getArray("notes")) {
+    // Note-offs come before note-ons at the same tick, as in MIDI files.
+    struct Event {
+      int64_t tick;
+      bool on;
+      unsigned index;
+    };
+    std::vector<Event> events;
+    std::vector<uint8_t> pitches;
+    for (const llvm::json::Value &value : *notes) {
+      const llvm::json::Array *note = value.getAsArray();
+      if (!note || note->size() != 3 || !(*note)[0].getAsInteger() ||
+          !(*note)[1].getAsInteger() || !(*note)[2].getAsInteger()) {
+        error = "notes must be [pitch, start tick, end tick]";
+        return false;
+      }
+      int64_t pitch = *(*note)[0].getAsInteger();
+      if (pitch < 0 || pitch > 127 || !midi2note(pitch)) {
+        error = "unknown note " + std::to_string(pitch);
+        return false;
+      }
+      unsigned index = pitches.size();
+      pitches.push_back(pitch);
+      events.push_back({*(*note)[1].getAsInteger(), true, index});
+      events.push_back({*(*note)[2].getAsInteger(), false, index});
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const Event &a, const Event &b) {
+                       return a.tick != b.tick ? a.tick < b.tick
+                                               : a.on < b.on;
+                     });
+    Tune tune;
+    TuneBuilder builder(tune, options.build);
+    std::vector<unsigned> note_ids(pitches.size(), ~0u);
+    for (const Event &event : events) {
+      if (event.on) {
+        note_ids[event.index] = builder.noteOn(pitches[event.index],
+                                               event.tick);
+      } else if (note_ids[event.index] != ~0u) {
+        builder.noteOff(note_ids[event.index], event.tick);
+      }
+    }
+    tunes.emplace_back("notes", std::move(tune));
+  } else {
+    error = "request has no path, abc or notes";
+    return false;
+  }
+
+  if (tunes.empty()) {
+    error = "no tune could be read";
+    return false;
+  }
+  return true;
+}
 
-  last_tick = 0;
-  bool first = true;
-  for (int i = 0, e = midifile[0].getEventCount(); i != e; ++i) {
-    const auto& event = midifile[0][i];
-    if (!event.isNoteOn()) continue;
-    if (first || event.tick - last_tick > 10) {
-      printf("\nTime %d:", event.tick);
+// Answer one daemon request with the fingering of each tune it carries.
+// The request may pick a "layout" other than the server's.
+llvm::json::Object solveDaemonRequest(const llvm::json::Object &request,
+                                      const std::atomic<bool> &cancel,
+                                      const SolveOptions &defaults) {
+  SolveOptions options = defaults;
+  options.solver.tree_decomposition.Cancel = &cancel;
+  options.solver.branch_and_bound.Cancel = &cancel;
+  options.solver.local_search.Cancel = &cancel;
+  if (auto timeout = request.getNumber("timeout")) {
+    options.solver.portfolio.budget =
+        std::min(options.solver.portfolio.budget, *timeout);
+  }
+  auto fail = [](std::string message) {
+    return llvm::json::Object{{"ok", false}, {"error", std::move(message)}};
+  };
+  if (auto name = request.getString("layout")) {
+    options.layout = findLayout(name->str());
+    if (!options.layout) {
+      return fail("unknown layout " + name->str());
     }
-    auto node = event_map[&event];
-    unsigned n1reed = lookupSolution(g, node, solution.getSelection(node));
+  }
+  const ConcertinaLayout &layout = *options.layout;
 
-    printf(" (%s)", GetReedAndFinger(n1reed).c_str()); 
-    last_tick = event.tick;
-    first = false;
+  std::vector<std::pair<std::string, Tune>> tunes;
+  std::string error;
+  if (!readDaemonTunes(request, options, tunes, error)) {
+    return fail(error);
+  }
+
+  llvm::json::Array results;
+  for (auto &[name, tune] : tunes) {
+    if (unsigned unplayable = countUnplayableNotes(tune, layout)) {
+      return fail(name + ": " + std::to_string(unplayable) +
+                  " notes cannot be played on the " + layout.name +
+                  " layout");
+    }
+    auto selections = fingerTune(tune, layout, options, nullptr,
+                                 &getThreadWorkspace(layout));
+    if (cancel) {
+      return fail("timed out");
+    }
+    llvm::json::Array notes;
+    for (unsigned i = 0; i < tune.notes.size(); ++i) {
+      unsigned reed = layout[getTuneNote(tune, i)].options[selections[i]];
+      notes.push_back(llvm::json::Object{
+          {"tick", tune.notes[i].tick},
+          {"pitch", tune.notes[i].pitch},
+          {"fingering", GetReedAndFinger(reed)},
+      });
+    }
+    auto cost = getTuneFingeringCost(tune, selections, layout);
+    results.push_back(llvm::json::Object{
+        {"name", name},
+        {"cost", std::isfinite(cost) ? llvm::json::Value(cost) : nullptr},
+        {"notes", std::move(notes)},
+    });
   }
-  printf("\n");
-}
\ No newline at end of file
+  return llvm::json::Object{{"ok", true}, {"tunes", std::move(results)}};
+}
+
+// Serve fingering requests from stdin until it ends, answering on stdout,
+// then report the latencies on stderr.
+int runDaemon(unsigned jobs, double request_timeout,
+              const SolveOptions &options) {
+  auto warm_up = [&options] {
+    // A short scale on each layout builds the workers' graphs and faults
+    // in the solver before the first request.
+    Tune scale;
+    TuneBuilder builder(scale, options.build);
+    for (uint8_t pitch : {60, 62, 64, 65, 67}) {
+      int tick = scale.notes.size() * 480;
+      builder.noteOff(builder.noteOn(pitch, tick), tick + 480);
+    }
+    for (const ConcertinaLayout *layout : AllLayouts) {
+      SolveOptions warm_options = options;
+      warm_options.cache = nullptr;
+      fingerTune(scale, *layout, warm_options, nullptr,
+                 &getThreadWorkspace(*layout));
+    }
+  };
+  SolverDaemon daemon(
+      [&options](const llvm::json::Object &request,
+                 const std::atomic<bool> &cancel) {
+        return solveDaemonRequest(request, cancel, options);
+      },
+      jobs, request_timeout, stdout, warm_up);
+  daemon.serve(std::cin);
+
+  llvm::json::Object stats = daemon.stats();
+  auto get = [&stats](llvm::StringRef key) {
+    return (long long)stats.getInteger(key).getValueOr(0);
+  };
+  fprintf(stderr,
+          "%lld requests, %lld timed out; latency p50 %lld us, p99 %lld us, "
+          "max %lld us\n",
+          get("requests"), get("timeouts"), get("p50_us"), get("p99_us"),
+          get("max_us"));
+  return 0;
+}
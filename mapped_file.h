@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A file mapped read-only into memory for as long as this lives.
+class MappedFile {
+public:
+  explicit MappedFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        bytes = static_cast<const uint8_t *>(p);
+        length = st.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (bytes) {
+      munmap(const_cast<uint8_t *>(bytes), length);
+    }
+  }
+
+  bool valid() const { return bytes != nullptr; }
+  const uint8_t *begin() const { return bytes; }
+  const uint8_t *end() const { return bytes + length; }
+
+private:
+  const uint8_t *bytes = nullptr;
+  size_t length = 0;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "tune.h"
+#include "MidiFile.h"
+#include <cstdio>
+
+// Read a MIDI file into a Tune, relating its notes as `build_options` ask.
+// Returns false, after reporting the reason on stderr, if the file cannot be
+// read or, unless `check_playable` is false, contains a note the concertina
+// cannot play.
+bool readMidiTune(const char *path, Tune &tune, bool check_playable = true,
+                  const TuneBuilderOptions &build_options = {}) {
+  PBQP_TRACE_SCOPE("parse");
+  smf::MidiFile midifile;
+  if (!midifile.read(path)) {
+    fprintf(stderr, "%s: unable to read MIDI file\n", path);
+    return false;
+  }
+
+  while (midifile.getTrackCount() > 1) {
+    midifile.mergeTracks(0, 1);
+  }
+
+  midifile.sortTracks();
+  midifile.doTimeAnalysis();
+
+  NoteOnStacks note_ons;
+  TuneBuilder builder(tune, build_options);
+  int ticks_per_quarter = midifile.getTicksPerQuarterNote();
+  builder.setTickSeconds(0.5 / ticks_per_quarter);
+  for (int i = 0, e = midifile[0].getEventCount(); i != e; ++i) {
+    const auto& event = midifile[0][i];
+    if (event.isTempo()) {
+      builder.setTickSeconds(event.getTempoSPT(ticks_per_quarter));
+    } else if (event.isNoteOn()) {
+      uint8_t note = event[1];
+      if (check_playable && !midi2note(note)) {
+        fprintf(stderr, "%s: unknown note %u at tick %d\n", path, note,
+                event.tick);
+        return false;
+      }
+
+      note_ons.noteOn(event.getChannel(), note,
+                      builder.noteOn(note, event.tick));
+    } else if (event.isNoteOff()) {
+      if (auto note_id = note_ons.noteOff(event.getChannel(), event[1])) {
+        builder.noteOff(*note_id, event.tick);
+      }
+    }
+  }
+  return true;
+}
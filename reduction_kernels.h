@@ -0,0 +1,321 @@
+#pragma once
+
+#include "llvm/CodeGen/PBQP/Math.h"
+#include "llvm/CodeGen/PBQP/ReductionRules.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONCERTINA_X86_KERNELS 1
+#endif
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+// R1 and R2 reductions for the small cost matrices of fingering graphs.
+//
+// Both rules come down to a min-plus product: each entry of the result is
+// the least, over the options of the node being reduced, of a sum of costs.
+// The generic rules in ReductionRules.h compute it one entry at a time, and
+// R2 first copies any edge matrix it needs the other way round onto the
+// heap. Here the minimum is taken over a whole row of the result at once,
+// with SSE or AVX2 when the CPU has them, reading the edge matrix's rows in
+// place or, when it has to be transposed, from a fixed-size aligned buffer
+// on the stack. Every entry is still computed as the same sums, added in
+// the same order, and compared with the same `C < Min` test, so the
+// reductions, and hence the solutions, are bit-identical to the generic
+// rules.
+
+/// Largest cost vector the kernels take. Longer ones, which fingering graphs
+/// never have, fall back to the generic rules.
+constexpr unsigned MinPlusCapacity = 16;
+
+enum class MinPlusKernel {
+  /// The generic rules from ReductionRules.h.
+  Generic,
+  Scalar,
+  SSE,
+  AVX2,
+};
+
+inline const char *getMinPlusKernelName(MinPlusKernel K) {
+  switch (K) {
+  case MinPlusKernel::Generic: return "generic";
+  case MinPlusKernel::Scalar: return "scalar";
+  case MinPlusKernel::SSE: return "sse";
+  case MinPlusKernel::AVX2: return "avx2";
+  }
+  llvm_unreachable("Unknown min-plus kernel");
+}
+
+/// Whether this CPU can run kernel K.
+inline bool isMinPlusKernelSupported(MinPlusKernel K) {
+  switch (K) {
+  case MinPlusKernel::Generic:
+  case MinPlusKernel::Scalar:
+    return true;
+#ifdef CONCERTINA_X86_KERNELS
+  case MinPlusKernel::SSE:
+    return __builtin_cpu_supports("sse2");
+  case MinPlusKernel::AVX2:
+    return __builtin_cpu_supports("avx2");
+#else
+  case MinPlusKernel::SSE:
+  case MinPlusKernel::AVX2:
+    return false;
+#endif
+  }
+  return false;
+}
+
+inline MinPlusKernel &activeMinPlusKernelRef() {
+  static MinPlusKernel K = [] {
+    for (MinPlusKernel K : {MinPlusKernel::AVX2, MinPlusKernel::SSE})
+      if (isMinPlusKernelSupported(K))
+        return K;
+    return MinPlusKernel::Scalar;
+  }();
+  return K;
+}
+
+/// The kernel the reductions use: the widest one this CPU supports, unless
+/// overridden by setMinPlusKernel.
+inline MinPlusKernel getMinPlusKernel() { return activeMinPlusKernelRef(); }
+
+/// Use kernel K for all later reductions, if the CPU supports it. Meant for
+/// benchmarking; call it before any solving starts.
+inline bool setMinPlusKernel(MinPlusKernel K) {
+  if (!isMinPlusKernelSupported(K))
+    return false;
+  activeMinPlusKernelRef() = K;
+  return true;
+}
+
+/// A row-major operand for the kernels: Rows x Cols costs, with Stride
+/// entries from one row to the next.
+struct MinPlusOperand {
+  const PBQPNum *Data;
+  unsigned Stride;
+};
+
+/// Fixed-capacity, aligned storage for an edge matrix that has to be
+/// transposed before the kernels can read its rows.
+struct alignas(32) TransposedCosts {
+  PBQPNum Data[MinPlusCapacity * MinPlusCapacity];
+
+  template <typename MatrixT>
+  MinPlusOperand load(const MatrixT &M, unsigned Rows, unsigned Cols) {
+    for (unsigned R = 0; R < Rows; ++R)
+      for (unsigned C = 0; C < Cols; ++C)
+        Data[R * MinPlusCapacity + C] = M[C][R];
+    return {Data, MinPlusCapacity};
+  }
+};
+
+/// Rows of M as an operand, transposing it into Buffer if asked.
+template <typename MatrixT>
+MinPlusOperand getOperand(const MatrixT &M, bool Transpose,
+                          TransposedCosts &Buffer) {
+  if (Transpose)
+    return Buffer.load(M, M.getCols(), M.getRows());
+  return {M[0], M.getCols()};
+}
+
+/// Out[C] = min over R < Rows of (B[R] + A[R][C]) + Add2[R], for C < Cols.
+/// Add2 is left out when null. The sums are formed and compared in the
+/// same order as in the generic rules.
+inline void minPlusScalar(MinPlusOperand A, const PBQPNum *B,
+                          const PBQPNum *Add2, unsigned Rows, unsigned C,
+                          unsigned Cols, PBQPNum *Out) {
+  for (; C < Cols; ++C) {
+    PBQPNum Min = B[0] + A.Data[C];
+    if (Add2)
+      Min = Min + Add2[0];
+    for (unsigned R = 1; R < Rows; ++R) {
+      PBQPNum V = B[R] + A.Data[R * A.Stride + C];
+      if (Add2)
+        V = V + Add2[R];
+      if (V < Min)
+        Min = V;
+    }
+    Out[C] = Min;
+  }
+}
+
+#ifdef CONCERTINA_X86_KERNELS
+// _mm_min_ps(V, Min) is `V < Min ? V : Min` lane by lane, including when
+// either is a NaN, which is exactly the scalar update.
+
+__attribute__((target("sse2"))) inline void
+minPlusSSE(MinPlusOperand A, const PBQPNum *B, const PBQPNum *Add2,
+           unsigned Rows, unsigned Cols, PBQPNum *Out) {
+  unsigned C = 0;
+  for (; C + 4 <= Cols; C += 4) {
+    __m128 Min = _mm_add_ps(_mm_set1_ps(B[0]), _mm_loadu_ps(A.Data + C));
+    if (Add2)
+      Min = _mm_add_ps(Min, _mm_set1_ps(Add2[0]));
+    for (unsigned R = 1; R < Rows; ++R) {
+      __m128 V = _mm_add_ps(_mm_set1_ps(B[R]),
+                            _mm_loadu_ps(A.Data + R * A.Stride + C));
+      if (Add2)
+        V = _mm_add_ps(V, _mm_set1_ps(Add2[R]));
+      Min = _mm_min_ps(V, Min);
+    }
+    _mm_storeu_ps(Out + C, Min);
+  }
+  // SSE has no masked load, so the last few columns are done one by one.
+  minPlusScalar(A, B, Add2, Rows, C, Cols, Out);
+}
+
+__attribute__((target("avx2"))) inline void
+minPlusAVX2(MinPlusOperand A, const PBQPNum *B, const PBQPNum *Add2,
+            unsigned Rows, unsigned Cols, PBQPNum *Out) {
+  // Lanes past the end of a row are masked off, so rows can be read in
+  // place without running off the end of the matrix.
+  static const int32_t Masks[16] = {-1, -1, -1, -1, -1, -1,
+                                                -1, -1, 0,  0,  0,  0,
+                                                0,  0,  0,  0};
+  for (unsigned C = 0; C < Cols; C += 8) {
+    unsigned Left = std::min(Cols - C, 8u);
+    __m256i Mask = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(Masks + 8 - Left));
+    __m256 Min = _mm256_add_ps(_mm256_set1_ps(B[0]),
+                               _mm256_maskload_ps(A.Data + C, Mask));
+    if (Add2)
+      Min = _mm256_add_ps(Min, _mm256_set1_ps(Add2[0]));
+    for (unsigned R = 1; R < Rows; ++R) {
+      __m256 V = _mm256_add_ps(
+          _mm256_set1_ps(B[R]),
+          _mm256_maskload_ps(A.Data + R * A.Stride + C, Mask));
+      if (Add2)
+        V = _mm256_add_ps(V, _mm256_set1_ps(Add2[R]));
+      Min = _mm256_min_ps(V, Min);
+    }
+    _mm256_maskstore_ps(Out + C, Mask, Min);
+  }
+}
+#endif
+
+/// Dispatch a min-plus row product to the active kernel.
+inline void minPlus(MinPlusOperand A, const PBQPNum *B, const PBQPNum *Add2,
+                    unsigned Rows, unsigned Cols, PBQPNum *Out) {
+  switch (getMinPlusKernel()) {
+#ifdef CONCERTINA_X86_KERNELS
+  case MinPlusKernel::AVX2:
+    return minPlusAVX2(A, B, Add2, Rows, Cols, Out);
+  case MinPlusKernel::SSE:
+    return minPlusSSE(A, B, Add2, Rows, Cols, Out);
+#endif
+  default:
+    return minPlusScalar(A, B, Add2, Rows, 0, Cols, Out);
+  }
+}
+
+/// R1 with the min-plus kernels: fold the costs of degree-one node NId into
+/// its neighbour. Equivalent to PBQP::applyR1.
+template <typename GraphT>
+void applyMinPlusR1(GraphT &G, typename GraphT::NodeId NId) {
+  using NodeId = typename GraphT::NodeId;
+  using EdgeId = typename GraphT::EdgeId;
+  using Vector = typename GraphT::Vector;
+  using Matrix = typename GraphT::Matrix;
+  using RawVector = typename GraphT::RawVector;
+
+  assert(G.getNodeDegree(NId) == 1 && "R1 applied to node with degree != 1.");
+
+  EdgeId EId = *G.adjEdgeIds(NId).begin();
+  NodeId MId = G.getEdgeOtherNodeId(EId, NId);
+
+  const Matrix &ECosts = G.getEdgeCosts(EId);
+  const Vector &XCosts = G.getNodeCosts(NId);
+  unsigned XLen = XCosts.getLength();
+  unsigned YLen = G.getNodeCosts(MId).getLength();
+  if (getMinPlusKernel() == MinPlusKernel::Generic || XLen == 0 ||
+      XLen > MinPlusCapacity || YLen > MinPlusCapacity)
+    return PBQP::applyR1(G, NId);
+
+  // Rows are NId's options and columns its neighbour's. The generic rule
+  // adds the node cost to the edge cost; float addition commutes, so taking
+  // them the other way round changes nothing.
+  TransposedCosts Buffer;
+  MinPlusOperand E =
+      getOperand(ECosts, NId != G.getEdgeNode1Id(EId), Buffer);
+  PBQPNum Min[MinPlusCapacity];
+  minPlus(E, &XCosts[0], nullptr, XLen, YLen, Min);
+
+  RawVector YCosts = G.getNodeCosts(MId);
+  for (unsigned J = 0; J < YLen; ++J)
+    YCosts[J] += Min[J];
+  G.setNodeCosts(MId, YCosts);
+  G.disconnectEdge(EId, MId);
+}
+
+/// R2 with the min-plus kernels: replace degree-two node NId by an edge
+/// between its neighbours. Equivalent to PBQP::applyR2.
+template <typename GraphT>
+void applyMinPlusR2(GraphT &G, typename GraphT::NodeId NId) {
+  using NodeId = typename GraphT::NodeId;
+  using EdgeId = typename GraphT::EdgeId;
+  using Vector = typename GraphT::Vector;
+  using Matrix = typename GraphT::Matrix;
+  using RawMatrix = typename GraphT::RawMatrix;
+
+  assert(G.getNodeDegree(NId) == 2 && "R2 applied to node with degree != 2.");
+
+  const Vector &XCosts = G.getNodeCosts(NId);
+
+  typename GraphT::AdjEdgeItr AEItr = G.adjEdgeIds(NId).begin();
+  EdgeId YXEId = *AEItr, ZXEId = *(++AEItr);
+
+  NodeId YNId = G.getEdgeOtherNodeId(YXEId, NId),
+         ZNId = G.getEdgeOtherNodeId(ZXEId, NId);
+
+  unsigned XLen = XCosts.getLength(), YLen = G.getNodeCosts(YNId).getLength(),
+           ZLen = G.getNodeCosts(ZNId).getLength();
+  if (getMinPlusKernel() == MinPlusKernel::Generic || XLen == 0 ||
+      XLen > MinPlusCapacity || YLen > MinPlusCapacity ||
+      ZLen > MinPlusCapacity)
+    return PBQP::applyR2(G, NId);
+
+  // Rows of XZ are NId's options and columns Z's, so that each row of
+  // Delta is a min-plus product over XZ.
+  TransposedCosts Buffer;
+  MinPlusOperand XZ = getOperand(G.getEdgeCosts(ZXEId),
+                                 G.getEdgeNode1Id(ZXEId) != NId, Buffer);
+  const Matrix &YXECosts = G.getEdgeCosts(YXEId);
+  bool YIsNode1 = G.getEdgeNode1Id(YXEId) == YNId;
+
+  RawMatrix Delta(YLen, ZLen);
+  PBQPNum YX[MinPlusCapacity];
+  for (unsigned I = 0; I < YLen; ++I) {
+    const PBQPNum *YXRow = YXECosts[I];
+    if (!YIsNode1) {
+      for (unsigned K = 0; K < XLen; ++K)
+        YX[K] = YXECosts[K][I];
+      YXRow = YX;
+    }
+    // Each entry is (YX + XZ) + X, as in the generic rule.
+    minPlus(XZ, YXRow, &XCosts[0], XLen, ZLen, Delta[I]);
+  }
+
+  EdgeId YZEId = G.findEdge(YNId, ZNId);
+  if (YZEId == G.invalidEdgeId()) {
+    YZEId = G.addEdge(YNId, ZNId, Delta);
+  } else {
+    const Matrix &YZECosts = G.getEdgeCosts(YZEId);
+    if (YNId == G.getEdgeNode1Id(YZEId))
+      G.updateEdgeCosts(YZEId, Delta + YZECosts);
+    else
+      G.updateEdgeCosts(YZEId, Delta.transpose() + YZECosts);
+  }
+
+  G.disconnectEdge(YXEId, YNId);
+  G.disconnectEdge(ZXEId, ZNId);
+}
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "concertina.h"
+#include "mapped_file.h"
+#include "tune.h"
+#include "llvm/Support/MD5.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A persistent cache of fingerings, shared by every process pointed at the
+// same directory, so that re-running a batch skips building and solving the
+// tunes it has already fingered.
+//
+// Entries are addressed by a hash of everything that decides the fingering:
+// the tune's notes and edges, the layout's option and cost tables, the
+// version of the cost rules, and the solver settings. Each entry is a file
+// holding a small header and the reed|finger byte chosen for each note, read
+// in place through a memory map. Entries are written to a temporary file and
+// renamed into place, so readers only ever see whole entries, and a reader
+// holding an entry's map is unaffected by another process evicting it.
+//
+// The cache is kept near its size limit by deleting the least recently used
+// entries. Each process counts the bytes it has seen, rescanning the
+// directory when that passes the limit, so several processes writing at once
+// may overshoot it for a while. Only files named as entries are counted or
+// deleted, so other files in the directory are left alone; temporary files
+// are deleted only once they are old enough that no writer can still be
+// about to rename them into place.
+
+using SolutionCacheKey = std::array<uint8_t, 16>;
+
+// The key for fingering `tune` on `layout`. `settings` describes whatever
+// else the fingering depends on, such as the solver and its options.
+SolutionCacheKey makeSolutionCacheKey(const Tune &tune,
+                                      const ConcertinaLayout &layout,
+                                      std::string_view settings) {
+  llvm::MD5 hash;
+  auto add = [&hash](uint32_t value) {
+    uint8_t bytes[4] = {uint8_t(value), uint8_t(value >> 8),
+                        uint8_t(value >> 16), uint8_t(value >> 24)};
+    hash.update(bytes);
+  };
+  add(kCostRulesVersion);
+  add(settings.size());
+  hash.update(llvm::StringRef(settings.data(), settings.size()));
+
+  for (const auto &note : layout.notes) {
+    add(note.num_options);
+    hash.update(llvm::makeArrayRef(note.options.data(), note.num_options));
+    hash.update(llvm::makeArrayRef(note.costs.data(), note.num_options));
+  }
+
+  // Notes are hashed as the concertina notes they map to, so that pitches
+  // the layout treats alike, and the timing of the notes, don't matter.
+  add(tune.notes.size());
+  for (unsigned i = 0; i < tune.notes.size(); ++i) {
+    add(unsigned(getTuneNote(tune, i)));
+  }
+  add(tune.edges.size());
+  for (const auto &edge : tune.edges) {
+    add(edge.from);
+    add(edge.to);
+    add(unsigned(edge.kind));
+  }
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  return result;
+}
+
+class SolutionCache {
+public:
+  // Use the cache in directory `dir`, creating it if need be, and keep it
+  // to about `max_bytes`.
+  SolutionCache(std::string dir, uint64_t max_bytes)
+      : dir(std::move(dir)), max_bytes(max_bytes) {
+    std::error_code ec;
+    std::filesystem::create_directories(this->dir, ec);
+    ok = std::filesystem::is_directory(this->dir, ec);
+    if (ok) {
+      bytes = totalSize(scan());
+    }
+  }
+
+  // Whether the cache directory could be opened.
+  bool valid() const { return ok; }
+
+  // The fingering stored under `key` for `tune` on `layout`, as a selected
+  // option index per note, if there is one.
+  std::optional<std::vector<unsigned>>
+  lookup(const SolutionCacheKey &key, const Tune &tune,
+         const ConcertinaLayout &layout) {
+    std::string path = entryPath(key);
+    MappedFile file(path.c_str());
+    if (!file.valid() || size_t(file.end() - file.begin()) < sizeof(Header)) {
+      return std::nullopt;
+    }
+    Header header;
+    std::memcpy(&header, file.begin(), sizeof(header));
+    const uint8_t *reeds = file.begin() + sizeof(header);
+    if (std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 ||
+        header.format != kFormat || header.key != key ||
+        header.num_notes != tune.notes.size() ||
+        size_t(file.end() - reeds) != header.num_notes) {
+      return std::nullopt;
+    }
+
+    std::vector<unsigned> selections(tune.notes.size());
+    for (unsigned i = 0; i < selections.size(); ++i) {
+      const NoteOptions &options = layout[getTuneNote(tune, i)];
+      auto end = options.options.begin() + options.num_options;
+      auto found = std::find(options.options.begin(), end, reeds[i]);
+      if (found == end) {
+        return std::nullopt;
+      }
+      selections[i] = found - options.options.begin();
+    }
+
+    // Mark the entry as recently used.
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return selections;
+  }
+
+  // Store `selections`, the fingering of `tune` on `layout`, under `key`.
+  // Failures are ignored: the fingering is simply solved again next time.
+  void store(const SolutionCacheKey &key, const Tune &tune,
+             const ConcertinaLayout &layout,
+             const std::vector<unsigned> &selections) {
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.format = kFormat;
+    header.key = key;
+    header.num_notes = selections.size();
+    std::vector<uint8_t> entry(sizeof(header) + selections.size());
+    std::memcpy(entry.data(), &header, sizeof(header));
+    for (unsigned i = 0; i < selections.size(); ++i) {
+      entry[sizeof(header) + i] =
+          layout[getTuneNote(tune, i)].options[selections[i]];
+    }
+
+    std::string path = entryPath(key);
+    std::string temp = path + "." + std::to_string(getpid()) + "." +
+                       std::to_string(next_temp++) + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      return;
+    }
+    bool written = write(fd, entry.data(), entry.size()) ==
+                   ssize_t(entry.size());
+    if (close(fd) != 0 || !written || rename(temp.c_str(), path.c_str())) {
+      unlink(temp.c_str());
+      return;
+    }
+
+    if ((bytes += entry.size()) > max_bytes) {
+      evict();
+    }
+  }
+
+private:
+  // The start of an entry, which the reed|finger byte of each note
+  // follows. Entries are in the byte order of the machine that wrote them;
+  // one written in the other order fails the format check.
+  struct Header {
+    char magic[4];
+    uint32_t format;
+    SolutionCacheKey key;
+    uint32_t num_notes;
+    uint32_t reserved = 0;
+  };
+
+  static constexpr char kMagic[4] = {'C', 'F', 'N', 'G'};
+  static constexpr uint32_t kFormat = 1;
+  static constexpr char kEntrySuffix[] = ".fingering";
+  // Temporary files older than this were left by a writer that died.
+  static constexpr std::chrono::hours kStaleTempAge{1};
+
+  // Whether `name` is that of an entry: 32 hex digits and the suffix.
+  static bool isEntryName(const std::string &name) {
+    constexpr size_t digits = 2 * sizeof(SolutionCacheKey);
+    return name.size() == digits + sizeof(kEntrySuffix) - 1 &&
+           name.compare(digits, std::string::npos, kEntrySuffix) == 0 &&
+           std::all_of(name.begin(), name.begin() + digits, [](char c) {
+             return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+           });
+  }
+
+  // Whether `name` is that of a temporary file written by store(): an entry
+  // name followed by a process id, a counter and ".tmp".
+  static bool isTempName(const std::string &name) {
+    size_t digits = 2 * sizeof(SolutionCacheKey);
+    size_t entry = digits + sizeof(kEntrySuffix) - 1;
+    return name.size() > entry + 4 && isEntryName(name.substr(0, entry)) &&
+           name.compare(name.size() - 4, 4, ".tmp") == 0;
+  }
+
+  std::string entryPath(const SolutionCacheKey &key) const {
+    std::string path = dir + "/";
+    for (uint8_t byte : key) {
+      path += "0123456789abcdef"[byte >> 4];
+      path += "0123456789abcdef"[byte & 0xf];
+    }
+    return path + kEntrySuffix;
+  }
+
+  struct CachedFile {
+    std::filesystem::file_time_type last_used;
+    std::filesystem::path path;
+    uint64_t size;
+  };
+
+  // The entries in the cache, least recently used first. Stale temporary
+  // files are deleted along the way if `clean` is set.
+  std::vector<CachedFile> scan(bool clean = false) const {
+    namespace fs = std::filesystem;
+    std::vector<CachedFile> files;
+    std::error_code ec;
+    auto now = fs::file_time_type::clock::now();
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+      std::error_code entry_ec;
+      if (!entry.is_regular_file(entry_ec)) {
+        continue;
+      }
+      std::string name = entry.path().filename().string();
+      bool is_entry = isEntryName(name);
+      if (!is_entry && !(clean && isTempName(name))) {
+        continue;
+      }
+      uint64_t size = entry.file_size(entry_ec);
+      auto time = entry.last_write_time(entry_ec);
+      if (entry_ec) {
+        continue;
+      }
+      if (is_entry) {
+        files.push_back({time, entry.path(), size});
+      } else if (now - time > kStaleTempAge) {
+        fs::remove(entry.path(), entry_ec);
+      }
+    }
+    std::sort(files.begin(), files.end(),
+              [](const CachedFile &a, const CachedFile &b) {
+                return a.last_used < b.last_used;
+              });
+    return files;
+  }
+
+  static uint64_t totalSize(const std::vector<CachedFile> &files) {
+    uint64_t total = 0;
+    for (const auto &file : files) {
+      total += file.size;
+    }
+    return total;
+  }
+
+  // Delete the least recently used files until the cache is back under
+  // three quarters of its limit, leaving room to grow before the next scan.
+  void evict() {
+    std::lock_guard<std::mutex> lock(evict_mutex);
+    if (bytes <= max_bytes) {
+      return;
+    }
+    auto files = scan(true);
+    uint64_t total = totalSize(files);
+    uint64_t target = max_bytes / 4 * 3;
+    for (const auto &file : files) {
+      if (total <= target) {
+        break;
+      }
+      std::error_code ec;
+      if (std::filesystem::remove(file.path, ec)) {
+        total -= file.size;
+      }
+    }
+    bytes = total;
+  }
+
+  std::string dir;
+  uint64_t max_bytes;
+  bool ok = false;
+  // Bytes in the cache, as of the last scan plus what this process has
+  // written since.
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<unsigned> next_temp{0};
+  std::mutex evict_mutex;
+};
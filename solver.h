@@ -1,3 +1,8 @@
+#pragma once
+
+#include "cost_arena.h"
+#include "reduction_kernels.h"
+#include "solver_stats.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Hashing.h"
 #include "llvm/CodeGen/PBQP/CostAllocator.h"
@@ -8,12 +13,15 @@
 #include "llvm/CodeGen/Register.h"
 #include "llvm/MC/MCRegister.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <set>
 #include <vector>
 
 namespace llvm {
@@ -30,32 +38,47 @@ namespace RegAlloc {
 /// Spill option index.
 inline unsigned getSpillOptionIdx() { return 0; }
 
+/// A set of options, excluding the spill option, as a bitmask: bit I stands
+/// for option I + 1.
+using OptionMask = uint64_t;
+
+/// The most options, besides the spill option, that an OptionMask holds.
+constexpr unsigned MaxMaskedOptions = 64;
+
 /// Metadata to speed allocatability test.
 ///
-/// Keeps track of the number of infinities in each row and column.
+/// Keeps track of which rows and columns hold infinities, as bitmasks, and
+/// of the most infinities in any one row or column. Each row's infinities
+/// are gathered into a bitmask in a single pass over the matrix, and
+/// everything else is derived from those masks with popcount and OR.
 class MatrixMetadata {
 public:
-  MatrixMetadata(const Matrix& M)
-    : UnsafeRows(new bool[M.getRows() - 1]()),
-      UnsafeCols(new bool[M.getCols() - 1]()) {
-    unsigned* ColCounts = new unsigned[M.getCols() - 1]();
-
-    for (unsigned i = 1; i < M.getRows(); ++i) {
-      unsigned RowCount = 0;
-      for (unsigned j = 1; j < M.getCols(); ++j) {
-        if (M[i][j] == std::numeric_limits<PBQPNum>::infinity()) {
-          ++RowCount;
-          ++ColCounts[j - 1];
-          UnsafeRows[i - 1] = true;
-          UnsafeCols[j - 1] = true;
-        }
+  MatrixMetadata(const Matrix& M) {
+    unsigned Rows = M.getRows(), Cols = M.getCols();
+    assert(Rows <= MaxMaskedOptions + 1 && Cols <= MaxMaskedOptions + 1 &&
+           "Too many options for an OptionMask");
+
+    // Each column's infinities, as a mask of rows.
+    OptionMask ColInfs[MaxMaskedOptions];
+    std::fill_n(ColInfs, Cols > 1 ? Cols - 1 : 0, 0);
+    for (unsigned i = 1; i < Rows; ++i) {
+      OptionMask RowInfs = 0;
+      for (unsigned j = 1; j < Cols; ++j) {
+        bool Inf = M[i][j] == std::numeric_limits<PBQPNum>::infinity();
+        RowInfs |= OptionMask(Inf) << (j - 1);
+        ColInfs[j - 1] |= OptionMask(Inf) << (i - 1);
       }
-      WorstRow = std::max(WorstRow, RowCount);
+      if (RowInfs)
+        UnsafeRows |= OptionMask(1) << (i - 1);
+      UnsafeCols |= RowInfs;
+      WorstRow = std::max(WorstRow, unsigned(countPopulation(RowInfs)));
     }
-    unsigned WorstColCountForCurRow =
-      *std::max_element(ColCounts, ColCounts + M.getCols() - 1);
-    WorstCol = std::max(WorstCol, WorstColCountForCurRow);
-    delete[] ColCounts;
+    for (unsigned j = 1; j < Cols; ++j)
+      WorstCol = std::max(WorstCol, unsigned(countPopulation(ColInfs[j - 1])));
+
+    // The cost allocator builds metadata once per distinct matrix.
+    PBQP_STAT(MatricesAllocated);
+    PBQP_STAT_ADD(MatrixBytes, M.getRows() * M.getCols() * sizeof(PBQPNum));
   }
 
   MatrixMetadata(const MatrixMetadata &) = delete;
@@ -63,14 +86,14 @@ public:
 
   unsigned getWorstRow() const { return WorstRow; }
   unsigned getWorstCol() const { return WorstCol; }
-  const bool* getUnsafeRows() const { return UnsafeRows.get(); }
-  const bool* getUnsafeCols() const { return UnsafeCols.get(); }
+  OptionMask getUnsafeRows() const { return UnsafeRows; }
+  OptionMask getUnsafeCols() const { return UnsafeCols; }
 
 private:
   unsigned WorstRow = 0;
   unsigned WorstCol = 0;
-  std::unique_ptr<bool[]> UnsafeRows;
-  std::unique_ptr<bool[]> UnsafeCols;
+  OptionMask UnsafeRows = 0;
+  OptionMask UnsafeCols = 0;
 };
 
 /// Holds a vector of the allowed physical regs for a vreg.
@@ -148,7 +171,8 @@ public:
 
   NodeMetadata(const NodeMetadata &Other)
       : RS(Other.RS), NumOpts(Other.NumOpts), DeniedOpts(Other.DeniedOpts),
-        OptUnsafeEdges(new unsigned[NumOpts]), VReg(Other.VReg),
+        OptUnsafeEdges(new unsigned[NumOpts]),
+        OptsWithUnsafeEdges(Other.OptsWithUnsafeEdges), VReg(Other.VReg),
         AllowedRegs(Other.AllowedRegs)
 #if LLVM_ENABLE_ABI_BREAKING_CHECKS
         ,
@@ -174,6 +198,8 @@ public:
 
   void setup(const Vector& Costs) {
     NumOpts = Costs.getLength() - 1;
+    assert(NumOpts <= MaxMaskedOptions &&
+           "Too many options for an OptionMask");
     OptUnsafeEdges = std::unique_ptr<unsigned[]>(new unsigned[NumOpts]());
   }
 
@@ -192,24 +218,27 @@ public:
 
   void handleAddEdge(const MatrixMetadata& MD, bool Transpose) {
     DeniedOpts += Transpose ? MD.getWorstRow() : MD.getWorstCol();
-    const bool* UnsafeOpts =
+    OptionMask UnsafeOpts =
       Transpose ? MD.getUnsafeCols() : MD.getUnsafeRows();
-    for (unsigned i = 0; i < NumOpts; ++i)
-      OptUnsafeEdges[i] += UnsafeOpts[i];
+    OptsWithUnsafeEdges |= UnsafeOpts;
+    for (; UnsafeOpts; UnsafeOpts &= UnsafeOpts - 1)
+      ++OptUnsafeEdges[countTrailingZeros(UnsafeOpts)];
   }
 
   void handleRemoveEdge(const MatrixMetadata& MD, bool Transpose) {
     DeniedOpts -= Transpose ? MD.getWorstRow() : MD.getWorstCol();
-    const bool* UnsafeOpts =
+    OptionMask UnsafeOpts =
       Transpose ? MD.getUnsafeCols() : MD.getUnsafeRows();
-    for (unsigned i = 0; i < NumOpts; ++i)
-      OptUnsafeEdges[i] -= UnsafeOpts[i];
+    for (; UnsafeOpts; UnsafeOpts &= UnsafeOpts - 1) {
+      unsigned i = countTrailingZeros(UnsafeOpts);
+      if (--OptUnsafeEdges[i] == 0)
+        OptsWithUnsafeEdges &= ~(OptionMask(1) << i);
+    }
   }
 
   bool isConservativelyAllocatable() const {
     return (DeniedOpts < NumOpts) ||
-      (std::find(&OptUnsafeEdges[0], &OptUnsafeEdges[NumOpts], 0) !=
-       &OptUnsafeEdges[NumOpts]);
+      (countPopulation(OptsWithUnsafeEdges) < NumOpts);
   }
 
 #if LLVM_ENABLE_ABI_BREAKING_CHECKS
@@ -222,7 +251,9 @@ private:
   ReductionState RS = Unprocessed;
   unsigned NumOpts = 0;
   unsigned DeniedOpts = 0;
+  // How many edges make each option unsafe, and the options with any.
   std::unique_ptr<unsigned[]> OptUnsafeEdges;
+  OptionMask OptsWithUnsafeEdges = 0;
   Register VReg;
   GraphMetadata::AllowedRegVecRef AllowedRegs;
 
@@ -231,6 +262,229 @@ private:
 #endif
 };
 
+/// A set of node ids with O(1) insertion and removal, and fast retrieval of
+/// the lowest id, backed by a two-level bitmap. Taking the lowest id keeps
+/// the reduction order the same as the ordered sets this replaces.
+class NodeWorklist {
+public:
+  using NodeId = GraphBase::NodeId;
+
+  bool empty() const { return Count == 0; }
+
+  bool contains(NodeId NId) const {
+    return NId / 64 < Words.size() && (Words[NId / 64] >> (NId % 64)) & 1;
+  }
+
+  void insert(NodeId NId) {
+    assert(!contains(NId) && "Node already in worklist.");
+    unsigned W = NId / 64;
+    if (W >= Words.size()) {
+      Words.resize(W + 1);
+      Summary.resize(W / 64 + 1);
+    }
+    Words[W] |= uint64_t(1) << (NId % 64);
+    Summary[W / 64] |= uint64_t(1) << (W % 64);
+    ++Count;
+  }
+
+  void erase(NodeId NId) {
+    assert(contains(NId) && "Node not in worklist.");
+    unsigned W = NId / 64;
+    Words[W] &= ~(uint64_t(1) << (NId % 64));
+    if (Words[W] == 0)
+      Summary[W / 64] &= ~(uint64_t(1) << (W % 64));
+    --Count;
+  }
+
+  /// Return the lowest node id in the worklist.
+  NodeId front() const {
+    assert(!empty() && "Worklist is empty.");
+    return findFrom(0);
+  }
+
+  /// Return the first node id at or after Start, wrapping around to the
+  /// lowest, so that an arbitrary Start picks an arbitrary member.
+  NodeId pick(uint64_t Start) const {
+    assert(!empty() && "Worklist is empty.");
+    NodeId NId = findFrom(Start % (Words.size() * 64));
+    return NId != NotFound ? NId : findFrom(0);
+  }
+
+private:
+  static constexpr NodeId NotFound = std::numeric_limits<NodeId>::max();
+
+  NodeId findFrom(NodeId Start) const {
+    unsigned W = Start / 64;
+    if (W >= Words.size())
+      return NotFound;
+    uint64_t Bits = Words[W] & (~uint64_t(0) << (Start % 64));
+    if (Bits)
+      return W * 64 + countTrailingZeros(Bits);
+
+    // Find the next non-empty word through the summary.
+    unsigned S = (W + 1) / 64;
+    if (S >= Summary.size())
+      return NotFound;
+    uint64_t SummaryBits = Summary[S] & (~uint64_t(0) << ((W + 1) % 64));
+    while (SummaryBits == 0) {
+      if (++S == Summary.size())
+        return NotFound;
+      SummaryBits = Summary[S];
+    }
+    W = S * 64 + countTrailingZeros(SummaryBits);
+    return W * 64 + countTrailingZeros(Words[W]);
+  }
+
+  std::vector<uint64_t> Words;
+  std::vector<uint64_t> Summary;
+  unsigned Count = 0;
+};
+
+/// Indexed min-heap of not-provably-allocatable nodes, ordered by spill cost,
+/// then degree, then node id. Given a non-zero seed, ties in spill cost and
+/// degree are broken by a hash of the node id under that seed instead.
+///
+/// Each entry caches the key it was sifted with. Reductions change the costs
+/// and degrees of nodes in the heap, so callers mark such nodes dirty, and
+/// their keys are refreshed in one batch before the minimum is taken.
+template <typename GraphT> class SpillCostQueue {
+public:
+  using NodeId = GraphBase::NodeId;
+
+  SpillCostQueue(const GraphT &G, uint64_t Seed = 0) : G(G), Seed(Seed) {}
+
+  bool empty() const { return Heap.empty(); }
+
+  bool contains(NodeId NId) const {
+    return NId < Pos.size() && Pos[NId] != NotInHeap;
+  }
+
+  void insert(NodeId NId) {
+    assert(!contains(NId) && "Node already in spill queue.");
+    if (NId >= Pos.size())
+      Pos.resize(NId + 1, NotInHeap);
+    Pos[NId] = Heap.size();
+    Heap.push_back(makeEntry(NId));
+    siftUp(Pos[NId]);
+  }
+
+  void erase(NodeId NId) {
+    assert(contains(NId) && "Node not in spill queue.");
+    unsigned I = Pos[NId];
+    Pos[NId] = NotInHeap;
+    if (I + 1 != Heap.size()) {
+      Heap[I] = Heap.back();
+      Pos[Heap[I].NId] = I;
+      Heap.pop_back();
+      siftDown(I);
+      siftUp(I);
+    } else {
+      Heap.pop_back();
+    }
+  }
+
+  /// Note that the spill cost or degree of NId may have changed.
+  void markDirty(NodeId NId) {
+    if (contains(NId))
+      Dirty.push_back(NId);
+  }
+
+  /// Remove and return the node with the lowest spill cost.
+  NodeId pop() {
+    for (NodeId NId : Dirty) {
+      if (!contains(NId))
+        continue;
+      unsigned I = Pos[NId];
+      Heap[I] = makeEntry(NId);
+      siftDown(I);
+      siftUp(Pos[NId]);
+    }
+    Dirty.clear();
+
+    NodeId NId = Heap.front().NId;
+    erase(NId);
+    return NId;
+  }
+
+private:
+  static constexpr unsigned NotInHeap = std::numeric_limits<unsigned>::max();
+
+  struct Entry {
+    PBQPNum SpillCost;
+    unsigned Degree;
+    uint64_t TieBreak;
+    NodeId NId;
+  };
+
+  Entry makeEntry(NodeId NId) const {
+    uint64_t TieBreak = Seed ? (uint64_t)hash_combine(Seed, NId) : NId;
+    return {G.getNodeCosts(NId)[0], (unsigned)G.getNodeDegree(NId), TieBreak,
+            NId};
+  }
+
+  static bool less(const Entry &A, const Entry &B) {
+    // Order NaN costs (from adding opposite infinities) after all others so
+    // that the comparison stays a strict weak ordering.
+    bool ANaN = std::isnan(A.SpillCost), BNaN = std::isnan(B.SpillCost);
+    if (ANaN != BNaN)
+      return BNaN;
+    if (!ANaN && A.SpillCost != B.SpillCost)
+      return A.SpillCost < B.SpillCost;
+    if (A.Degree != B.Degree)
+      return A.Degree < B.Degree;
+    if (A.TieBreak != B.TieBreak)
+      return A.TieBreak < B.TieBreak;
+    return A.NId < B.NId;
+  }
+
+  void siftUp(unsigned I) {
+    Entry E = Heap[I];
+    while (I > 0) {
+      unsigned Parent = (I - 1) / 2;
+      if (!less(E, Heap[Parent]))
+        break;
+      Heap[I] = Heap[Parent];
+      Pos[Heap[I].NId] = I;
+      I = Parent;
+    }
+    Heap[I] = E;
+    Pos[E.NId] = I;
+  }
+
+  void siftDown(unsigned I) {
+    Entry E = Heap[I];
+    unsigned N = Heap.size();
+    while (2 * I + 1 < N) {
+      unsigned Child = 2 * I + 1;
+      if (Child + 1 < N && less(Heap[Child + 1], Heap[Child]))
+        ++Child;
+      if (!less(Heap[Child], E))
+        break;
+      Heap[I] = Heap[Child];
+      Pos[Heap[I].NId] = I;
+      I = Child;
+    }
+    Heap[I] = E;
+    Pos[E.NId] = I;
+  }
+
+  const GraphT &G;
+  uint64_t Seed;
+  std::vector<Entry> Heap;
+  std::vector<unsigned> Pos;
+  std::vector<NodeId> Dirty;
+};
+
+/// Wall-clock time, in seconds, spent in each phase of a solve.
+struct SolvePhaseTimes {
+  /// Building the worklists.
+  double Setup = 0;
+  /// Applying reductions until the graph is empty.
+  double Reduce = 0;
+  /// Selecting options in reverse reduction order.
+  double Backpropagate = 0;
+};
+
 class RegAllocSolverImpl {
 private:
   using RAMatrix = MDMatrix<MatrixMetadata>;
@@ -240,7 +494,7 @@ public:
   using RawMatrix = PBQP::Matrix;
   using Vector = PBQP::Vector;
   using Matrix = RAMatrix;
-  using CostAllocator = PBQP::PoolCostAllocator<Vector, Matrix>;
+  using CostAllocator = ArenaCostAllocator<Vector, Matrix>;
 
   using NodeId = GraphBase::NodeId;
   using EdgeId = GraphBase::EdgeId;
@@ -251,14 +505,39 @@ public:
 
   using Graph = PBQP::Graph<RegAllocSolverImpl>;
 
-  RegAllocSolverImpl(Graph &G) : G(G) {}
-
-  Solution solve() {
+  /// A non-zero Seed randomizes the choice between equally good nodes to
+  /// reduce, so that restarts with different seeds explore different
+  /// solutions. Seed zero gives the deterministic lowest-id order.
+  RegAllocSolverImpl(Graph &G, uint64_t Seed = 0)
+      : G(G), Seed(Seed), RandomState(Seed),
+        NotProvablyAllocatableNodes(G, Seed) {}
+
+  /// Solve the graph, destructively. If Times is given, record how long each
+  /// phase took.
+  Solution solve(SolvePhaseTimes *Times = nullptr) {
+    using Clock = std::chrono::steady_clock;
+    auto Seconds = [](Clock::time_point From, Clock::time_point To) {
+      return std::chrono::duration<double>(To - From).count();
+    };
+
+    auto Start = Clock::now();
     G.setSolver(*this);
     Solution S;
     setup();
-    S = backpropagate(G, reduce());
+    auto SetupDone = Clock::now();
+    auto NodeStack = reduce();
+    auto ReduceDone = Clock::now();
+    S = backpropagate(G, std::move(NodeStack));
     G.unsetSolver();
+    auto End = Clock::now();
+    PBQP_TRACE_EVENT("setup", Start, SetupDone);
+    PBQP_TRACE_EVENT("reduce", SetupDone, ReduceDone);
+    PBQP_TRACE_EVENT("backpropagate", ReduceDone, End);
+    if (Times) {
+      Times->Setup = Seconds(Start, SetupDone);
+      Times->Reduce = Seconds(SetupDone, ReduceDone);
+      Times->Backpropagate = Seconds(ReduceDone, End);
+    }
     return S;
   }
 
@@ -269,7 +548,9 @@ public:
   }
 
   void handleRemoveNode(NodeId NId) {}
-  void handleSetNodeCosts(NodeId NId, const Vector& newCosts) {}
+  void handleSetNodeCosts(NodeId NId, const Vector& newCosts) {
+    NotProvablyAllocatableNodes.markDirty(NId);
+  }
 
   void handleAddEdge(EdgeId EId) {
     handleReconnectEdge(EId, G.getEdgeNode1Id(EId));
@@ -277,6 +558,7 @@ public:
   }
 
   void handleDisconnectEdge(EdgeId EId, NodeId NId) {
+    NotProvablyAllocatableNodes.markDirty(NId);
     NodeMetadata& NMd = G.getNodeMetadata(NId);
     const MatrixMetadata& MMd = G.getEdgeCosts(EId).getMetadata();
     NMd.handleRemoveEdge(MMd, NId == G.getEdgeNode2Id(EId));
@@ -284,6 +566,7 @@ public:
   }
 
   void handleReconnectEdge(EdgeId EId, NodeId NId) {
+    NotProvablyAllocatableNodes.markDirty(NId);
     NodeMetadata& NMd = G.getNodeMetadata(NId);
     const MatrixMetadata& MMd = G.getEdgeCosts(EId).getMetadata();
     NMd.handleAddEdge(MMd, NId == G.getEdgeNode2Id(EId));
@@ -330,21 +613,12 @@ private:
     switch (G.getNodeMetadata(NId).getReductionState()) {
     case NodeMetadata::Unprocessed: break;
     case NodeMetadata::OptimallyReducible:
-      assert(OptimallyReducibleNodes.find(NId) !=
-             OptimallyReducibleNodes.end() &&
-             "Node not in optimally reducible set.");
       OptimallyReducibleNodes.erase(NId);
       break;
     case NodeMetadata::ConservativelyAllocatable:
-      assert(ConservativelyAllocatableNodes.find(NId) !=
-             ConservativelyAllocatableNodes.end() &&
-             "Node not in conservatively allocatable set.");
       ConservativelyAllocatableNodes.erase(NId);
       break;
     case NodeMetadata::NotProvablyAllocatable:
-      assert(NotProvablyAllocatableNodes.find(NId) !=
-             NotProvablyAllocatableNodes.end() &&
-             "Node not in not-provably-allocatable set.");
       NotProvablyAllocatableNodes.erase(NId);
       break;
     }
@@ -353,6 +627,7 @@ private:
   void moveToOptimallyReducibleNodes(NodeId NId) {
     removeFromCurrentSet(NId);
     OptimallyReducibleNodes.insert(NId);
+    PBQP_STAT(WorklistMoves);
     G.getNodeMetadata(NId).setReductionState(
       NodeMetadata::OptimallyReducible);
   }
@@ -360,6 +635,7 @@ private:
   void moveToConservativelyAllocatableNodes(NodeId NId) {
     removeFromCurrentSet(NId);
     ConservativelyAllocatableNodes.insert(NId);
+    PBQP_STAT(WorklistMoves);
     G.getNodeMetadata(NId).setReductionState(
       NodeMetadata::ConservativelyAllocatable);
   }
@@ -367,6 +643,7 @@ private:
   void moveToNotProvablyAllocatableNodes(NodeId NId) {
     removeFromCurrentSet(NId);
     NotProvablyAllocatableNodes.insert(NId);
+    PBQP_STAT(WorklistMoves);
     G.getNodeMetadata(NId).setReductionState(
       NodeMetadata::NotProvablyAllocatable);
   }
@@ -398,18 +675,20 @@ private:
     // Consume worklists.
     while (true) {
       if (!OptimallyReducibleNodes.empty()) {
-        NodeSet::iterator NItr = OptimallyReducibleNodes.begin();
-        NodeId NId = *NItr;
-        OptimallyReducibleNodes.erase(NItr);
+        NodeId NId = OptimallyReducibleNodes.front();
+        OptimallyReducibleNodes.erase(NId);
         NodeStack.push_back(NId);
         switch (G.getNodeDegree(NId)) {
         case 0:
+          PBQP_STAT(R0Reductions);
           break;
         case 1:
-          applyR1(G, NId);
+          PBQP_STAT(R1Reductions);
+          applyMinPlusR1(G, NId);
           break;
         case 2:
-          applyR2(G, NId);
+          PBQP_STAT(R2Reductions);
+          applyMinPlusR2(G, NId);
           break;
         default: llvm_unreachable("Not an optimally reducible node.");
         }
@@ -420,18 +699,15 @@ private:
         // would be better to push nodes with lower 'expected' or worst-case
         // register costs first (since early nodes are the most
         // constrained).
-        NodeSet::iterator NItr = ConservativelyAllocatableNodes.begin();
-        NodeId NId = *NItr;
-        ConservativelyAllocatableNodes.erase(NItr);
+        NodeId NId = Seed ? ConservativelyAllocatableNodes.pick(nextRandom())
+                          : ConservativelyAllocatableNodes.front();
+        ConservativelyAllocatableNodes.erase(NId);
+        PBQP_STAT(ConservativePicks);
         NodeStack.push_back(NId);
         G.disconnectAllNeighborsFromNode(NId);
       } else if (!NotProvablyAllocatableNodes.empty()) {
-        NodeSet::iterator NItr =
-          std::min_element(NotProvablyAllocatableNodes.begin(),
-                           NotProvablyAllocatableNodes.end(),
-                           SpillCostComparator(G));
-        NodeId NId = *NItr;
-        NotProvablyAllocatableNodes.erase(NItr);
+        NodeId NId = NotProvablyAllocatableNodes.pop();
+        PBQP_STAT(SpillPicks);
         NodeStack.push_back(NId);
         G.disconnectAllNeighborsFromNode(NId);
       } else
@@ -441,27 +717,20 @@ private:
     return NodeStack;
   }
 
-  class SpillCostComparator {
-  public:
-    SpillCostComparator(const Graph& G) : G(G) {}
-
-    bool operator()(NodeId N1Id, NodeId N2Id) {
-      PBQPNum N1SC = G.getNodeCosts(N1Id)[0];
-      PBQPNum N2SC = G.getNodeCosts(N2Id)[0];
-      if (N1SC == N2SC)
-        return G.getNodeDegree(N1Id) < G.getNodeDegree(N2Id);
-      return N1SC < N2SC;
-    }
-
-  private:
-    const Graph& G;
-  };
+  /// SplitMix64.
+  uint64_t nextRandom() {
+    uint64_t Z = (RandomState += 0x9e3779b97f4a7c15);
+    Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+    Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+    return Z ^ (Z >> 31);
+  }
 
   Graph& G;
-  using NodeSet = std::set<NodeId>;
-  NodeSet OptimallyReducibleNodes;
-  NodeSet ConservativelyAllocatableNodes;
-  NodeSet NotProvablyAllocatableNodes;
+  uint64_t Seed;
+  uint64_t RandomState;
+  NodeWorklist OptimallyReducibleNodes;
+  NodeWorklist ConservativelyAllocatableNodes;
+  SpillCostQueue<Graph> NotProvablyAllocatableNodes;
 };
 
 class PBQPRAGraph : public PBQP::Graph<RegAllocSolverImpl> {
@@ -490,6 +759,24 @@ inline Solution solve(PBQPRAGraph& G) {
   return RegAllocSolver.solve();
 }
 
+/// Solve G with the reduction heuristic, recording the time spent in each
+/// phase in Times.
+inline Solution solve(PBQPRAGraph& G, SolvePhaseTimes *Times) {
+  if (G.empty())
+    return Solution();
+  RegAllocSolverImpl RegAllocSolver(G);
+  return RegAllocSolver.solve(Times);
+}
+
+/// Solve G with the reduction heuristic, breaking ties between equally good
+/// nodes pseudo-randomly according to Seed.
+inline Solution solveRandomized(PBQPRAGraph& G, uint64_t Seed) {
+  if (G.empty())
+    return Solution();
+  RegAllocSolverImpl RegAllocSolver(G, Seed);
+  return RegAllocSolver.solve();
+}
+
 } // end namespace RegAlloc
 } // end namespace PBQP
 
@@ -0,0 +1,201 @@
+#pragma once
+
+// Optional instrumentation of the solver and the graph builders: event
+// counters and a timeline of phases. It is only compiled in when
+// CONCERTINA_STATS is defined; otherwise the PBQP_STAT and PBQP_TRACE macros
+// expand to nothing and cost nothing.
+
+#ifdef CONCERTINA_STATS
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+enum class SolverCounter : unsigned {
+  /// Nodes of degree 0, 1 and 2 reduced optimally.
+  R0Reductions,
+  R1Reductions,
+  R2Reductions,
+  /// Nodes reduced because they were conservatively allocatable.
+  ConservativePicks,
+  /// Nodes reduced by lowest spill cost, when nothing better was left.
+  SpillPicks,
+  /// Nodes moved between the solver's worklists.
+  WorklistMoves,
+  /// Distinct cost matrices allocated, by the builders or by R2 reductions,
+  /// and the bytes of cost data they hold.
+  MatricesAllocated,
+  MatrixBytes,
+  /// Bytes of slabs reserved by the graphs' cost arenas.
+  CostArenaBytes,
+  NumCounters
+};
+
+/// Process-wide counters and phase timeline. Every thread records into the
+/// same instance; counters are relaxed atomics and events are appended under
+/// a lock, so it is safe, if not free, to use from the batch and portfolio
+/// threads.
+class SolverStats {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static SolverStats &get() {
+    static SolverStats Stats;
+    return Stats;
+  }
+
+  void add(SolverCounter C, uint64_t N = 1) {
+    Counters[(unsigned)C].fetch_add(N, std::memory_order_relaxed);
+  }
+
+  uint64_t getCount(SolverCounter C) const {
+    return Counters[(unsigned)C].load(std::memory_order_relaxed);
+  }
+
+  /// Record that the calling thread spent [Start, End) in phase Name. Name
+  /// must be a string literal.
+  void addEvent(const char *Name, Clock::time_point Start,
+                Clock::time_point End) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Events.push_back({Name, Start, End, getThreadIndex()});
+  }
+
+  /// Write the counters, and the number of times each phase ran and its
+  /// total duration, as a JSON object.
+  void writeJSON(FILE *Out) const {
+    static const char *const CounterNames[] = {
+        "r0_reductions",      "r1_reductions", "r2_reductions",
+        "conservative_picks", "spill_picks",   "worklist_moves",
+        "matrices_allocated", "matrix_bytes",  "cost_arena_bytes"};
+    static_assert(std::size(CounterNames) ==
+                      (unsigned)SolverCounter::NumCounters,
+                  "Every counter needs a name.");
+
+    fprintf(Out, "{\n  \"counters\": {");
+    for (unsigned I = 0; I < std::size(CounterNames); ++I)
+      fprintf(Out, "%s\n    \"%s\": %llu", I ? "," : "", CounterNames[I],
+              (unsigned long long)Counters[I].load());
+    fprintf(Out, "\n  },\n  \"phases\": {");
+
+    struct PhaseTotal {
+      uint64_t Count = 0;
+      double Seconds = 0;
+    };
+    std::map<std::string, PhaseTotal> Totals;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      for (const auto &E : Events) {
+        auto &Total = Totals[E.Name];
+        ++Total.Count;
+        Total.Seconds +=
+            std::chrono::duration<double>(E.End - E.Start).count();
+      }
+    }
+    bool First = true;
+    for (const auto &[Name, Total] : Totals) {
+      fprintf(Out, "%s\n    \"%s\": {\"count\": %llu, \"seconds\": %.6f}",
+              First ? "" : ",", Name.c_str(), (unsigned long long)Total.Count,
+              Total.Seconds);
+      First = false;
+    }
+    fprintf(Out, "\n  }\n}\n");
+  }
+
+  /// Write the phase timeline in the Trace Event format read by
+  /// chrome://tracing and Perfetto, one complete event per phase.
+  void writeTrace(FILE *Out) const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    // Timestamps count from the earliest event.
+    Clock::time_point Epoch = Clock::time_point::max();
+    for (const auto &E : Events)
+      Epoch = std::min(Epoch, E.Start);
+    fprintf(Out, "{\"traceEvents\": [");
+    for (unsigned I = 0; I < Events.size(); ++I) {
+      const auto &E = Events[I];
+      fprintf(Out,
+              "%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+              "\"dur\": %.3f, \"pid\": 1, \"tid\": %u}",
+              I ? "," : "", E.Name, microseconds(Epoch, E.Start),
+              microseconds(E.Start, E.End), E.Thread);
+    }
+    fprintf(Out, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  }
+
+private:
+  struct Event {
+    const char *Name;
+    Clock::time_point Start;
+    Clock::time_point End;
+    unsigned Thread;
+  };
+
+  static double microseconds(Clock::time_point From, Clock::time_point To) {
+    return std::chrono::duration<double, std::micro>(To - From).count();
+  }
+
+  /// A small, stable number for the calling thread, for the trace's rows.
+  static unsigned getThreadIndex() {
+    static std::atomic<unsigned> NextIndex{0};
+    thread_local unsigned Index = NextIndex++;
+    return Index;
+  }
+
+  std::array<std::atomic<uint64_t>, (unsigned)SolverCounter::NumCounters>
+      Counters{};
+  mutable std::mutex Mutex;
+  std::vector<Event> Events;
+};
+
+/// Records the lifetime of a scope as a phase event.
+class TraceScope {
+public:
+  explicit TraceScope(const char *Name)
+      : Name(Name), Start(SolverStats::Clock::now()) {}
+  ~TraceScope() {
+    SolverStats::get().addEvent(Name, Start, SolverStats::Clock::now());
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  const char *Name;
+  SolverStats::Clock::time_point Start;
+};
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
+
+#define PBQP_STAT_ADD(Counter, N)                                             \
+  ::llvm::PBQP::RegAlloc::SolverStats::get().add(                             \
+      ::llvm::PBQP::RegAlloc::SolverCounter::Counter, (N))
+#define PBQP_TRACE_EVENT(Name, Start, End)                                    \
+  ::llvm::PBQP::RegAlloc::SolverStats::get().addEvent((Name), (Start), (End))
+#define PBQP_TRACE_CONCAT_IMPL(A, B) A##B
+#define PBQP_TRACE_CONCAT(A, B) PBQP_TRACE_CONCAT_IMPL(A, B)
+#define PBQP_TRACE_SCOPE(Name)                                                \
+  ::llvm::PBQP::RegAlloc::TraceScope PBQP_TRACE_CONCAT(TraceScope, __LINE__)( \
+      Name)
+
+#else
+
+#define PBQP_STAT_ADD(Counter, N) ((void)0)
+#define PBQP_TRACE_EVENT(Name, Start, End) ((void)0)
+#define PBQP_TRACE_SCOPE(Name) ((void)0)
+
+#endif
+
+#define PBQP_STAT(Counter) PBQP_STAT_ADD(Counter, 1)
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "solver.h"
+#include "llvm/ADT/ArrayRef.h"
+#include <limits>
+#include <vector>
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+/// Compute the total cost of a solution: the sum of the selected node costs
+/// and of the edge costs between the selected options.
+///
+/// The solvers destructively reduce the graph they are given, so this must be
+/// called on a graph that has not been solved.
+inline PBQPNum getSolutionCost(const PBQPRAGraph &G, const Solution &S) {
+  PBQPNum Cost = 0;
+  for (auto NId : G.nodeIds())
+    Cost += G.getNodeCosts(NId)[S.getSelection(NId)];
+  for (auto EId : G.edgeIds()) {
+    unsigned N1Sel = S.getSelection(G.getEdgeNode1Id(EId));
+    unsigned N2Sel = S.getSelection(G.getEdgeNode2Id(EId));
+    Cost += G.getEdgeCosts(EId)[N1Sel][N2Sel];
+  }
+  return Cost;
+}
+
+/// A sum of costs that can have terms, including infinite ones, removed
+/// again exactly. Infinite terms are counted rather than added, and a sum
+/// holding infinities of both signs is infinite: as in the exact solvers, a
+/// sum of opposite infinities is treated as infeasible.
+class CostSum {
+public:
+  void add(PBQPNum C) {
+    if (C == std::numeric_limits<PBQPNum>::infinity())
+      ++PosInf;
+    else if (C == -std::numeric_limits<PBQPNum>::infinity())
+      ++NegInf;
+    else
+      Finite += C;
+  }
+
+  void remove(PBQPNum C) {
+    if (C == std::numeric_limits<PBQPNum>::infinity())
+      --PosInf;
+    else if (C == -std::numeric_limits<PBQPNum>::infinity())
+      --NegInf;
+    else
+      Finite -= C;
+  }
+
+  void add(const CostSum &Other) {
+    Finite += Other.Finite;
+    PosInf += Other.PosInf;
+    NegInf += Other.NegInf;
+  }
+
+  void remove(const CostSum &Other) {
+    Finite -= Other.Finite;
+    PosInf -= Other.PosInf;
+    NegInf -= Other.NegInf;
+  }
+
+  PBQPNum value() const {
+    if (PosInf)
+      return std::numeric_limits<PBQPNum>::infinity();
+    if (NegInf)
+      return -std::numeric_limits<PBQPNum>::infinity();
+    return Finite;
+  }
+
+  /// The change in value from this sum to New, where a move between equal
+  /// infinities counts as no change.
+  PBQPNum deltaTo(const CostSum &New) const {
+    PBQPNum Old = value(), NewValue = New.value();
+    if (Old == NewValue)
+      return 0;
+    return NewValue - Old;
+  }
+
+private:
+  double Finite = 0;
+  int PosInf = 0, NegInf = 0;
+};
+
+/// A read-only, index-based view of the costs in an unsolved graph, for
+/// solvers that search the problem directly instead of reducing the graph.
+/// Nodes are numbered densely from 0 in node id order.
+///
+/// The view shares the graph's cost vectors and matrices rather than pointing
+/// into its nodes and edges, so it stays valid after the graph is reduced. A
+/// solver can therefore take its view of a graph, let the heuristic reduce
+/// the graph for a starting solution, and then search from that solution.
+class CostView {
+public:
+  struct AdjEntry {
+    /// Index of the node at the other end of the edge.
+    unsigned Other;
+    const PBQP::Matrix *Costs;
+    /// True if this node is the edge's second node, i.e. its options index
+    /// the columns of Costs rather than the rows.
+    bool Transposed;
+  };
+
+  explicit CostView(const PBQPRAGraph &G) {
+    for (auto NId : G.nodeIds()) {
+      if (NId >= Index.size())
+        Index.resize(NId + 1, ~0u);
+      Index[NId] = NodeIds.size();
+      NodeIds.push_back(NId);
+      NodeCosts.push_back(G.getNodeCostsPtr(NId));
+    }
+
+    AdjBegin.assign(NodeIds.size() + 1, 0);
+    for (auto EId : G.edgeIds()) {
+      ++AdjBegin[Index[G.getEdgeNode1Id(EId)] + 1];
+      ++AdjBegin[Index[G.getEdgeNode2Id(EId)] + 1];
+    }
+    for (unsigned I = 0; I < NodeIds.size(); ++I)
+      AdjBegin[I + 1] += AdjBegin[I];
+    Adj.resize(AdjBegin.back());
+    std::vector<unsigned> Cursor(AdjBegin.begin(), AdjBegin.end() - 1);
+    for (auto EId : G.edgeIds()) {
+      unsigned N1 = Index[G.getEdgeNode1Id(EId)];
+      unsigned N2 = Index[G.getEdgeNode2Id(EId)];
+      EdgeCosts.push_back(G.getEdgeCostsPtr(EId));
+      const PBQP::Matrix *Costs = &*EdgeCosts.back();
+      Adj[Cursor[N1]++] = {N2, Costs, false};
+      Adj[Cursor[N2]++] = {N1, Costs, true};
+    }
+  }
+
+  unsigned getNumNodes() const { return NodeIds.size(); }
+  GraphBase::NodeId getNodeId(unsigned N) const { return NodeIds[N]; }
+  const PBQP::Vector &getNodeCosts(unsigned N) const { return *NodeCosts[N]; }
+  unsigned getNumOptions(unsigned N) const {
+    return NodeCosts[N]->getLength();
+  }
+
+  ArrayRef<AdjEntry> adj(unsigned N) const {
+    return makeArrayRef(Adj.data() + AdjBegin[N], Adj.data() + AdjBegin[N + 1]);
+  }
+
+  static PBQPNum getEdgeCost(const AdjEntry &A, unsigned Sel,
+                             unsigned OtherSel) {
+    return A.Transposed ? (*A.Costs)[OtherSel][Sel]
+                        : (*A.Costs)[Sel][OtherSel];
+  }
+
+  /// Total cost of a selection, given per node index.
+  PBQPNum getCost(ArrayRef<unsigned> Sel) const {
+    PBQPNum Cost = 0;
+    for (unsigned N = 0; N < getNumNodes(); ++N) {
+      Cost += getNodeCosts(N)[Sel[N]];
+      for (const AdjEntry &A : adj(N))
+        if (!A.Transposed)
+          Cost += getEdgeCost(A, Sel[N], Sel[A.Other]);
+    }
+    return Cost;
+  }
+
+  /// Total cost of a solution of the graph the view was built from.
+  PBQPNum getCost(const Solution &S) const {
+    std::vector<unsigned> Sel(getNumNodes());
+    for (unsigned N = 0; N < getNumNodes(); ++N)
+      Sel[N] = S.getSelection(NodeIds[N]);
+    return getCost(Sel);
+  }
+
+  Solution getSolution(ArrayRef<unsigned> Sel) const {
+    Solution S;
+    for (unsigned N = 0; N < getNumNodes(); ++N)
+      S.setSelection(NodeIds[N], Sel[N]);
+    return S;
+  }
+
+private:
+  std::vector<unsigned> Index;
+  std::vector<GraphBase::NodeId> NodeIds;
+  std::vector<PBQPRAGraph::VectorPtr> NodeCosts;
+  std::vector<PBQPRAGraph::MatrixPtr> EdgeCosts;
+  std::vector<unsigned> AdjBegin;
+  std::vector<AdjEntry> Adj;
+};
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "bnb_solver.h"
+#include "local_search.h"
+#include "solver.h"
+#include "solver_utils.h"
+#include "tree_solver.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using llvm::PBQP::Solution;
+using llvm::PBQP::RegAlloc::PBQPRAGraph;
+
+enum class SolverStrategy {
+  // The reduction heuristic from LLVM's PBQP register allocator.
+  Heuristic,
+  // Exact dynamic programming over a tree decomposition, falling back to the
+  // heuristic when the graph is too wide.
+  TreeDecomposition,
+  // Exact branch and bound from the heuristic's solution, within optional
+  // node and time limits.
+  BranchAndBound,
+  // The heuristic, refined by local search.
+  LocalSearch,
+  // Every strategy at once, each on its own thread, keeping the best
+  // solution found within a wall-clock budget.
+  Portfolio,
+};
+
+struct PortfolioOptions {
+  // Wall-clock budget in seconds.
+  double budget = 1.0;
+  // Number of threads running randomized restarts of the heuristic.
+  unsigned restart_threads = 1;
+};
+
+struct SolverOptions {
+  SolverStrategy strategy = SolverStrategy::Heuristic;
+  llvm::PBQP::RegAlloc::TreeDecompositionOptions tree_decomposition;
+  llvm::PBQP::RegAlloc::BranchAndBoundOptions branch_and_bound;
+  llvm::PBQP::RegAlloc::LocalSearchOptions local_search;
+  PortfolioOptions portfolio;
+};
+
+// Whether a solve with `options` has been asked to stop early, through the
+// cancel flag of any of its solvers, and so may have returned a worse
+// solution than it would have otherwise.
+bool isSolveCancelled(const SolverOptions &options) {
+  for (const std::atomic<bool> *cancel :
+       {options.tree_decomposition.Cancel, options.branch_and_bound.Cancel,
+        options.local_search.Cancel}) {
+    if (cancel && cancel->load()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The outcome of one strategy in a portfolio solve.
+struct PortfolioResult {
+  std::string strategy;
+  // Best cost the strategy found; infinite if it found nothing in time.
+  llvm::PBQP::PBQPNum cost =
+      std::numeric_limits<llvm::PBQP::PBQPNum>::infinity();
+  // Whether the strategy proved its solution optimal.
+  bool optimal = false;
+  // Number of solutions the strategy produced.
+  unsigned solutions = 0;
+};
+
+// What a solve did, for reporting.
+struct SolveReport {
+  // The strategy that produced the solution. For a portfolio solve, the
+  // strategy that won.
+  std::string strategy;
+  // Whether the solution is known to be optimal.
+  bool optimal = false;
+  llvm::PBQP::RegAlloc::TreeDecompositionStats tree_decomposition;
+  llvm::PBQP::RegAlloc::BranchAndBoundStats branch_and_bound;
+  llvm::PBQP::RegAlloc::LocalSearchStats local_search;
+  std::vector<PortfolioResult> portfolio;
+};
+
+// Rebuilds the problem being solved into a fresh graph, for strategies that
+// run several solvers, each of which consumes its own graph. Every copy must
+// add the same nodes in the same order, so that solutions agree between them.
+using GraphFactory = std::function<std::shared_ptr<PBQPRAGraph>()>;
+
+Solution solvePortfolio(PBQPRAGraph &graph, const GraphFactory &rebuild,
+                        const SolverOptions &options, SolveReport *report);
+
+// Solve `graph` with the strategy chosen by `options`. The graph may be
+// consumed by the solver. A portfolio solve also needs `rebuild`, to give
+// each of its strategies a graph of its own; without it, only the heuristic
+// runs.
+Solution solveGraph(PBQPRAGraph &graph, const SolverOptions &options,
+                    SolveReport *report = nullptr,
+                    const GraphFactory &rebuild = nullptr) {
+  SolveReport local_report;
+  if (!report) {
+    report = &local_report;
+  }
+
+  switch (options.strategy) {
+    case SolverStrategy::TreeDecomposition: {
+      Solution solution = llvm::PBQP::RegAlloc::solve(
+          graph, options.tree_decomposition, &report->tree_decomposition);
+      report->optimal = report->tree_decomposition.Exact;
+      report->strategy =
+          report->optimal ? "tree-decomposition" : "heuristic";
+      return solution;
+    }
+    case SolverStrategy::BranchAndBound: {
+      Solution solution = llvm::PBQP::RegAlloc::solve(
+          graph, options.branch_and_bound, &report->branch_and_bound);
+      report->optimal = report->branch_and_bound.Proven;
+      report->strategy = "branch-and-bound";
+      return solution;
+    }
+    case SolverStrategy::LocalSearch: {
+      Solution solution = llvm::PBQP::RegAlloc::solve(
+          graph, options.local_search, &report->local_search);
+      report->strategy = "local search";
+      return solution;
+    }
+    case SolverStrategy::Portfolio:
+      return solvePortfolio(graph, rebuild, options, report);
+    case SolverStrategy::Heuristic:
+    default:
+      report->strategy = "heuristic";
+      return llvm::PBQP::RegAlloc::solve(graph);
+  }
+}
+
+// Run the heuristic, the exact solvers, local search and randomized restarts
+// of the heuristic concurrently, and return the cheapest solution found when
+// they have all finished or the budget runs out. Ties go to the strategy listed
+// first, so the plain heuristic's answer is kept unless something beats it.
+//
+// A strategy that proves its solution optimal stops the others early. The
+// search-based strategies stop at the deadline; the heuristic itself cannot
+// be interrupted, but is fast.
+Solution solvePortfolio(PBQPRAGraph &graph, const GraphFactory &rebuild,
+                        const SolverOptions &options, SolveReport *report) {
+  using llvm::PBQP::PBQPNum;
+  using llvm::PBQP::RegAlloc::CostView;
+  using clock = std::chrono::steady_clock;
+  constexpr PBQPNum infinity = std::numeric_limits<PBQPNum>::infinity();
+
+  auto deadline = clock::now() +
+                  std::chrono::duration_cast<clock::duration>(
+                      std::chrono::duration<double>(options.portfolio.budget));
+  std::atomic<bool> stop{false};
+
+  std::mutex mutex;
+  std::condition_variable finished;
+  unsigned running = 0;
+  Solution best;
+  PBQPNum best_cost = infinity;
+  unsigned best_rank = ~0u;
+  PBQPNum proven_cost = -infinity;
+  bool proven = false;
+  std::vector<PortfolioResult> results;
+
+  // Record a solution from the strategy at `rank`, with its cost as
+  // evaluated on an unsolved copy of the graph.
+  auto offer = [&](unsigned rank, const Solution &solution, PBQPNum cost,
+                   bool optimal) {
+    if (std::isnan(cost)) {
+      cost = infinity;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &result = results[rank];
+    ++result.solutions;
+    if (result.solutions == 1 || cost < result.cost) {
+      result.cost = cost;
+    }
+    if (optimal) {
+      result.optimal = true;
+      proven = true;
+      proven_cost = cost;
+      stop = true;
+    }
+    if (best_rank == ~0u || cost < best_cost ||
+        (cost == best_cost && rank < best_rank)) {
+      best = solution;
+      best_cost = cost;
+      best_rank = rank;
+    }
+  };
+
+  // Seeds for the randomized restarts, which run after the strategies are
+  // set up, so it must outlive this function's inner scopes.
+  std::atomic<uint64_t> next_seed{1};
+  std::vector<std::function<void(unsigned)>> strategies;
+  auto add_strategy = [&](const char *name, std::function<void(unsigned)> run) {
+    results.push_back({name});
+    strategies.push_back(std::move(run));
+  };
+
+  add_strategy("heuristic", [&](unsigned rank) {
+    CostView view(graph);
+    Solution solution = llvm::PBQP::RegAlloc::solve(graph);
+    offer(rank, solution, view.getCost(solution), false);
+  });
+
+  if (rebuild) {
+    add_strategy("tree-decomposition", [&](unsigned rank) {
+      auto copy = rebuild();
+      CostView view(*copy);
+      auto td_options = options.tree_decomposition;
+      td_options.Cancel = &stop;
+      llvm::PBQP::RegAlloc::TreeDecompositionStats stats;
+      Solution solution =
+          llvm::PBQP::RegAlloc::solve(*copy, td_options, &stats);
+      if (stats.Exact) {
+        offer(rank, solution, view.getCost(solution), true);
+      }
+    });
+
+    add_strategy("branch-and-bound", [&](unsigned rank) {
+      auto copy = rebuild();
+      CostView view(*copy);
+      auto bnb_options = options.branch_and_bound;
+      bnb_options.Threads = 1;
+      bnb_options.TimeLimit = options.portfolio.budget;
+      bnb_options.Cancel = &stop;
+      llvm::PBQP::RegAlloc::BranchAndBoundStats stats;
+      Solution solution =
+          llvm::PBQP::RegAlloc::solve(*copy, bnb_options, &stats);
+      offer(rank, solution, view.getCost(solution), stats.Proven);
+    });
+
+    add_strategy("local search", [&](unsigned rank) {
+      auto copy = rebuild();
+      CostView view(*copy);
+      auto ls_options = options.local_search;
+      ls_options.TimeLimit = options.portfolio.budget;
+      ls_options.Cancel = &stop;
+      Solution solution = llvm::PBQP::RegAlloc::solve(*copy, ls_options);
+      offer(rank, solution, view.getCost(solution), false);
+    });
+
+    for (unsigned i = 0; i < options.portfolio.restart_threads; ++i) {
+      add_strategy("randomized restarts", [&](unsigned rank) {
+        while (!stop && clock::now() < deadline) {
+          auto copy = rebuild();
+          CostView view(*copy);
+          Solution solution =
+              llvm::PBQP::RegAlloc::solveRandomized(*copy, next_seed++);
+          offer(rank, solution, view.getCost(solution), false);
+        }
+      });
+    }
+  }
+
+  std::vector<std::thread> threads;
+  running = strategies.size();
+  for (unsigned rank = 0; rank < strategies.size(); ++rank) {
+    threads.emplace_back([&, rank] {
+      strategies[rank](rank);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--running == 0) {
+        finished.notify_all();
+      }
+    });
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait_until(lock, deadline, [&] { return running == 0; });
+  }
+  stop = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  report->strategy = results[best_rank].strategy;
+  report->optimal = proven && !(proven_cost < best_cost);
+  report->portfolio = std::move(results);
+  return best;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed-size thread pool where each worker owns a task deque. Workers pop
+// from the back of their own deque and, once it is empty, steal from the
+// front of the other workers' deques, so uneven task sizes (short jigs next
+// to long medleys) still keep every core busy.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(unsigned num_threads = 0) {
+    if (num_threads == 0) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+      queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+      workers.emplace_back([this, i] { workerLoop(i); });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  ~WorkStealingPool() {
+    wait();
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      shutting_down = true;
+    }
+    work_available.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  unsigned size() const { return workers.size(); }
+
+  // Queue a task. Tasks submitted from inside a worker go to that worker's
+  // own deque; others are distributed round-robin.
+  void submit(std::function<void()> task) {
+    unsigned target = current_worker != nullptr && current_worker->pool == this
+                          ? current_worker->index
+                          : next_queue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(queues[target]->mutex);
+      queues[target]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      ++pending;
+      ++queued;
+    }
+    work_available.notify_one();
+  }
+
+  // Block until every submitted task has finished. Must not be called from
+  // inside a task.
+  void wait() {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    all_done.wait(lock, [this] { return pending == 0; });
+  }
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  struct WorkerIdentity {
+    const WorkStealingPool *pool;
+    unsigned index;
+  };
+
+  bool popLocal(unsigned index, std::function<void()> &task) {
+    auto &queue = *queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(unsigned thief, std::function<void()> &task) {
+    for (unsigned i = 1; i < queues.size(); ++i) {
+      auto &queue = *queues[(thief + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void workerLoop(unsigned index) {
+    WorkerIdentity identity{this, index};
+    current_worker = &identity;
+
+    while (true) {
+      std::function<void()> task;
+      if (popLocal(index, task) || steal(index, task)) {
+        {
+          std::lock_guard<std::mutex> lock(state_mutex);
+          --queued;
+        }
+        task();
+        std::lock_guard<std::mutex> lock(state_mutex);
+        if (--pending == 0) {
+          all_done.notify_all();
+        }
+        continue;
+      }
+
+      // A task is pushed before `queued` is bumped, so a worker that sees
+      // queued > 0 here will find it on the next pass.
+      std::unique_lock<std::mutex> lock(state_mutex);
+      work_available.wait(lock,
+                          [this] { return shutting_down || queued > 0; });
+      if (shutting_down && queued == 0) {
+        break;
+      }
+    }
+    current_worker = nullptr;
+  }
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<unsigned> next_queue{0};
+
+  std::mutex state_mutex;
+  std::condition_variable work_available;
+  std::condition_variable all_done;
+  unsigned pending = 0;
+  int queued = 0;
+  bool shutting_down = false;
+
+  static inline thread_local WorkerIdentity *current_worker = nullptr;
+};
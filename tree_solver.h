@@ -0,0 +1,466 @@
+#pragma once
+
+#include "solver.h"
+#include "solver_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <queue>
+#include <vector>
+
+namespace llvm {
+namespace PBQP {
+namespace RegAlloc {
+
+struct TreeDecompositionOptions {
+  /// Largest tree-width for which the exact solver is used.
+  unsigned MaxWidth = 3;
+  /// Largest total number of DP table entries (one PBQPNum each) the exact
+  /// solver may allocate.
+  uint64_t MaxTableEntries = uint64_t(1) << 24;
+  /// If set, abandon the exact solve once this becomes true.
+  const std::atomic<bool> *Cancel = nullptr;
+};
+
+struct TreeDecompositionStats {
+  /// Width of the tree decomposition. If the decomposition was abandoned
+  /// because it grew too wide, this is the first width that exceeded the
+  /// limit, and so only a lower bound on the true width of the ordering.
+  unsigned Width = 0;
+  uint64_t TableEntries = 0;
+  /// Whether the exact solver was used, rather than the heuristic fallback.
+  bool Exact = false;
+  /// Whether the exact solve was cancelled part way through.
+  bool Cancelled = false;
+};
+
+/// A solution, as the option selected for each node in the order of the
+/// graph's nodeIds(), and its total cost.
+struct RankedSolution {
+  PBQPNum Cost;
+  std::vector<unsigned> Selections;
+};
+
+/// Exact PBQP solver by min-sum dynamic programming (bucket elimination) over
+/// a tree decomposition of the graph.
+///
+/// A greedy min-degree elimination order induces the tree decomposition: the
+/// bag of each node is the node plus its not-yet-eliminated neighbours (its
+/// separator) at the time it is eliminated. Eliminating a node produces a
+/// table over its separator holding the minimum cost of everything
+/// eliminated so far, for each assignment of the separator. Solutions are
+/// recovered by walking the order backwards, re-evaluating each node's
+/// bucket against its already-assigned separator.
+///
+/// Tunes give graphs close to a banded chain, whose width is small, so this
+/// is practical where it matters and provably optimal. Infinite costs are
+/// respected, and a sum of opposite infinities is treated as infeasible.
+class TreeDecompositionSolver {
+public:
+  TreeDecompositionSolver(const PBQPRAGraph &G) : View(G) {}
+
+  /// Compute an elimination order. Returns false, leaving the solver
+  /// unusable, if its width or table size exceeds the given limits.
+  bool decompose(const TreeDecompositionOptions &Opts) {
+    unsigned N = View.getNumNodes();
+    std::vector<std::vector<unsigned>> Nbrs(N);
+    for (unsigned I = 0; I < N; ++I) {
+      for (const auto &A : View.adj(I))
+        Nbrs[I].push_back(A.Other);
+      std::sort(Nbrs[I].begin(), Nbrs[I].end());
+      Nbrs[I].erase(std::unique(Nbrs[I].begin(), Nbrs[I].end()),
+                    Nbrs[I].end());
+    }
+
+    using DegreeEntry = std::pair<unsigned, unsigned>;
+    std::priority_queue<DegreeEntry, std::vector<DegreeEntry>,
+                        std::greater<DegreeEntry>>
+        Queue;
+    for (unsigned I = 0; I < N; ++I)
+      Queue.push({(unsigned)Nbrs[I].size(), I});
+
+    Order.clear();
+    Position.assign(N, 0);
+    Separators.assign(N, {});
+    std::vector<bool> Eliminated(N, false);
+    Width = 0;
+    while (!Queue.empty()) {
+      auto [Degree, X] = Queue.top();
+      Queue.pop();
+      if (Eliminated[X] || Degree != Nbrs[X].size())
+        continue;
+
+      Width = std::max(Width, Degree);
+      if (Width > Opts.MaxWidth)
+        return false;
+
+      Eliminated[X] = true;
+      Position[X] = Order.size();
+      Order.push_back(X);
+      Separators[X] = std::move(Nbrs[X]);
+
+      // Make the separator a clique, and drop X from its members.
+      const auto &Sep = Separators[X];
+      for (unsigned U : Sep) {
+        auto &UNbrs = Nbrs[U];
+        std::vector<unsigned> Merged;
+        Merged.reserve(UNbrs.size() + Sep.size());
+        std::set_union(UNbrs.begin(), UNbrs.end(), Sep.begin(), Sep.end(),
+                       std::back_inserter(Merged));
+        Merged.erase(std::remove_if(Merged.begin(), Merged.end(),
+                                    [&](unsigned V) {
+                                      return V == U || V == X;
+                                    }),
+                     Merged.end());
+        UNbrs = std::move(Merged);
+        Queue.push({(unsigned)UNbrs.size(), U});
+      }
+    }
+
+    TableEntries = 0;
+    for (unsigned X = 0; X < N; ++X) {
+      uint64_t Entries = 1;
+      for (unsigned Y : Separators[X])
+        Entries *= View.getNumOptions(Y);
+      TableEntries += Entries;
+      if (TableEntries > Opts.MaxTableEntries)
+        return false;
+    }
+    return true;
+  }
+
+  unsigned getWidth() const { return Width; }
+  uint64_t getTableEntries() const { return TableEntries; }
+
+  /// Solve the decomposed problem exactly. Returns false, leaving S
+  /// unchanged, if Cancel became true first.
+  bool solve(Solution &S, const std::atomic<bool> *Cancel = nullptr) {
+    if (!computeTables(Cancel))
+      return false;
+    std::vector<unsigned> Sel(View.getNumNodes(), 0);
+    std::vector<PBQPNum> Costs;
+    for (unsigned I = Order.size(); I-- > 0;) {
+      unsigned X = Order[I];
+      evaluateBucket(X, Sel, Costs);
+      Sel[X] = argMin(Costs);
+    }
+    S = View.getSolution(Sel);
+    return true;
+  }
+
+  /// Find the K cheapest distinct solutions of the decomposed problem,
+  /// cheapest first. Fewer are returned if there are fewer feasible
+  /// solutions. The optimal one is always returned, and is the only one if
+  /// its cost is infinite. Returns false, leaving Solutions unchanged, if
+  /// Cancel became true first.
+  ///
+  /// Solutions are enumerated by Lawler-style partitioning of the backward
+  /// walk that recovers the optimal solution. Each solution after the first
+  /// copies the options of some earlier solution for the nodes above a
+  /// position in the order, takes the next-cheapest option at that
+  /// position, and then follows the cheapest option at every node below.
+  /// Because the tables hold the exact minimum cost of everything below a
+  /// node, the cost of each such solution is known before it is walked, so
+  /// the candidates can be kept in a priority queue and each is walked only
+  /// once it is the cheapest left. The tables are computed once, so each
+  /// solution costs about one backward walk, rather than a whole solve. No
+  /// solution queues more alternatives than there are solutions left to
+  /// find, which bounds the queue by K^2 however large the graph.
+  bool solveKBest(unsigned K, std::vector<RankedSolution> &Solutions,
+                  const std::atomic<bool> *Cancel = nullptr) {
+    if (K == 0) {
+      Solutions.clear();
+      return true;
+    }
+    if (!computeTables(Cancel))
+      return false;
+
+    // A candidate solution: Parent's options above Pos, the option of rank
+    // Rank at Pos, and the cheapest options below. The first solution has
+    // no parent and starts at the top of the order.
+    struct Candidate {
+      double Cost;
+      unsigned Parent;
+      unsigned Pos;
+      unsigned Rank;
+      bool operator>(const Candidate &Other) const {
+        return Cost > Other.Cost;
+      }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>,
+                        std::greater<Candidate>>
+        Queue;
+    // The options and cost of each solution found so far.
+    std::vector<std::vector<unsigned>> Found;
+    std::vector<double> FoundCosts;
+
+    unsigned N = View.getNumNodes();
+    Queue.push({getOptimalCost(), ~0u, (unsigned)Order.size(), 0});
+    std::vector<PBQPNum> Costs;
+    std::vector<unsigned> Ranked;
+    std::vector<std::pair<double, unsigned>> Deviations;
+    while (!Queue.empty() && Found.size() < K) {
+      if (Cancel && Cancel->load())
+        return false;
+      Candidate C = Queue.top();
+      Queue.pop();
+      bool Root = C.Parent == ~0u;
+      std::vector<unsigned> Sel =
+          Root ? std::vector<unsigned>(N, 0) : Found[C.Parent];
+      unsigned Self = Found.size();
+      // Nothing follows the last solution, or an infeasible optimum.
+      bool Expand = Self + 1 < K && std::isfinite(C.Cost);
+
+      if (!Root) {
+        // The parent took the cheapest option at Pos; take the next one,
+        // and queue the one after that.
+        unsigned X = Order[C.Pos];
+        evaluateBucket(X, Sel, Costs);
+        rankOptions(Costs, Ranked);
+        Sel[X] = Ranked[C.Rank];
+        if (C.Rank + 1 < Ranked.size()) {
+          PBQPNum Next = Costs[Ranked[C.Rank + 1]];
+          if (Next != infinity())
+            Queue.push({FoundCosts[C.Parent] + (Next - Costs[Ranked[0]]),
+                        C.Parent, C.Pos, C.Rank + 1});
+        }
+      }
+
+      // Walk down from Pos, noting the second-cheapest option at each node
+      // as a deviation from this solution.
+      Deviations.clear();
+      for (unsigned I = C.Pos; I-- > 0;) {
+        unsigned X = Order[I];
+        evaluateBucket(X, Sel, Costs);
+        unsigned Best = argMin(Costs);
+        Sel[X] = Best;
+        if (!Expand || Costs.size() < 2)
+          continue;
+        unsigned Second = Best == 0 ? 1 : 0;
+        for (unsigned V = Second + 1; V < Costs.size(); ++V)
+          if (V != Best && Costs[V] < Costs[Second])
+            Second = V;
+        if (Costs[Second] != infinity())
+          Deviations.push_back({C.Cost + (Costs[Second] - Costs[Best]), I});
+      }
+      unsigned Left = Expand ? K - Self - 1 : 0;
+      if (Deviations.size() > Left) {
+        std::nth_element(Deviations.begin(), Deviations.begin() + Left,
+                         Deviations.end());
+        Deviations.resize(Left);
+      }
+      for (const auto &[Cost, Pos] : Deviations)
+        Queue.push({Cost, Self, Pos, 1});
+      Found.push_back(std::move(Sel));
+      FoundCosts.push_back(C.Cost);
+    }
+
+    Solutions.clear();
+    for (auto &Sel : Found) {
+      PBQPNum Cost = View.getCost(Sel);
+      Solutions.push_back({Cost, std::move(Sel)});
+    }
+    return true;
+  }
+
+  /// The cost of the optimal solution. Valid after solve().
+  PBQPNum getOptimalCost() const {
+    PBQPNum Cost = 0;
+    for (unsigned X : Order)
+      if (Separators[X].empty())
+        Cost += Tables[X][0];
+    return Cost;
+  }
+
+private:
+  static PBQPNum infinity() { return std::numeric_limits<PBQPNum>::infinity(); }
+
+  static unsigned argMin(const std::vector<PBQPNum> &Costs) {
+    unsigned Best = 0;
+    PBQPNum Min = infinity();
+    for (unsigned V = 0; V < Costs.size(); ++V) {
+      if (Costs[V] < Min) {
+        Min = Costs[V];
+        Best = V;
+      }
+    }
+    return Best;
+  }
+
+  /// The options in increasing order of cost, ties going to the lower
+  /// option, so that the first is the one argMin picks.
+  static void rankOptions(const std::vector<PBQPNum> &Costs,
+                          std::vector<unsigned> &Ranked) {
+    Ranked.resize(Costs.size());
+    for (unsigned V = 0; V < Costs.size(); ++V)
+      Ranked[V] = V;
+    std::stable_sort(
+        Ranked.begin(), Ranked.end(),
+        [&](unsigned A, unsigned B) { return Costs[A] < Costs[B]; });
+  }
+
+  /// Index into the table of node J for the assignment Sel of its separator.
+  uint64_t tableIndex(unsigned J, const std::vector<unsigned> &Sel) const {
+    uint64_t Idx = 0;
+    for (unsigned K = 0; K < Separators[J].size(); ++K)
+      Idx += Sel[Separators[J][K]] * Strides[J][K];
+    return Idx;
+  }
+
+  /// Cost of each option of X, given the options in Sel of every node in X's
+  /// separator, including everything already eliminated below X.
+  void evaluateBucket(unsigned X, std::vector<unsigned> &Sel,
+                      std::vector<PBQPNum> &Costs) const {
+    const Vector &NodeCosts = View.getNodeCosts(X);
+    unsigned NumOpts = NodeCosts.getLength();
+    Costs.assign(&NodeCosts[0], &NodeCosts[0] + NumOpts);
+
+    for (const auto &A : View.adj(X)) {
+      if (Position[A.Other] < Position[X])
+        continue;
+      for (unsigned V = 0; V < NumOpts; ++V)
+        Costs[V] += CostView::getEdgeCost(A, V, Sel[A.Other]);
+    }
+
+    for (unsigned J : Incoming[X]) {
+      // X is in J's separator; find its stride and the offset of the rest.
+      const auto &Sep = Separators[J];
+      unsigned XPos = std::find(Sep.begin(), Sep.end(), X) - Sep.begin();
+      unsigned Saved = Sel[X];
+      Sel[X] = 0;
+      uint64_t Base = tableIndex(J, Sel);
+      Sel[X] = Saved;
+      uint64_t Stride = Strides[J][XPos];
+      for (unsigned V = 0; V < NumOpts; ++V)
+        Costs[V] += Tables[J][Base + V * Stride];
+    }
+
+    // A sum of opposite infinities is infeasible, not free.
+    for (auto &C : Costs)
+      if (std::isnan(C))
+        C = infinity();
+  }
+
+  bool computeTables(const std::atomic<bool> *Cancel) {
+    unsigned N = View.getNumNodes();
+    Strides.assign(N, {});
+    Incoming.assign(N, {});
+    Tables.assign(N, {});
+    for (unsigned X = 0; X < N; ++X) {
+      uint64_t Stride = 1;
+      for (unsigned Y : Separators[X]) {
+        Strides[X].push_back(Stride);
+        Stride *= View.getNumOptions(Y);
+      }
+      if (!Separators[X].empty()) {
+        unsigned Dest = *std::min_element(
+            Separators[X].begin(), Separators[X].end(),
+            [&](unsigned A, unsigned B) { return Position[A] < Position[B]; });
+        Incoming[Dest].push_back(X);
+      }
+    }
+
+    std::vector<unsigned> Sel(N, 0);
+    std::vector<PBQPNum> Costs;
+    for (unsigned X : Order) {
+      if (Cancel && Cancel->load())
+        return false;
+      const auto &Sep = Separators[X];
+      uint64_t Entries = 1;
+      for (unsigned Y : Sep)
+        Entries *= View.getNumOptions(Y);
+      auto &Table = Tables[X];
+      Table.resize(Entries);
+
+      // Enumerate separator assignments with the first member varying
+      // fastest, matching the strides.
+      for (unsigned Y : Sep)
+        Sel[Y] = 0;
+      for (uint64_t Idx = 0; Idx < Entries; ++Idx) {
+        evaluateBucket(X, Sel, Costs);
+        Table[Idx] = Costs[argMin(Costs)];
+        for (unsigned Y : Sep) {
+          if (++Sel[Y] < View.getNumOptions(Y))
+            break;
+          Sel[Y] = 0;
+        }
+      }
+    }
+    return true;
+  }
+
+  CostView View;
+  std::vector<unsigned> Order;
+  std::vector<unsigned> Position;
+  std::vector<std::vector<unsigned>> Separators;
+  std::vector<std::vector<uint64_t>> Strides;
+  std::vector<std::vector<unsigned>> Incoming;
+  std::vector<std::vector<PBQPNum>> Tables;
+  unsigned Width = 0;
+  uint64_t TableEntries = 0;
+};
+
+/// Solve G exactly by dynamic programming over a tree decomposition when its
+/// width and table size are within Opts, and with the reduction heuristic
+/// otherwise (including when the exact solve is cancelled).
+inline Solution solve(PBQPRAGraph &G, const TreeDecompositionOptions &Opts,
+                      TreeDecompositionStats *Stats = nullptr) {
+  if (G.empty())
+    return Solution();
+
+  TreeDecompositionSolver TDSolver(G);
+  bool Exact = TDSolver.decompose(Opts);
+  if (Stats) {
+    Stats->Width = TDSolver.getWidth();
+    Stats->TableEntries = Exact ? TDSolver.getTableEntries() : 0;
+    Stats->Exact = Exact;
+  }
+  Solution S;
+  if (Exact && TDSolver.solve(S, Opts.Cancel))
+    return S;
+  if (Stats) {
+    Stats->Cancelled = Exact;
+    Stats->Exact = false;
+  }
+  return solve(G);
+}
+
+/// Find up to K of the cheapest distinct solutions of G, cheapest first, by
+/// dynamic programming over a tree decomposition when its width and table
+/// size are within Opts. Otherwise, or if the solve is cancelled, only the
+/// reduction heuristic's solution is returned, and Stats says so.
+inline std::vector<RankedSolution>
+solveKBest(PBQPRAGraph &G, unsigned K, const TreeDecompositionOptions &Opts,
+           TreeDecompositionStats *Stats = nullptr) {
+  std::vector<RankedSolution> Solutions;
+  if (G.empty() || K == 0)
+    return Solutions;
+
+  TreeDecompositionSolver TDSolver(G);
+  bool Exact = TDSolver.decompose(Opts);
+  if (Stats) {
+    Stats->Width = TDSolver.getWidth();
+    Stats->TableEntries = Exact ? TDSolver.getTableEntries() : 0;
+    Stats->Exact = Exact;
+  }
+  if (Exact && TDSolver.solveKBest(K, Solutions, Opts.Cancel))
+    return Solutions;
+  if (Stats) {
+    Stats->Cancelled = Exact;
+    Stats->Exact = false;
+  }
+  CostView View(G);
+  Solution S = solve(G);
+  std::vector<unsigned> Sel(View.getNumNodes());
+  for (unsigned N = 0; N < Sel.size(); ++N)
+    Sel[N] = S.getSelection(View.getNodeId(N));
+  Solutions.push_back({View.getCost(Sel), std::move(Sel)});
+  return Solutions;
+}
+
+} // end namespace RegAlloc
+} // end namespace PBQP
+} // end namespace llvm
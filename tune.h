@@ -0,0 +1,412 @@
+#pragma once
+
+#include "concertina.h"
+#include "graph.h"
+#include "solver_utils.h"
+#include "solvers.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <vector>
+
+std::optional<ConcertinaNote> midi2note(uint8_t n) {
+  switch (n) {
+    case 84: return ConcertinaNote::C5;
+    case 83: return ConcertinaNote::B5;
+    case 81: return ConcertinaNote::A5;
+    case 80: return ConcertinaNote::Gsharp5;
+    case 79: return ConcertinaNote::G5;
+    case 78: return ConcertinaNote::Fsharp5;
+    case 77: return ConcertinaNote::F5;
+    case 76: return ConcertinaNote::E5;
+    case 75: return ConcertinaNote::Dsharp5;
+    case 74: return ConcertinaNote::D5;
+    case 73: return ConcertinaNote::Csharp5;
+    case 72: return ConcertinaNote::C5;
+    case 71: return ConcertinaNote::B4;
+    case 70: return ConcertinaNote::Bflat4;
+    case 69: return ConcertinaNote::A4;
+    case 68: return ConcertinaNote::Gsharp4;
+    case 67: return ConcertinaNote::G4;
+    case 66: return ConcertinaNote::Fsharp4;
+    case 65: return ConcertinaNote::F4;
+    case 64: return ConcertinaNote::E4;
+    case 63: return ConcertinaNote::Dsharp4;
+    case 62: return ConcertinaNote::D4;
+    case 61: return ConcertinaNote::Csharp4;
+    case 60: return ConcertinaNote::C4;
+    case 59: return ConcertinaNote::B3;
+    case 58: return ConcertinaNote::Bflat3;
+    case 57: return ConcertinaNote::A3;
+    case 55: return ConcertinaNote::G3;
+    case 54: return ConcertinaNote::Fsharp3;
+    case 53: return ConcertinaNote::F3;
+    case 52: return ConcertinaNote::E3;
+    case 48: return ConcertinaNote::C3;
+    case 43: return ConcertinaNote::G2;
+    case 38: return ConcertinaNote::D2;
+    case 36: return ConcertinaNote::C2;
+    default: return std::nullopt;
+  }
+}
+
+// Whether MIDI pitch `pitch` is mapped by midi2note and can be played
+// somewhere on `layout`. Pitches outside 0-127 cannot.
+bool isPlayablePitch(int pitch, const ConcertinaLayout &layout) {
+  if (pitch < 0 || pitch > 127) {
+    return false;
+  }
+  auto mapped = midi2note(pitch);
+  return mapped && layout[*mapped].num_options > 0;
+}
+
+struct TuneNote {
+  uint8_t pitch;
+  int tick;
+};
+
+// A constraint between two notes of a tune. Edges always point forwards in
+// time: `from` < `to`.
+struct TuneEdge {
+  unsigned from;
+  unsigned to;
+  EdgeKind kind;
+};
+
+// The onset window TuneBuilder uses by default, and the length of a tick
+// until a reader sets it: 480 ticks to a beat at 120 beats per minute.
+constexpr double kDefaultOnsetWindowMs = 12;
+constexpr double kDefaultTickSeconds = 0.5 / 480;
+
+// A tune reduced to what the fingering problem needs: its notes in onset
+// order, and the simultaneous/sequential constraints between them. Unlike a
+// PBQPRAGraph, which the solver consumes, a Tune can be turned into as many
+// graphs (whole or partial) as needed.
+struct Tune {
+  std::vector<TuneNote> notes;
+  std::vector<TuneEdge> edges;
+  // Notes starting no more than this many ticks apart were built as one
+  // onset, as TuneBuilder timed its window at the tune's first note.
+  double onset_window_ticks =
+      kDefaultOnsetWindowMs / (1000 * kDefaultTickSeconds);
+};
+
+// How TuneBuilder relates the notes of a tune to one another.
+struct TuneBuilderOptions {
+  // Note events no more than this many milliseconds apart count as one
+  // onset or one release, so that chords played a little unevenly still
+  // group together.
+  double onset_window_ms = kDefaultOnsetWindowMs;
+  // A note follows at most this many of the notes that ended just before
+  // it, the latest first, and never more than kMaxSequentialLookback.
+  unsigned sequential_lookback = 8;
+};
+
+// The most notes TuneBuilder keeps sounding together, and the most that a
+// note can follow.
+constexpr unsigned kMaxSoundingNotes = 10;
+constexpr unsigned kMaxSequentialLookback = 16;
+
+// Builds a Tune from a time-ordered stream of note-on and note-off events, as
+// decoded from a MIDI file. Notes sounding together are simultaneous, and a
+// note is sequential to the notes that ended just before it started.
+//
+// The builder sweeps through the events holding two small fixed-size sets:
+// the notes sounding, in the order they started, and the latest notes to
+// end. Each note therefore gets a bounded number of edges, and a tune is
+// built in time linear in its length however dense it is. When more than
+// kMaxSoundingNotes notes sound at once, as under a piano's sustain pedal,
+// the earliest is dropped from the set and later notes are not tied to it.
+class TuneBuilder {
+public:
+  explicit TuneBuilder(Tune &tune, const TuneBuilderOptions &options = {})
+      : tune(tune), onset_window_ms(options.onset_window_ms),
+        lookback(std::min(options.sequential_lookback,
+                          kMaxSequentialLookback)) {
+    setTickSeconds(kDefaultTickSeconds);
+  }
+
+  // Set the length of a tick, which the onset window is measured in. Readers
+  // call this with the file's timing and again at each tempo change; until
+  // then there are 480 ticks to a beat at 120 beats per minute. Lengths
+  // that aren't positive are ignored. The window in force when the first
+  // note starts is kept in the tune.
+  void setTickSeconds(double seconds) {
+    if (seconds > 0) {
+      window_ticks = onset_window_ms / (1000 * seconds);
+      if (tune.notes.empty()) {
+        tune.onset_window_ticks = window_ticks;
+      }
+    }
+  }
+
+  // Start a note, returning its index in the tune.
+  unsigned noteOn(uint8_t pitch, int tick) {
+    unsigned note_id = tune.notes.size();
+    tune.notes.push_back({pitch, tick});
+
+    for (unsigned i = 0; i < num_sounding; ++i) {
+      tune.edges.push_back({sounding[i], note_id, EdgeKind::Simultaneous});
+    }
+
+    if (num_sounding == kMaxSoundingNotes) {
+      std::copy(sounding.begin() + 1, sounding.end(), sounding.begin());
+      --num_sounding;
+    }
+    sounding[num_sounding++] = note_id;
+
+    if (last_event_was_note_on && tick - last_tick > window_ticks) {
+      num_ended = 0;
+    }
+
+    for (unsigned i = std::min(num_ended, lookback); i > 0; --i) {
+      unsigned seq_id = ended[(num_ended - i) % kMaxSequentialLookback];
+      tune.edges.push_back({seq_id, note_id, EdgeKind::Sequential});
+    }
+
+    last_event_was_note_on = true;
+    last_tick = tick;
+    return note_id;
+  }
+
+  // End the note with index `note_id`.
+  void noteOff(unsigned note_id, int tick) {
+    auto sounding_end = sounding.begin() + num_sounding;
+    auto found = std::find(sounding.begin(), sounding_end, note_id);
+    if (found != sounding_end) {
+      std::copy(found + 1, sounding_end, found);
+      --num_sounding;
+    }
+
+    if (tick - last_tick > window_ticks) {
+      num_ended = 0;
+    }
+
+    ended[num_ended++ % kMaxSequentialLookback] = note_id;
+    last_event_was_note_on = false;
+    last_tick = tick;
+  }
+
+private:
+  Tune &tune;
+  double onset_window_ms;
+  unsigned lookback;
+  double window_ticks = 0;
+  // The notes sounding, earliest first.
+  std::array<unsigned, kMaxSoundingNotes> sounding;
+  unsigned num_sounding = 0;
+  // The notes ended since the last gap, as a ring buffer of the latest.
+  std::array<unsigned, kMaxSequentialLookback> ended;
+  unsigned num_ended = 0;
+  int last_tick = 0;
+  bool last_event_was_note_on = false;
+};
+
+// The number of edges of each kind in `tune`, indexed by EdgeKind.
+std::array<size_t, size_t(EdgeKind::MaxEdgeKind)>
+countTuneEdges(const Tune &tune) {
+  std::array<size_t, size_t(EdgeKind::MaxEdgeKind)> counts{};
+  for (const auto &edge : tune.edges) {
+    ++counts[size_t(edge.kind)];
+  }
+  return counts;
+}
+
+// The notes still waiting for a note-off, by channel and key. A note-off ends
+// the latest of them, as MidiFile::linkNotePairs pairs events. Each key's
+// waiting notes are a stack threaded through an array indexed by note, so
+// pairing is a couple of array accesses rather than a hash lookup per event.
+class NoteOnStacks {
+public:
+  void noteOn(uint8_t channel, uint8_t key, unsigned note_id) {
+    if (below.size() <= note_id) {
+      below.resize(note_id + 1, none);
+    }
+    unsigned &top = latest[slot(channel, key)];
+    below[note_id] = top;
+    top = note_id;
+  }
+
+  // The note ended by a note-off, if one is waiting.
+  std::optional<unsigned> noteOff(uint8_t channel, uint8_t key) {
+    unsigned &top = latest[slot(channel, key)];
+    if (top == none) {
+      return std::nullopt;
+    }
+    unsigned note_id = top;
+    top = below[note_id];
+    return note_id;
+  }
+
+private:
+  static constexpr unsigned none = ~0u;
+
+  static unsigned slot(uint8_t channel, uint8_t key) {
+    return (channel & 0xf) * 128 + (key & 0x7f);
+  }
+
+  std::vector<unsigned> latest = std::vector<unsigned>(16 * 128, none);
+  std::vector<unsigned> below;
+};
+
+ConcertinaNote getTuneNote(const Tune &tune, unsigned i) {
+  return *midi2note(tune.notes[i].pitch);
+}
+
+auto addNoteEdge(ConcertinaGraph &graph, PBQPRAGraph::NodeId n1id,
+                 PBQPRAGraph::NodeId n2id, EdgeKind kind) {
+  switch (kind) {
+    case EdgeKind::Simultaneous:
+      return addSimultaneousNoteEdge(graph, n1id, n2id);
+    case EdgeKind::Sequential:
+      return addSequentialNoteEdge(graph, n1id, n2id);
+    default:
+      return addSequentialAndSimultaneousNoteEdge(graph, n1id, n2id);
+  }
+}
+
+// Add every note and edge of `tune` to `graph`, returning the node for each
+// note. All of the tune's pitches must be mapped by midi2note.
+std::vector<PBQPRAGraph::NodeId> buildTuneGraph(ConcertinaGraph &graph,
+                                                const Tune &tune) {
+  PBQP_TRACE_SCOPE("build");
+  std::vector<PBQPRAGraph::NodeId> node_ids;
+  node_ids.reserve(tune.notes.size());
+  graph.node_notes.reserve(graph.node_notes.size() + tune.notes.size());
+  for (unsigned i = 0; i < tune.notes.size(); ++i) {
+    node_ids.push_back(addNote(graph, getTuneNote(tune, i)));
+  }
+  for (const auto &edge : tune.edges) {
+    addNoteEdge(graph, node_ids[edge.from], node_ids[edge.to], edge.kind);
+  }
+  return node_ids;
+}
+
+// Solve `tune` as a single graph built in `g`, which is cleared first,
+// returning the selected option index for each note. Reusing a graph reuses
+// the costs it has already built for the layout.
+std::vector<unsigned> solveTune(ConcertinaGraph &g, const Tune &tune,
+                                const SolverOptions &options = {},
+                                SolveReport *report = nullptr) {
+  g.clear();
+  const ConcertinaLayout &layout = *g.layout;
+  auto node_ids = buildTuneGraph(g, tune);
+  auto rebuild = [&tune, &layout] {
+    auto copy = std::make_shared<ConcertinaGraph>(layout);
+    buildTuneGraph(*copy, tune);
+    return std::shared_ptr<PBQPRAGraph>(copy, &copy->graph);
+  };
+  Solution solution = solveGraph(g.graph, options, report, rebuild);
+
+  std::vector<unsigned> selections;
+  selections.reserve(node_ids.size());
+  for (auto nid : node_ids) {
+    selections.push_back(solution.getSelection(nid));
+  }
+  return selections;
+}
+
+// Solve `tune` as a single graph on `layout`, returning the selected option
+// index for each note.
+std::vector<unsigned>
+solveTune(const Tune &tune, const SolverOptions &options = {},
+          SolveReport *report = nullptr,
+          const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  ConcertinaGraph g(layout);
+  return solveTune(g, tune, options, report);
+}
+
+// A fingering of a tune, as a selected option index per note, and its cost.
+struct TuneFingering {
+  llvm::PBQP::PBQPNum cost;
+  std::vector<unsigned> selections;
+};
+
+// The `count` cheapest distinct fingerings of `tune` on `layout`, cheapest
+// first, found exactly by dynamic programming over a tree decomposition of
+// its graph. Fewer are returned if the tune has fewer playable fingerings.
+// If the decomposition is too wide for `options`, or the solve is
+// cancelled, only the heuristic's fingering is returned, and `stats` says
+// so.
+std::vector<TuneFingering> solveTuneAlternatives(
+    const Tune &tune, unsigned count,
+    const llvm::PBQP::RegAlloc::TreeDecompositionOptions &options,
+    llvm::PBQP::RegAlloc::TreeDecompositionStats *stats = nullptr,
+    const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  ConcertinaGraph g(layout);
+  auto node_ids = buildTuneGraph(g, tune);
+  // Solutions list nodes in node id order, which needn't be note order.
+  std::vector<unsigned> node_index;
+  unsigned index = 0;
+  for (auto nid : g.graph.nodeIds()) {
+    node_index.resize(std::max<size_t>(node_index.size(), nid + 1));
+    node_index[nid] = index++;
+  }
+  auto solutions =
+      llvm::PBQP::RegAlloc::solveKBest(g.graph, count, options, stats);
+
+  std::vector<TuneFingering> fingerings;
+  fingerings.reserve(solutions.size());
+  for (const auto &solution : solutions) {
+    TuneFingering fingering{solution.Cost, {}};
+    fingering.selections.reserve(node_ids.size());
+    for (auto nid : node_ids) {
+      fingering.selections.push_back(solution.Selections[node_index[nid]]);
+    }
+    fingerings.push_back(std::move(fingering));
+  }
+  return fingerings;
+}
+
+// The total cost of a fingering of `tune` on `layout` under the PBQP cost
+// model.
+llvm::PBQP::PBQPNum
+getTuneFingeringCost(const Tune &tune, const std::vector<unsigned> &selections,
+                     const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  ConcertinaGraph g(layout);
+  auto node_ids = buildTuneGraph(g, tune);
+  Solution solution;
+  for (unsigned i = 0; i < node_ids.size(); ++i) {
+    solution.setSelection(node_ids[i], selections[i]);
+  }
+  return llvm::PBQP::RegAlloc::getSolutionCost(g.graph, solution);
+}
+
+// The cost getTuneFingeringCost gives, but infinite where that is NaN, for
+// ranking fingerings: a NaN comes of adding a unison's negative infinity to
+// an impossible pair's positive one, and the fingering is as infeasible as
+// any other with an impossible pair.
+llvm::PBQP::PBQPNum
+getRankingFingeringCost(const Tune &tune,
+                        const std::vector<unsigned> &selections,
+                        const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  auto cost = getTuneFingeringCost(tune, selections, layout);
+  return std::isnan(cost)
+             ? std::numeric_limits<llvm::PBQP::PBQPNum>::infinity()
+             : cost;
+}
+
+// Print a fingering, given as a selected option index per note, grouping
+// notes that start together onto one line.
+void printTuneFingering(FILE *out, const Tune &tune,
+                        const std::vector<unsigned> &selections,
+                        const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  int last_tick = 0;
+  bool first = true;
+  for (unsigned i = 0; i < tune.notes.size(); ++i) {
+    const auto &note = tune.notes[i];
+    if (first || note.tick - last_tick > tune.onset_window_ticks) {
+      fprintf(out, "\nTime %d:", note.tick);
+    }
+    unsigned reed = layout[getTuneNote(tune, i)].options[selections[i]];
+
+    fprintf(out, " (%s)", GetReedAndFinger(reed).c_str());
+    last_tick = note.tick;
+    first = false;
+  }
+  fprintf(out, "\n");
+}
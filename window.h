@@ -0,0 +1,119 @@
+#pragma once
+
+#include "tune.h"
+#include <algorithm>
+#include <memory>
+#include <numeric>
+
+struct WindowOptions {
+  // Number of notes in each solved window.
+  unsigned window_notes = 512;
+  // Number of trailing notes of each window that are re-solved as part of the
+  // next window rather than committed.
+  unsigned overlap_notes = 128;
+};
+
+// Solve `tune` on `layout` as a sequence of overlapping windows, returning
+// the selected option index for each note. Each window is a fresh graph, so
+// the graph, its costs and the solver's state are bounded by the window size
+// rather than the tune length.
+//
+// Memory is not bounded overall: the whole Tune is read before solving, and
+// the edge index and the selections below are over every note, so the
+// footprint still grows linearly with the tune, at a few tens of bytes a
+// note rather than the few hundred a whole-tune graph takes. For 1.6 million
+// notes the Tune takes 57 MiB, windows of 512 add 13 MiB, and a whole-tune
+// solve adds 540 MiB.
+//
+// Only the leading notes of a window are committed; the overlap is solved
+// again at the start of the next window. Edges from committed notes into a
+// window are folded into the node costs of the window's notes, using the
+// committed choices, so each window sees the fingering that precedes it.
+std::vector<unsigned>
+solveTuneWindowed(const Tune &tune, const WindowOptions &options,
+                  const SolverOptions &solver_options = {},
+                  const ConcertinaLayout &layout = CGWheatstoneLayout) {
+  unsigned num_notes = tune.notes.size();
+  unsigned window_notes = std::max(1u, options.window_notes);
+  unsigned overlap_notes = std::min(options.overlap_notes, window_notes - 1);
+
+  // Index the edges by their later note, so each window can find both its
+  // internal edges and the edges reaching back into committed notes.
+  std::vector<unsigned> edge_begin(num_notes + 1, 0);
+  for (const auto &edge : tune.edges) {
+    ++edge_begin[edge.to + 1];
+  }
+  std::partial_sum(edge_begin.begin(), edge_begin.end(), edge_begin.begin());
+  std::vector<unsigned> incoming(tune.edges.size());
+  {
+    std::vector<unsigned> cursor(edge_begin.begin(), edge_begin.end() - 1);
+    for (unsigned k = 0; k < tune.edges.size(); ++k) {
+      incoming[cursor[tune.edges[k].to]++] = k;
+    }
+  }
+
+  std::vector<unsigned> selections(num_notes);
+  unsigned start = 0;
+  while (start < num_notes) {
+    unsigned end = std::min(num_notes, start + window_notes);
+    unsigned commit =
+        end == num_notes ? end : std::max(start + 1, end - overlap_notes);
+
+    // Build the window into `g`, returning the node for each of its notes.
+    auto build_window = [&](ConcertinaGraph &g) {
+      PBQP_TRACE_SCOPE("build");
+      std::vector<PBQPRAGraph::NodeId> node_ids;
+      node_ids.reserve(end - start);
+      for (unsigned i = start; i < end; ++i) {
+        auto nid = addNote(g, getTuneNote(tune, i));
+        node_ids.push_back(nid);
+
+        std::optional<PBQPRAGraph::RawVector> conditioned;
+        for (unsigned k = edge_begin[i]; k != edge_begin[i + 1]; ++k) {
+          const TuneEdge &edge = tune.edges[incoming[k]];
+          if (edge.from >= start) {
+            continue;
+          }
+          if (!conditioned) {
+            conditioned.emplace(g.graph.getNodeCosts(nid));
+          }
+          auto from_options =
+              getNoteOptions(*g.layout, getTuneNote(tune, edge.from));
+          auto to_options = getNodeOptions(g, nid);
+          llvm::PBQP::Matrix Costs(from_options.size(), to_options.size(), 0);
+          setupNoteEdgeCosts(edge.kind, Costs, from_options, to_options);
+          *conditioned += Costs.getRowAsVector(selections[edge.from]);
+        }
+        if (conditioned) {
+          g.graph.setNodeCosts(nid, std::move(*conditioned));
+        }
+      }
+
+      for (unsigned i = start; i < end; ++i) {
+        for (unsigned k = edge_begin[i]; k != edge_begin[i + 1]; ++k) {
+          const TuneEdge &edge = tune.edges[incoming[k]];
+          if (edge.from >= start) {
+            addNoteEdge(g, node_ids[edge.from - start], node_ids[i - start],
+                        edge.kind);
+          }
+        }
+      }
+      return node_ids;
+    };
+
+    ConcertinaGraph g(layout);
+    auto node_ids = build_window(g);
+    auto rebuild = [&] {
+      auto copy = std::make_shared<ConcertinaGraph>(layout);
+      build_window(*copy);
+      return std::shared_ptr<PBQPRAGraph>(copy, &copy->graph);
+    };
+    Solution solution =
+        solveGraph(g.graph, solver_options, nullptr, rebuild);
+    for (unsigned i = start; i < commit; ++i) {
+      selections[i] = solution.getSelection(node_ids[i - start]);
+    }
+    start = commit;
+  }
+  return selections;
+}